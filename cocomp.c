@@ -9,6 +9,9 @@
 #define PAGE_SIZE 64
 #define NUM_PAGES (MEMORY_SIZE / PAGE_SIZE)
 #define INVALID_PAGE 0xFF  // Use 0xFF as the invalid page indicator
+#define HEAP_WORDS ((HEAP_SIZE + 63) / 64)  // 64-bit words in the heap bitmap
+#define HEAP_SIZE_CLASSES 17     // freed blocks of 1..16 blocks are cached by size
+#define HEAP_FREE_LIST_DEPTH 32  // cached blocks per size
 #define INPUT_LAYER_SIZE 8
 #define HIDDEN_LAYER_SIZE 16
 #define OUTPUT_LAYER_SIZE 4
@@ -39,8 +42,14 @@ typedef struct {
     int inter_process_comm[MAX_PROCESSES];
     unsigned char dynamic_code_area[MEMORY_SIZE];
     int thread_stack_pointers[MAX_THREADS];
-    // For extended memory management
-    int free_blocks[HEAP_SIZE];
+    // Heap allocator: one bit per block (set = free), the size of each live
+    // allocation at its start address, and per-size lists of freed blocks
+    // that are kept back from the bitmap for reuse
+    unsigned long long heap_bitmap[HEAP_WORDS];
+    int heap_sizes[HEAP_SIZE];
+    int heap_free_lists[HEAP_SIZE_CLASSES][HEAP_FREE_LIST_DEPTH];
+    int heap_free_list_counts[HEAP_SIZE_CLASSES];
+    int heap_search_word;  // bitmap word where the next search starts
 } Cocomp;
 
 void initialize_cocomp(Cocomp *cocomp) {
@@ -66,7 +75,13 @@ void initialize_cocomp(Cocomp *cocomp) {
     memset(cocomp->inter_process_comm, 0, sizeof(cocomp->inter_process_comm));
     memset(cocomp->dynamic_code_area, 0, sizeof(cocomp->dynamic_code_area));
     memset(cocomp->thread_stack_pointers, 0, sizeof(cocomp->thread_stack_pointers));
-    memset(cocomp->free_blocks, 1, sizeof(cocomp->free_blocks));  // Initialize free blocks as available
+    memset(cocomp->heap_bitmap, 0xFF, sizeof(cocomp->heap_bitmap));  // Initialize free blocks as available
+    if (HEAP_SIZE % 64) {
+        cocomp->heap_bitmap[HEAP_WORDS - 1] = (1ULL << (HEAP_SIZE % 64)) - 1;  // no blocks past the end
+    }
+    memset(cocomp->heap_sizes, 0, sizeof(cocomp->heap_sizes));
+    memset(cocomp->heap_free_list_counts, 0, sizeof(cocomp->heap_free_list_counts));
+    cocomp->heap_search_word = 0;
 }
 
 void print_memory(Cocomp *cocomp) {
@@ -116,39 +131,125 @@ void handle_interrupt(Cocomp *cocomp, int interrupt_code) {
     }
 }
 
-void allocate_heap(Cocomp *cocomp, int size) {
-    int start_block = -1;
-    int consecutive_free_blocks = 0;
-    for (int i = 0; i < HEAP_SIZE; i++) {
-        if (cocomp->free_blocks[i]) {
-            if (start_block == -1) start_block = i;
-            consecutive_free_blocks++;
-            if (consecutive_free_blocks == size) {
-                // Allocate blocks
-                for (int j = start_block; j < start_block + size; j++) {
-                    cocomp->free_blocks[j] = 0;
-                }
-                cocomp->heap_pointer = start_block;
-                printf("Allocated %d blocks starting at %d\n", size, start_block);
-                return;
-            }
+// Set (free) or clear (allocated) `size` bits of the heap bitmap, a word at
+// a time.
+void heap_mark(Cocomp *cocomp, int start, int size, int free) {
+    while (size > 0) {
+        int word = start / 64;
+        int bit = start % 64;
+        int count = 64 - bit < size ? 64 - bit : size;
+        unsigned long long mask = (count == 64 ? ~0ULL : (1ULL << count) - 1) << bit;
+        if (free) {
+            cocomp->heap_bitmap[word] |= mask;
         } else {
-            start_block = -1;
-            consecutive_free_blocks = 0;
+            cocomp->heap_bitmap[word] &= ~mask;
+        }
+        start += count;
+        size -= count;
+    }
+}
+
+// First run of `size` free blocks starting at or after bitmap word `first`,
+// or -1. `run` carries the free blocks at the top of the previous word into
+// the next one, so runs can cross words.
+int heap_find_run(Cocomp *cocomp, int size, int first) {
+    int run = 0;
+    for (int word = first; word < HEAP_WORDS; word++) {
+        unsigned long long bits = cocomp->heap_bitmap[word];
+        if (bits == ~0ULL) {
+            run += 64;
+            if (run >= size) return word * 64 + 64 - run;
+            continue;
+        }
+        if (bits == 0) {
+            run = 0;
+            continue;
+        }
+        if (run + __builtin_ctzll(~bits) >= size) return word * 64 - run;
+        if (size <= 64 && __builtin_popcountll(bits) >= size) {
+            // Keep bit i only if bits i..i+size-1 are all free
+            unsigned long long starts = bits;
+            for (int length = 1; length < size; ) {
+                int shift = length < size - length ? length : size - length;
+                starts &= starts >> shift;
+                length += shift;
+            }
+            if (starts) return word * 64 + __builtin_ctzll(starts);
+        }
+        run = __builtin_clzll(~bits);
+    }
+    return -1;
+}
+
+// Return every cached block to the bitmap
+void heap_flush_free_lists(Cocomp *cocomp) {
+    for (int size = 1; size < HEAP_SIZE_CLASSES; size++) {
+        for (int i = 0; i < cocomp->heap_free_list_counts[size]; i++) {
+            heap_mark(cocomp, cocomp->heap_free_lists[size][i], size, 1);
         }
+        cocomp->heap_free_list_counts[size] = 0;
     }
-    printf("Heap allocation failed: not enough space!\n");
 }
 
-void free_heap(Cocomp *cocomp, int address, int size) {
-    if (address >= 0 && address + size <= HEAP_SIZE) {
-        for (int i = address; i < address + size; i++) {
-            cocomp->free_blocks[i] = 1;
+int heap_free_blocks(Cocomp *cocomp) {
+    int count = 0;
+    for (int word = 0; word < HEAP_WORDS; word++) {
+        count += __builtin_popcountll(cocomp->heap_bitmap[word]);
+    }
+    for (int size = 1; size < HEAP_SIZE_CLASSES; size++) {
+        count += size * cocomp->heap_free_list_counts[size];
+    }
+    return count;
+}
+
+// Returns the address of `size` contiguous heap blocks, or -1. Small sizes
+// come straight off their free list; otherwise the bitmap is searched from
+// where the last search left off, then from the start, then again after
+// the free lists have been flushed back into it.
+int allocate_heap(Cocomp *cocomp, int size) {
+    if (size <= 0 || size > HEAP_SIZE) {
+        printf("Heap allocation failed: invalid size %d!\n", size);
+        return -1;
+    }
+    int address;
+    if (size < HEAP_SIZE_CLASSES && cocomp->heap_free_list_counts[size] > 0) {
+        address = cocomp->heap_free_lists[size][--cocomp->heap_free_list_counts[size]];
+    } else {
+        address = heap_find_run(cocomp, size, cocomp->heap_search_word);
+        if (address < 0 && cocomp->heap_search_word > 0) {
+            address = heap_find_run(cocomp, size, 0);
         }
-        printf("Freed %d blocks starting at %d\n", size, address);
+        if (address < 0) {
+            heap_flush_free_lists(cocomp);
+            address = heap_find_run(cocomp, size, 0);
+        }
+        if (address < 0) {
+            printf("Heap allocation failed: not enough space!\n");
+            return -1;
+        }
+        heap_mark(cocomp, address, size, 0);
+        cocomp->heap_search_word = (address + size) / 64 % HEAP_WORDS;
+    }
+    cocomp->heap_sizes[address] = size;
+    printf("Allocated %d blocks starting at %d\n", size, address);
+    return address;
+}
+
+// Frees the allocation starting at `address`; its size was recorded when it
+// was allocated.
+void free_heap(Cocomp *cocomp, int address) {
+    if (address < 0 || address >= HEAP_SIZE || cocomp->heap_sizes[address] == 0) {
+        printf("Invalid heap address %d!\n", address);
+        return;
+    }
+    int size = cocomp->heap_sizes[address];
+    cocomp->heap_sizes[address] = 0;
+    if (size < HEAP_SIZE_CLASSES && cocomp->heap_free_list_counts[size] < HEAP_FREE_LIST_DEPTH) {
+        cocomp->heap_free_lists[size][cocomp->heap_free_list_counts[size]++] = address;
     } else {
-        printf("Invalid heap address or size!\n");
+        heap_mark(cocomp, address, size, 1);
     }
+    printf("Freed %d blocks starting at %d\n", size, address);
 }
 
 void simulate_page_fault(Cocomp *cocomp, int address) {
@@ -172,6 +273,7 @@ void print_debug_info(Cocomp *cocomp) {
     printf("Accumulator: %lf\n", cocomp->accumulator);
     printf("Stack Pointer: %d\n", cocomp->stack_pointer);
     printf("Heap Pointer: %d\n", cocomp->heap_pointer);
+    printf("Free Heap Blocks: %d\n", heap_free_blocks(cocomp));
     printf("Process ID: %d\n", cocomp->process_id);
     printf("Task ID: %d\n", cocomp->task_id);
     printf("Thread ID: %d\n", cocomp->thread_id);
@@ -355,8 +457,8 @@ int main() {
     push_stack(&cocomp, 3.14);
     printf("Popped value: %lf\n", pop_stack(&cocomp));
     handle_interrupt(&cocomp, 0x01);
-    allocate_heap(&cocomp, 10);
-    free_heap(&cocomp, cocomp.heap_pointer, 10);
+    int block = allocate_heap(&cocomp, 10);
+    free_heap(&cocomp, block);
     simulate_page_fault(&cocomp, 128);
     print_debug_info(&cocomp);
 
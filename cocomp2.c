@@ -1,365 +1,7921 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdarg.h>
 #include <math.h>
+#include <time.h>
+#include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) && defined(__unix__) && !defined(COCOMP_NO_JIT)
+#define COCOMP_JIT 1
+#else
+#define COCOMP_JIT 0
+#endif
+// -DCOCOMP_PROFILE builds count every executed instruction per opcode, per
+// address and per call stack, and time one in PROFILE_SAMPLE_INTERVAL of
+// them. Without it none of the profiling code or state exists.
+#ifdef COCOMP_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define profile_clock() __rdtsc()
+#else
+#define profile_clock() ((unsigned long long)clock())
+#endif
+#endif
+// The batch engine steps lanes four at a time, and the vector instructions
+// work four doubles at a time, with AVX2 when the compiler targets it
+// (-mavx2 or -march=native); otherwise both use plain loops.
+#if defined(__AVX2__) && !defined(COCOMP_NO_AVX2)
+#define COCOMP_AVX2 1
+#include <immintrin.h>
+#else
+#define COCOMP_AVX2 0
+#endif
+#ifdef COCOMP_BENCH
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
+// Default VM sizes. Each VM gets its own from the CocompConfig it is
+// created with; batch lanes always use these.
 #define MEMORY_SIZE 4096
 #define STACK_SIZE 512
 #define HEAP_SIZE 1024
-#define PAGE_SIZE 256
-#define NUM_PAGES (MEMORY_SIZE / PAGE_SIZE)
+#define PAGE_SHIFT 8
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define NUM_PAGES (MEMORY_SIZE / PAGE_SIZE)     // physical page frames in memory
+#define MAX_FRAMES 255                           // frames a page table entry can name
+#define VIRTUAL_PAGES_PER_FRAME 16               // default address space, relative to memory
+#define MAX_VIRTUAL_SIZE (1L << 31)              // everything a 32-bit guest address can reach
+#define PAGE_TABLE_ENTRIES 4096                  // pages per page table, one directory entry each
+#define TLB_ENTRIES 8                            // direct-mapped by page number
+#define CACHE_LINE_SIZE 64
+#define SWAP_PREFETCH_PAGES 4                    // pages read ahead of a sequential fault
+#define SWAP_READAHEAD (256 * 1024)              // bytes of swap file the host is asked to read ahead
+#define SWAP_TRIM_BYTES (16 * 1024 * 1024)       // host pages of swap touched between drops of its mappings
 #define MAX_THREADS 4
+#define THREAD_LIMIT 64        // largest max_threads a config may ask for
+#define THREAD_STACK_SIZE 256  // stacks of spawned threads, carved below the main stack
+#define CALL_DEPTH 256         // return addresses each guest thread can hold
+#define THREAD_TIME_SLICE 64   // basic blocks a guest thread runs before preemption
+#define MAX_POOLS 8
 #define INVALID_PAGE 0xFF
 #define NEURON_COUNT 100
 #define SYNAPSE_COUNT (NEURON_COUNT * NEURON_COUNT)
+// Layer sizes can be set at build time, e.g. -DHIDDEN_LAYER_SIZE=64.
+#ifndef INPUT_LAYER_SIZE
 #define INPUT_LAYER_SIZE 10
+#endif
+#ifndef HIDDEN_LAYER_SIZE
 #define HIDDEN_LAYER_SIZE 20
+#endif
+#ifndef OUTPUT_LAYER_SIZE
 #define OUTPUT_LAYER_SIZE 1
+#endif
 #define LEARNING_RATE 0.01
 
+// -DCOCOMP_FIXED_CONFIG builds only accept the default sizes, and the hot
+// paths (dispatch, stores, the stack and address translation) use them as
+// constants instead of reading them from the VM.
+#ifdef COCOMP_FIXED_CONFIG
+#define VM_MEMORY_SIZE(cocomp) MEMORY_SIZE
+#define VM_PAGE_SHIFT(cocomp) PAGE_SHIFT
+#else
+#define VM_MEMORY_SIZE(cocomp) ((cocomp)->memory_size)
+#define VM_PAGE_SHIFT(cocomp) ((cocomp)->page_shift)
+#endif
+#define VM_PAGE_SIZE(cocomp) (1 << VM_PAGE_SHIFT(cocomp))
+
+// execute_program runs from the pre-decoded instruction cache. Compilers with
+// labels-as-values thread the handlers (one indirect jump per handler);
+// everything else, or a build with -DCOCOMP_DISPATCH_SWITCH, dispatches the
+// decoded entries through a switch.
+#if defined(__GNUC__) || defined(__clang__)
+#define COCOMP_HAVE_COMPUTED_GOTO 1
+#else
+#define COCOMP_HAVE_COMPUTED_GOTO 0
+#endif
+#if COCOMP_HAVE_COMPUTED_GOTO && !defined(COCOMP_DISPATCH_SWITCH)
+#define COCOMP_THREADED_DISPATCH 1
+#else
+#define COCOMP_THREADED_DISPATCH 0
+#endif
+#define MAX_INSTRUCTION_LENGTH 16  // opcode + three 5-byte varints, a compact vector instruction
+#define MEMORY_PADDING (MAX_INSTRUCTION_LENGTH - 1)  // zeros after memory, for an immediate cut off by its end
+#define MAX_FUSED_LENGTH 48       // bytes covered by one superinstruction
+
+#define DECODED_CAPACITY(memory_size) (2 * (memory_size) + 2)
+
+// Decoded form of one instruction. Entries are laid out as straight-line
+// traces, so the fall-through successor of an entry is always the next entry
+// (an OP_LINK where the trace continues elsewhere) and the next instruction
+// pointer is address + length. Immediates are copied out of the unaligned
+// program bytes once, at decode time. A superinstruction replaces the head
+// of a fused run; the entries it covers stay in place for jumps into them.
 typedef struct {
-    unsigned char memory[MEMORY_SIZE];
-    unsigned char heap[HEAP_SIZE];
-    unsigned char page_table[NUM_PAGES];
-    unsigned char page_directory[NUM_PAGES];
-    int instruction_pointer;
-    double accumulator;
-    int stack_pointer;
-    int heap_pointer;
-    int process_id;
-    int task_id;
+    union {
+        double fvalue;     // LOAD_FLOAT/ADD/SUBTRACT/COMPARE immediate, folded constant
+        int xor_mask;      // fused bitwise run: applied after the and mask in ivalue
+        int return_offset; // CALL pushes ip + return_offset: 1 in raw code (the operand byte), else length
+        struct {
+            int vector_source;  // vector instruction: second range (0 for VFILL)
+            int vector_count;   // and the doubles in each range
+        };
+    };
+    int ivalue;            // STORE address, JUMP/CALL/branch target, bitwise operand, interrupt code, link entry,
+                           // vector destination
+    unsigned char op;      // OP_* handler index
+    unsigned char opcode;  // raw opcode byte, for diagnostics
+    unsigned char length;  // bytes consumed by the instruction (the whole run when fused)
+    unsigned char span;    // entries consumed: 1, or the number of instructions fused
+} DecodedInstruction;
+
+enum {
+    OP_RESOLVE,    // entry 0: look the instruction pointer up, decoding on a miss
+    OP_LINK,       // trace continues at entry ivalue
+    OP_UNDECODED,  // invalidated by a write, decode again
+    OP_LOAD_FLOAT,
+    OP_ADD,
+    OP_STORE,
+    OP_PUSH,
+    OP_POP,
+    OP_JUMP,
+    OP_CALL,
+    OP_RETURN,
+    OP_NOP,
+    OP_SUBTRACT,
+    OP_COMPARE,
+    OP_SYSCALL,
+    OP_AND,
+    OP_OR,
+    OP_XOR,
+    OP_SHIFT_LEFT,
+    OP_SHIFT_RIGHT,
+    OP_BRANCH_EQUAL,      // BEQ, BLT, BGT: JUMP if the last COMPARE set the flag
+    OP_BRANCH_LESS,
+    OP_BRANCH_GREATER,
+    OP_BRANCH_ZERO,       // BZ: JUMP if the accumulator is 0
+    OP_DECREMENT_BRANCH,  // DBNZ: take 1 from the top stack slot, JUMP unless that leaves 0
+    OP_VECTOR,            // VADD, VMUL, VDOT, VFILL, VCOPY, told apart by opcode
+    OP_END,
+    OP_UNKNOWN,
+    // Superinstructions produced by fuse_instructions
+    OP_FUSED_LOAD_PUSH,         // LOAD_FLOAT; PUSH
+    OP_FUSED_LOAD_ARITH,        // LOAD_FLOAT; (ADD|SUBTRACT)+, folded to one constant
+    OP_FUSED_LOAD_ARITH_STORE,  // LOAD_FLOAT; (ADD|SUBTRACT)*; STORE
+    OP_FUSED_BITWISE,           // two or more of AND/OR/XOR, folded to (x & ivalue) ^ xor_mask
+    OP_FUSED_INT_CHAIN,         // AND/OR/XOR/SHIFT run with at least one shift, one int conversion
+    OP_FUSED_COMPARE_BRANCH,    // COMPARE; BEQ|BLT|BGT, the branch read from the covered entry
+    // STOREs of a program verify_program accepted, which write memory
+    // directly: the address is in range and holds no code
+    OP_STORE_VERIFIED,
+    OP_FUSED_LOAD_ARITH_STORE_VERIFIED,
+    OP_COUNT
+};
+
+// Flags register, set by COMPARE from the accumulator and its operand and
+// tested by the conditional branches. A compare with NaN sets none.
+enum {
+    FLAG_EQUAL = 1,
+    FLAG_LESS = 2,     // accumulator < operand
+    FLAG_GREATER = 4
+};
+
+// Compact bytecode, as written by assemble: a CompactHeader, the constant
+// pool, then the code. Opcodes are the raw ones, but every operand except a
+// SYSCALL's is a LEB128 varint. Integer operands are zigzag encoded. The
+// operand of LOAD_FLOAT, ADD, SUBTRACT and COMPARE is a zigzag integer shifted
+// left one bit, or the index of a pool constant shifted left with bit 0
+// set. NOP has no padding byte. load_program puts the code at address 0
+// and the pool after it, on an 8-byte boundary.
+#define COMPACT_MAGIC "CCBC"  // 'C' is no raw opcode, so no raw program starts with it
+#define COMPACT_VERSION 1
+#define MAX_VARINT_LENGTH 5   // a 32-bit operand
+
+typedef struct {
+    char magic[4];                 // COMPACT_MAGIC
+    unsigned short version;        // COMPACT_VERSION
+    unsigned short flags;          // none defined; 0
+    unsigned int constant_count;   // doubles in the pool
+    unsigned int code_size;        // bytes of code after the pool
+} CompactHeader;
+
+enum {
+    CODE_RAW,
+    CODE_COMPACT
+};
+
+// Baseline JIT for hot basic blocks (x86-64 with mmap only; -DCOCOMP_NO_JIT
+// compiles it out). Block entries are counted whenever control reaches an
+// address through a jump, call, return or program start.
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 50  // entries before a block is compiled
+#endif
+#define JIT_MIN_BLOCK_INSTRUCTIONS 4  // shorter blocks that fall through cost more to call than to interpret
+#define JIT_MAX_BLOCKS 256
+#define JIT_MAX_BLOCK_INSTRUCTIONS 256
+#define JIT_BUFFER_SIZE (256 * 1024)
+
+struct Cocomp;
+// Compiled block: takes the accumulator in xmm0 and returns it there, storing
+// the instruction pointer the interpreter should resume at.
+typedef double (*JitFunction)(double accumulator, struct Cocomp *cocomp, int *next_ip);
+
+typedef struct {
+    int start;             // address of the first instruction
+    int end;               // address just past the last compiled instruction
+    JitFunction code;
+} JitBlock;
+
+#ifdef COCOMP_PROFILE
+#define PROFILE_SAMPLE_INTERVAL 16  // time one instruction in this many, on average
+#define PROFILE_MAX_FRAMES 1024     // distinct call stacks tracked
+#define PROFILE_RANGE_SIZE 32       // bytes per address range in the report
+
+// One node of the call tree built from CALL/RETURN; the first max_threads
+// nodes are the roots of the guest threads.
+typedef struct {
+    int parent;
+    int function;      // CALL target address, -1 for a root
+    int first_child;
+    int next_sibling;
+    long count;        // instructions executed with exactly this stack
+} ProfileFrame;
+
+typedef struct {
+    long opcode_counts[256];
+    long opcode_samples[256];
+    unsigned long long opcode_cycles[256];  // over the sampled instructions only
+    long *address_counts;                   // per address of memory
+    long *address_samples;
+    unsigned long long *address_cycles;
+    ProfileFrame frames[PROFILE_MAX_FRAMES];
+    int frame_count;
+    int *current_frame;                     // per guest thread
+    int countdown;                          // instructions until the next sample
+    unsigned seed;                          // jitters the interval so loops do not alias
+    int sample_ip;                          // instruction being timed, -1 if none
+    int sample_opcode;
+    unsigned long long sample_start;
+} Profile;
+#endif
+
+// Guest loads and stores (STORE, the stack, CALL/RETURN) use virtual
+// addresses, translated to frames of `memory` through a TLB and then the
+// page directory and page table. Pages that are not resident live in the
+// swap: an anonymous mapping by default, or a file given to open_swap.
+// Instructions are fetched from `memory` directly, so the frames the
+// program was loaded into are pinned.
+enum {
+    PAGE_POLICY_CLOCK,
+    PAGE_POLICY_LRU,
+    PAGE_POLICY_RANDOM
+};
+
+typedef struct {
+    int page;   // -1 if the entry is empty
+    int frame;
+} TlbEntry;
+
+typedef struct {
+    unsigned char *table;  // frame of each page, or INVALID_PAGE; allocated while resident > 0
+    int resident;          // pages of this table that are in memory
+} PageDirectoryEntry;
+
+// The heap is split evenly into one arena per guest thread slot, and a
+// thread allocates from its own arena by bumping `used`. Freeing the top
+// block of an arena gives its bytes back at once. A block freed further
+// down stays dead until the arena is released below it or has no live
+// blocks left.
+typedef struct {
+    int base;        // first heap address of the arena
+    int used;        // bytes from base taken by live or dead blocks
+    int live_blocks;
+    int dead_bytes;  // freed, not yet reclaimed
+    int high_water;  // most bytes ever used
+    long failures;   // allocations that did not fit
+} HeapArena;
+
+// Fixed-size objects carved out of one arena block. Free slots are chained
+// through their first bytes.
+typedef struct {
+    int base;         // heap address of the pool's block, -1 once it is gone
+    int object_size;
+    int capacity;
+    int free_head;    // heap address of the first free slot, -1 if none
+    int live;
+    int high_water;
+} HeapPool;
+
+enum {
+    THREAD_FREE,
+    THREAD_READY,     // running or runnable
+    THREAD_BLOCKED,   // in JOIN
+    THREAD_FINISHED,
+    THREAD_SENDING,   // in SEND, on a full channel
+    THREAD_RECEIVING  // in RECV, on an empty channel
+};
+
+// Sizes of one VM, fixed when it is created. Start from
+// COCOMP_DEFAULT_CONFIG and change what the job needs.
+typedef struct {
+    int memory_size;        // bytes of physical memory, a multiple of page_size
+    int heap_size;
+    int stack_size;         // main stack, at the top of memory; a whole number of 8-byte slots
+    int page_size;          // a power of two
+    int max_threads;        // guest threads, each with a heap arena
+    int input_layer_size;
+    int hidden_layer_size;
+    int output_layer_size;
+} CocompConfig;
+
+#define COCOMP_DEFAULT_CONFIG \
+    {MEMORY_SIZE, HEAP_SIZE, STACK_SIZE, PAGE_SIZE, MAX_THREADS, INPUT_LAYER_SIZE, HIDDEN_LAYER_SIZE, OUTPUT_LAYER_SIZE}
+
+// Paging state of a VM. It is created when the VM first touches an address
+// outside its frames, or asks for paging explicitly (open_swap,
+// set_resident_frames, the reports); until then virtual page n is simply
+// frame n and loads and stores skip translation.
+typedef struct {
+    PageDirectoryEntry *page_directory;                    // &first_directory_entry unless open_swap needed more
+    PageDirectoryEntry first_directory_entry;              // covers the default address space
+    unsigned char *swap;                                   // contents of every page that is not resident, mapped on first use
+    int swap_fd;                                           // file behind swap, -1 for anonymous memory
+    long swap_traffic;                                     // bytes of host pages faulted in swap since its last trim
+    long swap_host_page;                                   // host page of swap last counted in swap_traffic
+    long swap_readahead_end;                               // end of the last range the host was asked to read ahead
+    long next_sequential_page;                             // page a sequential scan would fault on next
+    int sequential_faults;                                 // faults in a row at next_sequential_page
+    int resident_frames;                                   // most frames this VM may hold pages in
+    TlbEntry tlb[TLB_ENTRIES];
+    unsigned long mmu_clock;
+    int pinned_frames;
+    int clock_hand;
+    int page_policy;                                       // PAGE_POLICY_*
+    unsigned int page_seed;                                // for PAGE_POLICY_RANDOM
+    int backing_store_used;                                // a page has been evicted since the last reset
+    long tlb_hits;
+    long tlb_misses;
+    long page_faults;
+    long page_evictions;
+    long page_writebacks;
+    long page_prefetches;
+    int frame_pages[MAX_FRAMES];                           // virtual page held by each frame, -1 if free
+    unsigned char frame_pinned[MAX_FRAMES];
+    unsigned char frame_referenced[MAX_FRAMES];            // clock bit
+    unsigned char frame_dirty[MAX_FRAMES];                 // differs from the backing store
+    unsigned long frame_last_use[MAX_FRAMES];              // mmu_clock at the last access, for LRU
+    unsigned char first_page_table[PAGE_TABLE_ENTRIES];    // table 0, never freed
+} CocompPaging;
+
+// Heap bytes and their allocator metadata, created by the first heap call.
+typedef struct {
+    unsigned char *bytes;
+    int *sizes;                     // block starting here: size if live, -size if freed, 0 if none
+    HeapArena *arenas;              // arena i belongs to guest thread i
+    HeapPool pools[MAX_POOLS];
+    int pool_count;
+} CocompHeap;
+
+// Neural network layers, created by the first network call.
+typedef struct {
+    double *input_layer;
+    double *hidden_layer;
+    double *output_layer;
+    double *weights_input_hidden;
+    double *weights_hidden_output;
+    double *biases_hidden;
+    double *biases_output;
+} CocompNetwork;
+
+#define IPC_MAILBOXES 10         // processes a VM can exchange messages with
+#define IPC_DEFAULT_CAPACITY 64  // messages in a channel made by the first ipc_send/ipc_receive
+#define IPC_SEND 0x10            // SYSCALL IPC_SEND + n sends to process n
+#define IPC_RECEIVE 0x20         // SYSCALL IPC_RECEIVE + n receives from process n
+
+enum {
+    IPC_SPSC,  // one sending VM, one receiving VM
+    IPC_MPMC   // any number of either
+};
+
+// Bounded queue of messages between VMs, which may run on different host
+// threads; no operation takes a lock. The sending and receiving ends each
+// own a cache line. An SPSC channel needs only the two counters, and each
+// end keeps its last view of the other's. In an MPMC channel each slot has
+// a sequence number, and senders and receivers claim slots with a
+// compare-and-swap on their counter (Vyukov's bounded queue).
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;  // messages sent (MPMC: slots claimed)
+    size_t cached_tail;                            // SPSC sender's view of tail
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;  // messages received (MPMC: slots claimed)
+    size_t cached_head;                            // SPSC receiver's view of head
+    _Alignas(CACHE_LINE_SIZE) int kind;            // IPC_SPSC or IPC_MPMC
+    size_t mask;                                   // capacity - 1, capacity a power of two
+    atomic_int references;                         // endpoints attached, plus the creator's
+    atomic_size_t *sequences;                      // MPMC only
+    double *messages;
+} IpcChannel;
+
+// A VM's channel endpoints, by the process ID at the other end. Created by
+// the first use of either. A VM has the same channel as both endpoints for a
+// process it was not connected to, so what it sends there it receives back.
+typedef struct {
+    IpcChannel *send_channels[IPC_MAILBOXES];
+    IpcChannel *receive_channels[IPC_MAILBOXES];
+} CocompIpc;
+
+// A file system in one image file, mapped MAP_SHARED, that VMs mount.
+// The image starts with an FsHeader holding the directory; each file is one
+// run of blocks reserved when it is created, so its bytes are contiguous in
+// the image and start on a block boundary.
+#define FS_MAGIC "COCOMPFS"
+#define FS_VERSION 1
+#define FS_BLOCK_SIZE 4096                // a multiple of the host page size
+#define FS_MAX_FILES 64
+#define FS_NAME_LENGTH 48                 // including the terminating NUL
+#define FS_DEFAULT_FILE_SIZE (64 * 1024)  // reserved for a file a guest creates
+#define FS_MAX_OPEN 16                    // open files per VM
+#define FS_READAHEAD (256 * 1024)         // bytes of image the host is asked to read ahead
+// Guest file syscalls. OPEN, READ, WRITE and SEEK take the address of
+// their arguments, doubles as STORE writes them, in the accumulator;
+// CLOSE takes the descriptor. The result, or -1, is left in the
+// accumulator.
+#define FILE_OPEN 0x30    // [name address, flags] -> descriptor
+#define FILE_READ 0x31    // [descriptor, address, length] -> bytes read
+#define FILE_WRITE 0x32   // [descriptor, address, length] -> bytes written
+#define FILE_SEEK 0x33    // [descriptor, offset, SEEK_SET/SEEK_CUR/SEEK_END] -> position
+#define FILE_CLOSE 0x34   // descriptor -> 0
+
+enum {
+    FS_READ = 1,    // fs_open flags
+    FS_WRITE = 2,
+    FS_CREATE = 4   // reserve FS_DEFAULT_FILE_SIZE for the file if it is missing
+};
+
+typedef struct {
+    char name[FS_NAME_LENGTH];  // empty if the entry is free
+    long first_block;
+    long blocks;                // reserved for the file
+    long size;                  // bytes written
+} FsEntry;
+
+typedef struct {
+    char magic[8];
+    int version;
+    int block_size;
+    long block_count;
+    long next_block;            // first block no file has reserved
+    FsEntry entries[FS_MAX_FILES];
+} FsHeader;
+
+typedef struct {
+    FsHeader *header;           // the mapped image
+    size_t size;
+    int fd;
+    pthread_mutex_t lock;       // guards the directory; file bytes are unguarded
+    atomic_int references;      // VMs that mounted it, plus the opener's
+} CocompFs;
+
+typedef struct {
+    int entry;                  // directory entry, -1 if the descriptor is free
+    int flags;
+    long position;
+    long sequential_end;        // where the last READ ended; a READ from there is sequential
+    long readahead_end;         // end of the last range the host was asked to read ahead
+} FsOpenFile;
+
+// A VM's mounted file system and open files, created by mount_fs
+typedef struct {
+    CocompFs *fs;
+    FsOpenFile files[FS_MAX_OPEN];
+    long zero_copy_pages;       // guest pages READ by mapping the image
+    long copied_bytes;          // bytes READ by copying from the image
+} CocompFiles;
+
+// Console output of a VM: the guest's print syscall and the diagnostics of
+// calls into the VM. CONSOLE_DIRECT prints each message as it comes.
+// CONSOLE_BUFFERED collects them in the VM and writes them in batches, when
+// the buffer fills, when the interpreter returns to the host and on
+// flush_console. CONSOLE_BACKGROUND hands the batches to a writer thread
+// instead. CONSOLE_SILENT drops everything, and failures only set the VM's
+// status.
+enum {
+    CONSOLE_DIRECT,
+    CONSOLE_BUFFERED,
+    CONSOLE_BACKGROUND,
+    CONSOLE_SILENT
+};
+
+#define CONSOLE_BUFFER_SIZE 4096
+
+// Output of a buffered console not yet written, created by its first message
+typedef struct {
+    size_t used;
+    long batches;                   // buffers written out or handed to the writer
+    char text[CONSOLE_BUFFER_SIZE];
+} CocompConsole;
+
+// Why the last failed call into a VM, or guest instruction, failed
+enum {
+    COCOMP_OK,
+    COCOMP_STACK_OVERFLOW,
+    COCOMP_STACK_UNDERFLOW,
+    COCOMP_INVALID_ADDRESS,
+    COCOMP_UNKNOWN_INSTRUCTION,
+    COCOMP_UNKNOWN_SYSCALL,
+    COCOMP_PROGRAM_TOO_LARGE,
+    COCOMP_THREAD_LIMIT,
+    COCOMP_DEADLOCK,
+    COCOMP_INVALID_HEAP_CALL,   // bad size, address, arena or pool
+    COCOMP_HEAP_FULL,           // arena or pool
+    COCOMP_NO_MEMORY,           // the host could not provide swap or a page frame
+    COCOMP_INVALID_PROCESS,
+    COCOMP_CHANNEL_FULL,
+    COCOMP_CHANNEL_EMPTY,
+    COCOMP_NO_FILE_SYSTEM,
+    COCOMP_NO_FILE,
+    COCOMP_BAD_FILE,            // descriptor not open, or not for this access
+    COCOMP_FILE_SYSTEM_FULL,
+    COCOMP_BAD_PROGRAM,         // malformed compact bytecode image
+    COCOMP_STATUS_COUNT
+};
+
+// SYSCALL n runs the handler registered for n, which takes its argument
+// from and leaves its result in the accumulator.
+#define SYSCALL_COUNT 256
+typedef void (*SyscallHandler)(struct Cocomp *cocomp, int code);
+
+// A VM is one cache-line-aligned allocation: this struct, followed by every
+// array the interpreter uses whose size depends on the config, each
+// starting on its own cache line (see layout_cocomp). The first cache line
+// holds the state touched on every dispatch. Paging, the heap, the neural
+// network and IPC are separate allocations, made the first time they are
+// used, so a VM that never uses them carries only a pointer for each.
+typedef struct Cocomp {
+    _Alignas(CACHE_LINE_SIZE) struct {
+        unsigned char *memory;
+        DecodedInstruction *decoded;   // DECODED_CAPACITY(memory_size); entry 0 is the OP_RESOLVE sentinel
+        int *decoded_index;            // address -> entry, 0 if not decoded
+        double accumulator;
+        int instruction_pointer;
+        int stack_pointer;
+        int stack_base;                // running thread's stack region
+        int stack_limit;
+        int memory_size;
+        int page_shift;
+        int time_slice;                // basic blocks per slice, 0 = switch only on YIELD/JOIN/END
+        int reschedule;                // set by YIELD/JOIN for the interpreter
+    };
+    CocompPaging *paging;
+    CocompHeap *heap;
+    CocompNetwork *network;
+    CocompIpc *ipc;
+    CocompConsole *console;
+    CocompFiles *files;
     int thread_id;
     int thread_count;
-    int thread_stack_pointers[MAX_THREADS];
-    int inter_process_comm[10]; // Example IPC storage
-    // Dynamic code loading area
-    unsigned char dynamic_code_area[1024];
-    // Neural network simulation
-    double input_layer[INPUT_LAYER_SIZE];
-    double hidden_layer[HIDDEN_LAYER_SIZE];
-    double output_layer[OUTPUT_LAYER_SIZE];
-    double weights_input_hidden[INPUT_LAYER_SIZE * HIDDEN_LAYER_SIZE];
-    double weights_hidden_output[HIDDEN_LAYER_SIZE * OUTPUT_LAYER_SIZE];
-    double biases_hidden[HIDDEN_LAYER_SIZE];
-    double biases_output[OUTPUT_LAYER_SIZE];
+    int *return_stacks;           // CALL_DEPTH return addresses per thread, outside guest memory
+    int return_depth;             // of the running thread
+    int flags;                    // FLAG_* of the running thread
+    int decoded_count;
+    int fusion_enabled;           // fuse superinstructions when decoding
+    int jit_enabled;  // runtime switch; compiled blocks are only run while set
+#if COCOMP_JIT
+    unsigned short *jit_counters;              // block entries seen per address
+    short *jit_block_at;                       // compiled block + 1, 0 if none
+    unsigned char *jit_covered;                // address may lie inside a compiled block
+    unsigned char *jit_code;                   // mmap'd on first compile
+    int jit_code_used;
+    int jit_block_count;
+#endif
+    // Everything below is only touched by calls into the VM, not by the
+    // interpreter loop.
+    _Alignas(CACHE_LINE_SIZE) int heap_size;
+    int stack_size;
+    int num_frames;                            // memory_size / page size
+    int max_threads;
+    int heap_arena_size;                       // heap bytes owned by each guest thread
+    int input_layer_size;
+    int hidden_layer_size;
+    int output_layer_size;
+    size_t region_size;                        // bytes allocated for the VM
+    size_t mapped_size;                        // bytes mapped from a snapshot by fork_cocomp, else 0
+    long virtual_pages;                        // size of the address space
+    int code_size;                             // bytes loaded by load_program; their frames are pinned
+    int code_format;                           // CODE_* of the loaded program
+    int constant_pool;                         // address of a compact program's constants, after its code
+    int constant_count;
+    int process_id;
+    int task_id;
+    int *thread_stack_pointers;
+    int *thread_return_depths;
+    unsigned char *thread_flags;
+    // Saved registers of guest threads that are not running
+    int *thread_instruction_pointers;
+    double *thread_accumulators;
+    unsigned char *thread_states;              // THREAD_*
+    int *thread_join_targets;                  // thread a blocked thread waits for, or process of an IPC wait
+    long context_switches;
+    int parked;                                // every thread waits on a channel; the VM gives up its host thread
+    int console_mode;                          // CONSOLE_*
+    FILE *console_file;                        // NULL for stdout
+    int status;                                // COCOMP_* of the last failure, until the host clears it
+    int fusion_counts[OP_COUNT];  // superinstructions created, per OP_FUSED_*
+    int verified;                 // the program passed verify_program; its STOREs are decoded unchecked
+#if COCOMP_JIT
+    JitBlock jit_blocks[JIT_MAX_BLOCKS];
+#endif
+#ifdef COCOMP_PROFILE
+    Profile profile;
+#endif
 } Cocomp;
 
+_Static_assert(offsetof(Cocomp, reschedule) + sizeof(int) <= CACHE_LINE_SIZE,
+               "the interpreter's state must fit in the first cache line");
+
+// A VM written to an unlinked file by snapshot_cocomp: the VM's region,
+// then each component it had but its channels, each on its own cache line. fork_cocomp maps
+// the file MAP_PRIVATE, so forks share its pages until they write to them.
+// Anonymous swap, if the VM had any, follows on a page boundary and is
+// mapped on its own.
+typedef struct {
+    int fd;
+    size_t size;             // region and components
+    size_t heap_offset;      // 0 if the VM had no heap, and so on
+    size_t network_offset;
+    size_t paging_offset;
+    size_t swap_offset;
+    size_t swap_size;
+} CocompSnapshot;
+
+// Bytecode shared by every VM that loads it. open_module maps a file and
+// module_from_code copies a buffer; either way the module is looked up by
+// the hash of its bytes first, so the same code is only kept once. The first
+// VM to load a module leaves its decoded trace there, and VMs of the same
+// memory size that load it later copy the trace instead of decoding again.
+#define MODULE_CACHE_SLOTS 64  // modules kept by content hash; a new one replaces the one in its slot
+
+typedef struct {
+    int memory_size;           // of the VM that decoded it
+    int fusion_enabled;
+    int count;                 // decoded entries, the OP_RESOLVE sentinel included
+    int verified;
+    int fusion_counts[OP_COUNT];
+    int *decoded_index;        // one per program byte
+    DecodedInstruction decoded[];
+} ModuleTrace;
+
+typedef struct {
+    unsigned long long hash;
+    const unsigned char *code;
+    long size;
+    size_t mapped_size;             // of the file mapping; 0 if the module holds a copy
+    atomic_int references;          // holders, the cache's slot included
+    _Atomic(ModuleTrace *) trace;   // NULL until a VM has loaded the module
+} CocompModule;
+
+typedef struct {
+    long hits;                 // opens that found the module cached
+    long misses;
+    int modules;               // cached now
+    long bytes;
+} ModuleCacheStats;
+
+// Lockstep execution of many independent guests. Lane state is kept as
+// structure-of-arrays; every dispatch picks the lowest live instruction
+// pointer and runs that instruction on all lanes sitting there, masking the
+// rest off, so lanes that branch apart wait and reconverge. Instructions
+// whose bytes are the same in every lane are decoded once and applied with
+// vector kernels; bytes that differ between lanes (or that a lane has
+// written) are decoded and executed per lane.
+#define BATCH_VECTOR_LANES 8                         // lane arrays are padded to this
+#define BATCH_MEMORY_STRIDE (MEMORY_SIZE + 16)       // room for operands read past the end
+#define BATCH_HALTED INT_MAX                         // instruction pointer of a stopped lane
+
+enum {
+    BATCH_UNDECODED,
+    BATCH_SHARED,    // code[address] holds the decode every lane agrees on
+    BATCH_PER_LANE   // lanes may disagree; decode from each lane's memory
+};
+
+typedef struct {
+    double accumulator;
+    int instruction_pointer;
+    int stack_pointer;
+} BatchResult;
+
+typedef struct {
+    int count;                   // guests in the batch
+    int padded_count;            // lanes allocated, a multiple of BATCH_VECTOR_LANES
+    double *accumulators;        // 32-byte aligned, one entry per lane
+    int *instruction_pointers;   // BATCH_HALTED once a lane has stopped
+    int *stack_pointers;
+    int *return_stacks;          // CALL_DEPTH return addresses per lane
+    int *return_depths;
+    int *flags;                  // FLAG_* per lane
+    int *final_ips;              // where each stopped lane halted
+    unsigned char *memory;       // lane memories, BATCH_MEMORY_STRIDE bytes apart
+    unsigned char *shared_code;  // image the shared decodes are read from
+    unsigned char *lane_private; // byte differs between lanes or has been written
+    unsigned char *code_state;   // BATCH_* per address
+    DecodedInstruction *code;
+    long lockstep_steps;         // dispatches with every live lane at the same address
+    long divergent_steps;        // dispatches that masked live lanes off
+} CocompBatch;
+
+// Multi-core VM farm. A pool of worker threads each owns a deque of jobs;
+// a worker takes its newest job, runs it for one quantum and puts it back at
+// the far end, so long jobs cannot starve short ones. Idle workers steal from
+// the far end of other workers' deques.
+#define FARM_QUANTUM 10000  // basic blocks a job runs before it is requeued
+
+enum {
+    FARM_JOB_QUEUED,
+    FARM_JOB_DONE,
+    FARM_JOB_CANCELLED
+};
+
+typedef struct {
+    Cocomp *cocomp;              // owned by the caller; holds the result once done
+    atomic_int state;            // FARM_JOB_*
+    atomic_int cancel_requested;
+    long quanta;                 // quanta the job has run
+} FarmJob;
+
+struct VmFarm;
+
+typedef struct {
+    struct VmFarm *farm;
+    pthread_t thread;
+    pthread_mutex_t lock;        // guards the deque
+    FarmJob **deque;             // ring buffer: owner works at the tail, thieves at the head
+    int head;
+    int size;
+    int capacity;
+    atomic_long jobs_completed;
+    atomic_long quanta;
+    atomic_long steals;
+    atomic_long busy_nanoseconds;
+} FarmWorker;
+
+typedef struct VmFarm {
+    FarmWorker *workers;
+    int worker_count;
+    int quantum;
+    pthread_mutex_t lock;        // guards queued, shutdown and job completion
+    pthread_cond_t work_ready;
+    pthread_cond_t job_done;
+    int queued;                  // jobs sitting in any deque
+    int shutdown;
+    unsigned next_worker;        // round-robin target for farm_submit
+} VmFarm;
+
+Cocomp *create_cocomp(const CocompConfig *config);
+Cocomp *clone_cocomp(const Cocomp *cocomp);
+void destroy_cocomp(Cocomp *cocomp);
+CocompSnapshot *snapshot_cocomp(const Cocomp *cocomp);
+Cocomp *fork_cocomp(const CocompSnapshot *snapshot);
+void destroy_snapshot(CocompSnapshot *snapshot);
+CocompPaging *get_paging(Cocomp *cocomp);
+CocompHeap *get_heap(Cocomp *cocomp);
+CocompNetwork *get_network(Cocomp *cocomp);
+CocompIpc *get_ipc(Cocomp *cocomp);
+CocompConsole *get_console(Cocomp *cocomp);
+void set_console(Cocomp *cocomp, int mode, FILE *file);
+void console_print(Cocomp *cocomp, const char *format, ...);
+void report_error(Cocomp *cocomp, int status, const char *format, ...);
+void flush_console(Cocomp *cocomp);
+void sync_console(void);
+const char *status_name(int status);
 void initialize(Cocomp *cocomp);
 void load_program(Cocomp *cocomp, unsigned char *program, int size);
+const char *verify_program(const unsigned char *program, int size, int memory_size, int *address);
+void unverify_program(Cocomp *cocomp);
+CocompModule *open_module(const char *path);
+CocompModule *module_from_code(const unsigned char *code, long size);
+void release_module(CocompModule *module);
+int load_module(Cocomp *cocomp, CocompModule *module);
+int load_module_file(Cocomp *cocomp, const char *path);
+ModuleCacheStats module_cache_stats(void);
+void print_module_cache_stats(void);
+void flush_module_cache(void);
 void execute_program(Cocomp *cocomp);
+void execute_program_switch(Cocomp *cocomp);
+void execute_program_decoded(Cocomp *cocomp);
+int execute_program_quantum(Cocomp *cocomp, int quantum);
+void decode_instruction(Cocomp *cocomp, int address, DecodedInstruction *d);
+void decode_bytes(const unsigned char *memory, int address, DecodedInstruction *d);
+void decode_compact(const unsigned char *code, int address, const unsigned char *pool, int pool_count,
+                    DecodedInstruction *d);
+int decode_trace(Cocomp *cocomp, int address, int sweep_end);
+int redecode_instruction(Cocomp *cocomp, int index, int address);
+void reset_decoded(Cocomp *cocomp);
+void predecode_program(Cocomp *cocomp, int start, int size);
+int fuse_instructions(Cocomp *cocomp, int index);
+void print_fusion_stats(Cocomp *cocomp);
+void invalidate_decoded(Cocomp *cocomp, int address, int length);
+void set_jit_enabled(Cocomp *cocomp, int enabled);
+#if COCOMP_JIT
+int jit_compile_block(Cocomp *cocomp, int address);
+void jit_invalidate(Cocomp *cocomp, int address, int length);
+void jit_flush(Cocomp *cocomp);
+#endif
+CocompBatch *create_batch(unsigned char **programs, int *sizes, int count);
+void execute_batch(CocompBatch *batch);
+void get_batch_results(CocompBatch *batch, BatchResult *results);
+unsigned char *batch_memory(CocompBatch *batch, int index);
+void free_batch(CocompBatch *batch);
+int run_batch(unsigned char **programs, int *sizes, int count, BatchResult *results);
+VmFarm *create_farm(int num_workers, int quantum);
+FarmJob *farm_submit(VmFarm *farm, Cocomp *cocomp);
+void farm_cancel(VmFarm *farm, FarmJob *job);
+int farm_wait(VmFarm *farm, FarmJob *job);
+void print_farm_stats(VmFarm *farm);
+void destroy_farm(VmFarm *farm);
+const char *opcode_name(unsigned char opcode);
+unsigned char *assemble(const char *source, long *size, char *error, int error_size);
+int disassemble(const unsigned char *program, long size, FILE *out);
+#ifdef COCOMP_PROFILE
+void reset_profile(Cocomp *cocomp);
+void profile_instruction(Cocomp *cocomp, int address, const DecodedInstruction *d);
+void profile_flush(Cocomp *cocomp);
+void print_profile(Cocomp *cocomp);
+int export_folded_stacks(Cocomp *cocomp, const char *path);
+#endif
 void print_memory(Cocomp *cocomp);
 void push_stack(Cocomp *cocomp, double value);
 double pop_stack(Cocomp *cocomp);
 void handle_interrupt(Cocomp *cocomp, int interrupt_code);
-void allocate_heap(Cocomp *cocomp, int size);
+SyscallHandler register_syscall(int code, SyscallHandler handler);
+void reset_threads(Cocomp *cocomp);
+int spawn_thread(Cocomp *cocomp, int address);
+int schedule_thread(Cocomp *cocomp);
+int end_thread(Cocomp *cocomp);
+int thread_waiting(Cocomp *cocomp);
+void reset_heap(Cocomp *cocomp);
+int allocate_heap(Cocomp *cocomp, int size);
+int arena_allocate(Cocomp *cocomp, int arena, int size);
 void free_heap(Cocomp *cocomp, int address);
+int arena_mark(Cocomp *cocomp, int arena);
+void arena_release(Cocomp *cocomp, int arena, int mark);
+int create_pool(Cocomp *cocomp, int object_size, int capacity);
+int pool_allocate(Cocomp *cocomp, int pool);
+void pool_free(Cocomp *cocomp, int pool, int address);
+void print_heap_stats(Cocomp *cocomp);
+void reset_mmu(Cocomp *cocomp);
+void reset_page_mapping(Cocomp *cocomp);
+int mmu_read(Cocomp *cocomp, int address, void *data, int length);
+int mmu_write(Cocomp *cocomp, int address, const void *data, int length);
+int page_fault(Cocomp *cocomp, int page);
+int open_swap(Cocomp *cocomp, const char *path, long size);
+void close_swap(Cocomp *cocomp);
+void set_resident_frames(Cocomp *cocomp, int frames);
 void simulate_page_fault(Cocomp *cocomp, int address);
+void print_mmu_stats(Cocomp *cocomp);
 void print_debug_info(Cocomp *cocomp);
 void process_management(Cocomp *cocomp, int num_processes);
 void thread_management(Cocomp *cocomp, int num_threads);
 void paging_management(Cocomp *cocomp);
 void file_system_operations(Cocomp *cocomp);
+CocompFs *create_fs(const char *path, long size);
+CocompFs *open_fs(const char *path);
+void release_fs(CocompFs *fs);
+int fs_add_file(CocompFs *fs, const char *name, const void *data, long size);
+int mount_fs(Cocomp *cocomp, CocompFs *fs);
+void unmount_fs(Cocomp *cocomp);
+int fs_open(Cocomp *cocomp, const char *name, int flags);
+long fs_read(Cocomp *cocomp, int fd, int address, long length);
+long fs_write(Cocomp *cocomp, int fd, int address, long length);
+long fs_seek(Cocomp *cocomp, int fd, long offset, int whence);
+int fs_close(Cocomp *cocomp, int fd);
 void exception_handling(Cocomp *cocomp, const char *error_message);
-void ipc_send(Cocomp *cocomp, int process_id, int message);
+IpcChannel *create_channel(int capacity, int kind);
+void release_channel(IpcChannel *channel);
+int channel_send(IpcChannel *channel, const double *messages, int count);
+int channel_receive(IpcChannel *channel, double *messages, int count);
+int channel_has_room(IpcChannel *channel);
+int channel_has_message(IpcChannel *channel);
+IpcChannel *ipc_channel(Cocomp *cocomp, int process_id, int receive);
+int ipc_attach(Cocomp *cocomp, int process_id, IpcChannel *channel, int receive);
+int ipc_connect(Cocomp *a, Cocomp *b, int capacity);
+int ipc_send(Cocomp *cocomp, int process_id, int message);
 int ipc_receive(Cocomp *cocomp, int process_id);
+int ipc_send_batch(Cocomp *cocomp, int process_id, const double *messages, int count);
+int ipc_receive_batch(Cocomp *cocomp, int process_id, double *messages, int count);
 void load_dynamic_code(Cocomp *cocomp, unsigned char *code, int size);
 void initialize_neural_network(Cocomp *cocomp);
 void forward_pass(Cocomp *cocomp);
 void backward_pass(Cocomp *cocomp, double *target_output);
 void train_neural_network(Cocomp *cocomp, double *inputs, double *targets, int num_samples, int epochs);
+#ifdef COCOMP_BENCH
+void bench_begin(void);
+void bench_end(void);
+void bench_report(const char *name, long ops, double seconds);
+void benchmark_programs(Cocomp *cocomp);
+void benchmark_dispatch(Cocomp *cocomp);
+void benchmark_batch(Cocomp *cocomp);
+void benchmark_farm(Cocomp *cocomp);
+void benchmark_threads(Cocomp *cocomp);
+void benchmark_heap(Cocomp *cocomp);
+void benchmark_page_faults(Cocomp *cocomp);
+void benchmark_swap(Cocomp *cocomp);
+void benchmark_file_system(Cocomp *cocomp);
+void benchmark_neural_network(Cocomp *cocomp);
+void benchmark_vm_state(Cocomp *cocomp);
+void benchmark_snapshot(Cocomp *cocomp);
+void benchmark_ipc(Cocomp *cocomp);
+void benchmark_console(Cocomp *cocomp);
+void benchmark_verifier(Cocomp *cocomp);
+void benchmark_modules(Cocomp *cocomp);
+void benchmark_compact(Cocomp *cocomp);
+void benchmark_vectors(Cocomp *cocomp);
 
 int main() {
-    Cocomp cocomp;
-    initialize(&cocomp);
-
-    // Example program with neural network instructions
-    unsigned char program[] = {
-        0x01, 0x40, 0x00, 0x00, 0x00, // LOAD_FLOAT 3.14
-        0x04,                         // PUSH
-        0x01, 0x40, 0x00, 0x00, 0x01, // LOAD_FLOAT 2.71
-        0x02,                         // ADD
-        0x05,                         // POP
-        0x03, 0x00,                   // STORE result at address 0
-        0x0C, 0x01,                   // SYSTEM CALL with interrupt code 1
-        0xFF                          // END
-    };
+    bench_begin();
+    Cocomp *cocomp = create_cocomp(NULL);
+    if (!cocomp) {
+        return 1;
+    }
+    benchmark_programs(cocomp);
+    benchmark_dispatch(cocomp);
+    benchmark_batch(cocomp);
+    benchmark_farm(cocomp);
+    benchmark_threads(cocomp);
+    benchmark_heap(cocomp);
+    benchmark_page_faults(cocomp);
+    benchmark_swap(cocomp);
+    benchmark_file_system(cocomp);
+    benchmark_neural_network(cocomp);
+    benchmark_vm_state(cocomp);
+    benchmark_snapshot(cocomp);
+    benchmark_ipc(cocomp);
+    benchmark_console(cocomp);
+    benchmark_verifier(cocomp);
+    benchmark_modules(cocomp);
+    benchmark_compact(cocomp);
+    benchmark_vectors(cocomp);
+    bench_end();
+    destroy_cocomp(cocomp);
+    return 0;
+}
+#elif defined(COCOMP_CHECK)
+int check_engines(void);
+
+int main() {
+    return check_engines() ? 0 : 1;
+}
+#else
+int main() {
+    Cocomp *cocomp = create_cocomp(NULL);
+    if (!cocomp) {
+        return 1;
+    }
 
-    load_program(&cocomp, program, sizeof(program));
-    execute_program(&cocomp);
-    print_memory(&cocomp);
-    print_debug_info(&cocomp);
+    // Example program, assembled to compact bytecode: add two numbers,
+    // store the sum past the program and print it
+    char error[128];
+    long size;
+    unsigned char *program = assemble(
+        "    LOAD_FLOAT 3.14\n"
+        "    ADD 2.71\n"
+        "    STORE 256       ; result\n"
+        "    SYSCALL 1       ; print the accumulator\n"
+        "    END\n",
+        &size, error, sizeof(error));
+    if (!program) {
+        printf("Assembler: %s\n", error);
+        return 1;
+    }
+    disassemble(program, size, stdout);
+    load_program(cocomp, program, size);
+    free(program);
+    execute_program(cocomp);
+    print_memory(cocomp);
+    print_debug_info(cocomp);
 
     // Neural network simulation example
     double inputs[INPUT_LAYER_SIZE] = {1.0, 0.5, 0.3, 0.8, 0.6, 0.2, 0.9, 0.4, 0.7, 0.1}; // Example inputs
     double targets[OUTPUT_LAYER_SIZE] = {0.5}; // Example target output
-    initialize_neural_network(&cocomp);
-    train_neural_network(&cocomp, inputs, targets, 1, 1000);
-    forward_pass(&cocomp);
-    printf("Neural network output: %f\n", cocomp.output_layer[0]);
+    initialize_neural_network(cocomp);
+    train_neural_network(cocomp, inputs, targets, 1, 1000);
+    forward_pass(cocomp);
+    printf("Neural network output: %f\n", cocomp->network->output_layer[0]);
 
     // Simulate process and thread management
-    process_management(&cocomp, 2);
-    thread_management(&cocomp, 2);
+    process_management(cocomp, 2);
+    thread_management(cocomp, 2);
+
+    // Heap example: a pool and a block inside a scope marked on the arena
+    int mark = arena_mark(cocomp, cocomp->thread_id);
+    int block = allocate_heap(cocomp, 64);
+    int pool = create_pool(cocomp, 16, 4);
+    int object = pool_allocate(cocomp, pool);
+    printf("Heap block at %d, pool object at %d\n", block, object);
+    free_heap(cocomp, block);
+    print_heap_stats(cocomp);
+    arena_release(cocomp, cocomp->thread_id, mark);
 
     // Exception Handling Example
-    exception_handling(&cocomp, "Example exception occurred");
+    exception_handling(cocomp, "Example exception occurred");
 
     // IPC Example
-    ipc_send(&cocomp, 1, 42);
-    int message = ipc_receive(&cocomp, 1);
+    ipc_send(cocomp, 1, 42);
+    int message = ipc_receive(cocomp, 1);
     printf("Received IPC message: %d\n", message);
 
     // Dynamic Code Loading Example
-    unsigned char dynamic_code[] = {
-        0x01, 0x40, 0x00, 0x00, 0x02, // LOAD_FLOAT 4.56
-        0x06, 0x10,                   // JUMP to address 16
-        0xFF                          // END
-    };
-    load_dynamic_code(&cocomp, dynamic_code, sizeof(dynamic_code));
-    execute_program(&cocomp);
-    print_memory(&cocomp);
+    unsigned char *dynamic_code = assemble(
+        "    LOAD_FLOAT 4.56\n"
+        "    JUMP done\n"
+        "    ADD 1           ; skipped\n"
+        "done:\n"
+        "    END\n",
+        &size, error, sizeof(error));
+    if (!dynamic_code) {
+        printf("Assembler: %s\n", error);
+        return 1;
+    }
+    load_dynamic_code(cocomp, dynamic_code, size);  // runs it as well
+    free(dynamic_code);
+    print_memory(cocomp);
 
+#ifdef COCOMP_PROFILE
+    print_profile(cocomp);
+    export_folded_stacks(cocomp, "cocomp2.folded");
+#endif
+    destroy_cocomp(cocomp);
     return 0;
 }
+#endif
 
-void initialize(Cocomp *cocomp) {
-    memset(cocomp->memory, 0, MEMORY_SIZE);
-    memset(cocomp->heap, 0, HEAP_SIZE);
-    memset(cocomp->page_table, INVALID_PAGE, sizeof(cocomp->page_table));
-    memset(cocomp->page_directory, INVALID_PAGE, sizeof(cocomp->page_directory));
-    memset(cocomp->thread_stack_pointers, 0, sizeof(cocomp->thread_stack_pointers));
-    memset(cocomp->inter_process_comm, 0, sizeof(cocomp->inter_process_comm));
-    memset(cocomp->dynamic_code_area, 0, sizeof(cocomp->dynamic_code_area));
-    memset(cocomp->input_layer, 0, sizeof(cocomp->input_layer));
-    memset(cocomp->hidden_layer, 0, sizeof(cocomp->hidden_layer));
-    memset(cocomp->output_layer, 0, sizeof(cocomp->output_layer));
-    memset(cocomp->weights_input_hidden, 0, sizeof(cocomp->weights_input_hidden));
-    memset(cocomp->weights_hidden_output, 0, sizeof(cocomp->weights_hidden_output));
-    memset(cocomp->biases_hidden, 0, sizeof(cocomp->biases_hidden));
-    memset(cocomp->biases_output, 0, sizeof(cocomp->biases_output));
+// Round `used` up to a cache line and, if `base` is set, point `field` at
+// that offset from it; then reserve `count` elements there.
+#define CARVE(base, used, field, count) \
+    do { \
+        used = (used + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE; \
+        if (base) field = (void *)((unsigned char *)(base) + used); \
+        used += (size_t)(count) * sizeof(*field); \
+    } while (0)
+#define ROUND_TO_CACHE_LINE(size) (((size) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE)
 
-    cocomp->instruction_pointer = 0;
-    cocomp->accumulator = 0;
-    cocomp->stack_pointer = MEMORY_SIZE - STACK_SIZE;
-    cocomp->heap_pointer = 0;
-    cocomp->process_id = 0;
-    cocomp->task_id = 0;
-    cocomp->thread_id = 0;
-    cocomp->thread_count = 1; // Start with one thread
-    initialize_neural_network(cocomp);
+// Place the arrays of `cocomp`, whose sizes are already set, after the
+// struct in its region, and return the size of the region. With
+// assign == 0 only the size is computed.
+static size_t layout_cocomp(Cocomp *cocomp, int assign) {
+    Cocomp *base = assign ? cocomp : NULL;
+    size_t used = sizeof(Cocomp);
+    CARVE(base, used, cocomp->memory, cocomp->memory_size + MEMORY_PADDING);
+    CARVE(base, used, cocomp->decoded_index, cocomp->memory_size);
+    CARVE(base, used, cocomp->decoded, DECODED_CAPACITY(cocomp->memory_size));
+#if COCOMP_JIT
+    CARVE(base, used, cocomp->jit_counters, cocomp->memory_size);
+    CARVE(base, used, cocomp->jit_block_at, cocomp->memory_size);
+    CARVE(base, used, cocomp->jit_covered, cocomp->memory_size);
+#endif
+    CARVE(base, used, cocomp->thread_stack_pointers, cocomp->max_threads);
+    CARVE(base, used, cocomp->thread_return_depths, cocomp->max_threads);
+    CARVE(base, used, cocomp->thread_flags, cocomp->max_threads);
+    CARVE(base, used, cocomp->return_stacks, (size_t)cocomp->max_threads * CALL_DEPTH);
+    CARVE(base, used, cocomp->thread_instruction_pointers, cocomp->max_threads);
+    CARVE(base, used, cocomp->thread_accumulators, cocomp->max_threads);
+    CARVE(base, used, cocomp->thread_states, cocomp->max_threads);
+    CARVE(base, used, cocomp->thread_join_targets, cocomp->max_threads);
+#ifdef COCOMP_PROFILE
+    CARVE(base, used, cocomp->profile.address_counts, cocomp->memory_size);
+    CARVE(base, used, cocomp->profile.address_samples, cocomp->memory_size);
+    CARVE(base, used, cocomp->profile.address_cycles, cocomp->memory_size);
+    CARVE(base, used, cocomp->profile.current_frame, cocomp->max_threads);
+#endif
+    return ROUND_TO_CACHE_LINE(used);
 }
 
-void load_program(Cocomp *cocomp, unsigned char *program, int size) {
-    if (size > MEMORY_SIZE) {
-        printf("Program size exceeds memory capacity!\n");
+// The heap's arrays follow its struct in one allocation
+static size_t layout_heap(const Cocomp *cocomp, CocompHeap *heap, CocompHeap *base) {
+    size_t used = sizeof(CocompHeap);
+    CARVE(base, used, heap->bytes, cocomp->heap_size);
+    CARVE(base, used, heap->sizes, cocomp->heap_size);
+    CARVE(base, used, heap->arenas, cocomp->max_threads);
+    return ROUND_TO_CACHE_LINE(used);
+}
+
+static size_t layout_network(const Cocomp *cocomp, CocompNetwork *network, CocompNetwork *base) {
+    size_t used = sizeof(CocompNetwork);
+    CARVE(base, used, network->input_layer, cocomp->input_layer_size);
+    CARVE(base, used, network->hidden_layer, cocomp->hidden_layer_size);
+    CARVE(base, used, network->output_layer, cocomp->output_layer_size);
+    CARVE(base, used, network->weights_input_hidden, cocomp->input_layer_size * cocomp->hidden_layer_size);
+    CARVE(base, used, network->weights_hidden_output, cocomp->hidden_layer_size * cocomp->output_layer_size);
+    CARVE(base, used, network->biases_hidden, cocomp->hidden_layer_size);
+    CARVE(base, used, network->biases_output, cocomp->output_layer_size);
+    return ROUND_TO_CACHE_LINE(used);
+}
+
+// Zeroed, cache-line-aligned memory for a component, or NULL
+static void *allocate_component(size_t size, const char *what) {
+    void *component = aligned_alloc(CACHE_LINE_SIZE, ROUND_TO_CACHE_LINE(size));
+    if (!component) {
+        printf("Cannot allocate %s\n", what);
+        return NULL;
+    }
+    memset(component, 0, size);
+    return component;
+}
+
+// VIRTUAL_PAGES_PER_FRAME pages per frame, as far as 32-bit addresses reach
+static long default_virtual_pages(const Cocomp *cocomp) {
+    long pages = (long)cocomp->num_frames * VIRTUAL_PAGES_PER_FRAME;
+    long limit = MAX_VIRTUAL_SIZE / VM_PAGE_SIZE(cocomp);
+    return pages < limit ? pages : limit;
+}
+
+static int check_config(const CocompConfig *config) {
+#ifdef COCOMP_FIXED_CONFIG
+    static const CocompConfig defaults = COCOMP_DEFAULT_CONFIG;
+    if (memcmp(config, &defaults, sizeof(CocompConfig)) != 0) {
+        printf("This build only supports the default VM sizes\n");
+        return 0;
+    }
+#endif
+    int page = config->page_size;
+    if (page < 16 || (page & (page - 1)) != 0) {
+        printf("Page size %d is not a power of two of at least 16\n", page);
+        return 0;
+    }
+    if (config->memory_size < page || config->memory_size % page != 0 || config->memory_size / page > MAX_FRAMES) {
+        printf("Memory size %d must be 1 to %d pages of %d bytes\n", config->memory_size, MAX_FRAMES, page);
+        return 0;
+    }
+    if (config->max_threads < 1 || config->max_threads > THREAD_LIMIT) {
+        printf("max_threads must be 1 to %d\n", THREAD_LIMIT);
+        return 0;
+    }
+    if (config->stack_size < 16 || config->stack_size % sizeof(double) != 0) {
+        printf("Stack size %d must be a multiple of %d bytes, at least 16\n", config->stack_size, (int)sizeof(double));
+        return 0;
+    }
+    if (config->stack_size + (config->max_threads - 1) * THREAD_STACK_SIZE >= config->memory_size) {
+        printf("Stacks of %d threads do not fit in %d bytes of memory\n", config->max_threads, config->memory_size);
+        return 0;
+    }
+    if (config->heap_size < config->max_threads) {
+        printf("Heap of %d bytes is too small for %d arenas\n", config->heap_size, config->max_threads);
+        return 0;
+    }
+    if (config->input_layer_size < 1 || config->hidden_layer_size < 1 || config->output_layer_size < 1) {
+        printf("Layer sizes must be at least 1\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Allocate and initialize a VM with the sizes in `config`, or the default
+// sizes if it is NULL. Returns NULL if the sizes are unusable or the
+// allocation fails.
+Cocomp *create_cocomp(const CocompConfig *config) {
+    static const CocompConfig defaults = COCOMP_DEFAULT_CONFIG;
+    Cocomp sizes;  // only the size fields are used
+    if (!config) {
+        config = &defaults;
+    }
+    if (!check_config(config)) {
+        return NULL;
+    }
+    memset(&sizes, 0, sizeof(Cocomp));
+    sizes.memory_size = config->memory_size;
+    sizes.heap_size = config->heap_size;
+    sizes.stack_size = config->stack_size;
+    sizes.page_shift = __builtin_ctz(config->page_size);
+    sizes.num_frames = config->memory_size / config->page_size;
+    sizes.max_threads = config->max_threads;
+    sizes.heap_arena_size = config->heap_size / config->max_threads;
+    sizes.input_layer_size = config->input_layer_size;
+    sizes.hidden_layer_size = config->hidden_layer_size;
+    sizes.output_layer_size = config->output_layer_size;
+    sizes.region_size = layout_cocomp(&sizes, 0);
+
+    Cocomp *cocomp = aligned_alloc(CACHE_LINE_SIZE, sizes.region_size);
+    if (!cocomp) {
+        printf("Cannot allocate %zu bytes for a VM\n", sizes.region_size);
+        return NULL;
+    }
+    memcpy(cocomp, &sizes, sizeof(Cocomp));
+    layout_cocomp(cocomp, 1);
+    cocomp->virtual_pages = default_virtual_pages(cocomp);
+    initialize(cocomp);
+    return cocomp;
+}
+
+// Components of a forked VM start out in its snapshot mapping, and go
+// with it.
+static void free_component(Cocomp *cocomp, void *component) {
+    unsigned char *bytes = component;
+    if (bytes < (unsigned char *)cocomp || bytes >= (unsigned char *)cocomp + cocomp->mapped_size) {
+        free(component);
+    }
+}
+
+static void free_ipc(Cocomp *cocomp) {
+    CocompIpc *ipc = cocomp->ipc;
+    if (!ipc) {
         return;
     }
-    memcpy(cocomp->memory, program, size);
+    for (int i = 0; i < IPC_MAILBOXES; i++) {
+        release_channel(ipc->send_channels[i]);
+        release_channel(ipc->receive_channels[i]);
+    }
+    free_component(cocomp, ipc);
+    cocomp->ipc = NULL;
 }
 
-void execute_program(Cocomp *cocomp) {
-    int running = 1;
-    while (running && cocomp->instruction_pointer < MEMORY_SIZE) {
-        unsigned char instruction = cocomp->memory[cocomp->instruction_pointer];
-        switch (instruction) {
-            case 0x01:  // LOAD_FLOAT immediate value into accumulator
-                {
-                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
-                    cocomp->accumulator = *(double*)ptr;
-                    cocomp->instruction_pointer += sizeof(double);
-                }
-                break;
-            case 0x02:  // ADD immediate value to accumulator
-                {
-                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
-                    cocomp->accumulator += *(double*)ptr;
-                    cocomp->instruction_pointer += sizeof(double);
-                }
-                break;
-            case 0x03:  // STORE accumulator to memory
-                {
-                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
-                    int address = *(int*)ptr;
-                    if (address >= 0 && address < MEMORY_SIZE) {
-                        *(double*)&cocomp->memory[address] = cocomp->accumulator;
-                    } else {
-                        printf("Invalid memory address %d\n", address);
-                    }
-                    cocomp->instruction_pointer += sizeof(int);
-                }
-                break;
-            case 0x04:  // PUSH accumulator onto stack
-                push_stack(cocomp, cocomp->accumulator);
-                break;
-            case 0x05:  // POP from stack into accumulator
-                cocomp->accumulator = pop_stack(cocomp);
-                break;
-            case 0x06:  // JUMP to address
-                {
-                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
-                    cocomp->instruction_pointer = *(int*)ptr - 1;
-                }
-                break;
-            case 0x07:  // CALL function
-                push_stack(cocomp, cocomp->instruction_pointer + 1);
-                cocomp->instruction_pointer = cocomp->memory[++cocomp->instruction_pointer] - 1;
-                break;
-            case 0x08:  // RETURN from function
-                cocomp->instruction_pointer = (int)pop_stack(cocomp) - 1;
-                break;
-            case 0x09:  // NOP (No Operation)
-                cocomp->instruction_pointer++;
-                break;
-            case 0x0A:  // SUBTRACT immediate value from accumulator
-                {
-                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
-                    cocomp->accumulator -= *(double*)ptr;
-                    cocomp->instruction_pointer += sizeof(double);
-                }
-                break;
-            case 0x0B:  // COMPARE accumulator with immediate value
-                {
-                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
-                    double value = *(double*)ptr;
-                    if (cocomp->accumulator == value) {
-                        // Set flag or branch if necessary
-                    }
-                    cocomp->instruction_pointer += sizeof(double);
-                }
-                break;
-            case 0x0C:  // SYSTEM CALL (for I/O or other operations)
-                handle_interrupt(cocomp, cocomp->memory[++cocomp->instruction_pointer]);
-                break;
-            case 0x0D:  // CALL function
-                push_stack(cocomp, cocomp->instruction_pointer + 1);
-                cocomp->instruction_pointer = cocomp->memory[++cocomp->instruction_pointer] - 1;
-                break;
-            case 0x0E:  // RETURN from function
-                cocomp->instruction_pointer = (int)pop_stack(cocomp) - 1;
-                break;
-            case 0x0F:  // BITWISE AND accumulator with immediate value
-                {
-                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
-                    int value = *(int*)ptr;
-                    cocomp->accumulator = (int)cocomp->accumulator & value;
-                    cocomp->instruction_pointer += sizeof(int);
-                }
-                break;
-            case 0x10:  // BITWISE OR accumulator with immediate value
-                {
-                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
-                    int value = *(int*)ptr;
-                    cocomp->accumulator = (int)cocomp->accumulator | value;
-                    cocomp->instruction_pointer += sizeof(int);
-                }
-                break;
-            case 0x11:  // BITWISE XOR accumulator with immediate value
-                {
-                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
-                    int value = *(int*)ptr;
-                    cocomp->accumulator = (int)cocomp->accumulator ^ value;
-                    cocomp->instruction_pointer += sizeof(int);
-                }
-                break;
-            case 0x12:  // SHIFT LEFT accumulator by immediate value
-                {
-                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
-                    int value = *(int*)ptr;
-                    cocomp->accumulator = (int)cocomp->accumulator << value;
-                    cocomp->instruction_pointer += sizeof(int);
-                }
-                break;
-            case 0x13:  // SHIFT RIGHT accumulator by immediate value
-                {
-                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
-                    int value = *(int*)ptr;
-                    cocomp->accumulator = (int)cocomp->accumulator >> value;
-                    cocomp->instruction_pointer += sizeof(int);
-                }
-                break;
-            case 0xFF:  // END program
+static void free_paging(Cocomp *cocomp) {
+    CocompPaging *paging = cocomp->paging;
+    if (!paging) {
+        return;
+    }
+    close_swap(cocomp);
+    free_component(cocomp, paging);
+    cocomp->paging = NULL;
+}
+
+// Copy of `cocomp` and of each component it has created. A VM with a swap
+// file cannot be copied, as both copies would write to the same file.
+Cocomp *clone_cocomp(const Cocomp *cocomp) {
+    if (cocomp->paging && cocomp->paging->swap_fd >= 0) {
+        printf("Cannot clone a VM with a swap file\n");
+        return NULL;
+    }
+    Cocomp *copy = aligned_alloc(CACHE_LINE_SIZE, cocomp->region_size);
+    if (!copy) {
+        printf("Cannot allocate %zu bytes for a VM\n", cocomp->region_size);
+        return NULL;
+    }
+    memcpy(copy, cocomp, cocomp->region_size);
+    layout_cocomp(copy, 1);
+    copy->mapped_size = 0;
+    copy->paging = NULL;
+    copy->heap = NULL;
+    copy->network = NULL;
+    copy->ipc = NULL;
+    copy->console = NULL;  // output not yet written stays with the original
+    copy->files = NULL;    // so do the mount and open files
+#if COCOMP_JIT
+    copy->jit_code = NULL;  // compiled blocks point at the original
+    jit_flush(copy);
+#endif
+    if (cocomp->paging) {
+        CocompPaging *paging = allocate_component(sizeof(CocompPaging), "paging state");
+        if (!paging) goto failed;
+        memcpy(paging, cocomp->paging, sizeof(CocompPaging));
+        paging->page_directory = &paging->first_directory_entry;
+        paging->first_directory_entry.table = paging->first_page_table;
+        paging->swap = NULL;
+        copy->paging = paging;
+        if (cocomp->paging->swap) {
+            size_t size = cocomp->virtual_pages << cocomp->page_shift;
+            unsigned char *swap = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (swap == MAP_FAILED) {
+                printf("Cannot allocate swap\n");
+                goto failed;
+            }
+            memcpy(swap, cocomp->paging->swap, size);
+            paging->swap = swap;
+        }
+    }
+    if (cocomp->heap) {
+        size_t size = layout_heap(cocomp, cocomp->heap, NULL);
+        if (!(copy->heap = allocate_component(size, "a heap"))) goto failed;
+        memcpy(copy->heap, cocomp->heap, size);
+        layout_heap(copy, copy->heap, copy->heap);
+    }
+    if (cocomp->network) {
+        size_t size = layout_network(cocomp, cocomp->network, NULL);
+        if (!(copy->network = allocate_component(size, "a neural network"))) goto failed;
+        memcpy(copy->network, cocomp->network, size);
+        layout_network(copy, copy->network, copy->network);
+    }
+    // channels stay with the original; the copy starts unconnected
+    return copy;
+
+failed:
+    destroy_cocomp(copy);
+    return NULL;
+}
+
+static int write_snapshot(int fd, const void *data, size_t size, size_t offset) {
+    const unsigned char *bytes = data;
+    while (size > 0) {
+        ssize_t written = pwrite(fd, bytes, size, offset);
+        if (written <= 0) {
+            return 0;
+        }
+        bytes += written;
+        size -= written;
+        offset += written;
+    }
+    return 1;
+}
+
+// Save `cocomp`, typically just after its setup has run, for fork_cocomp.
+// Compiled JIT code is not kept. Returns NULL if the VM has a swap file or
+// the snapshot cannot be written.
+CocompSnapshot *snapshot_cocomp(const Cocomp *cocomp) {
+    CocompSnapshot *snapshot = calloc(1, sizeof(CocompSnapshot));
+    char name[] = "/tmp/cocomp-snapshot-XXXXXX";
+    int fd = mkstemp(name);
+    if (fd >= 0) unlink(name);
+    // A clone has the JIT state cleared and components laid out as usual
+    Cocomp *copy = clone_cocomp(cocomp);
+    if (!snapshot || fd < 0 || !copy) {
+        printf("Cannot create a snapshot\n");
+        goto failed;
+    }
+    size_t size = copy->region_size;
+    int written = write_snapshot(fd, copy, size, 0);
+    if (copy->heap) {
+        snapshot->heap_offset = size;
+        size += layout_heap(copy, copy->heap, NULL);
+        written &= write_snapshot(fd, copy->heap, size - snapshot->heap_offset, snapshot->heap_offset);
+    }
+    if (copy->network) {
+        snapshot->network_offset = size;
+        size += layout_network(copy, copy->network, NULL);
+        written &= write_snapshot(fd, copy->network, size - snapshot->network_offset, snapshot->network_offset);
+    }
+    if (copy->paging) {
+        snapshot->paging_offset = size;
+        size += ROUND_TO_CACHE_LINE(sizeof(CocompPaging));
+        written &= write_snapshot(fd, copy->paging, sizeof(CocompPaging), snapshot->paging_offset);
+    }
+    snapshot->size = size;
+    if (copy->paging && copy->paging->swap) {
+        long page = sysconf(_SC_PAGESIZE);
+        snapshot->swap_offset = (size + page - 1) / page * page;
+        snapshot->swap_size = copy->virtual_pages << copy->page_shift;
+        written &= write_snapshot(fd, copy->paging->swap, snapshot->swap_size, snapshot->swap_offset);
+    }
+    if (!written) {
+        printf("Cannot write a snapshot\n");
+        goto failed;
+    }
+    destroy_cocomp(copy);
+    snapshot->fd = fd;
+    return snapshot;
+
+failed:
+    destroy_cocomp(copy);
+    if (fd >= 0) close(fd);
+    free(snapshot);
+    return NULL;
+}
+
+// A new VM in the state `snapshot` was taken in. Its pages are shared with
+// the snapshot until written, so the cost does not depend on the VM's
+// size. Returns NULL if the snapshot cannot be mapped.
+Cocomp *fork_cocomp(const CocompSnapshot *snapshot) {
+    unsigned char *base = mmap(NULL, snapshot->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, snapshot->fd, 0);
+    if (base == MAP_FAILED) {
+        printf("Cannot map a snapshot\n");
+        return NULL;
+    }
+    Cocomp *cocomp = (Cocomp *)base;
+    cocomp->mapped_size = snapshot->size;
+    layout_cocomp(cocomp, 1);
+    cocomp->heap = snapshot->heap_offset ? (CocompHeap *)(base + snapshot->heap_offset) : NULL;
+    cocomp->network = snapshot->network_offset ? (CocompNetwork *)(base + snapshot->network_offset) : NULL;
+    cocomp->paging = snapshot->paging_offset ? (CocompPaging *)(base + snapshot->paging_offset) : NULL;
+    if (cocomp->heap) {
+        layout_heap(cocomp, cocomp->heap, cocomp->heap);
+    }
+    if (cocomp->network) {
+        layout_network(cocomp, cocomp->network, cocomp->network);
+    }
+    if (cocomp->paging) {
+        CocompPaging *paging = cocomp->paging;
+        paging->page_directory = &paging->first_directory_entry;
+        paging->first_directory_entry.table = paging->first_page_table;
+        paging->swap = NULL;
+        if (snapshot->swap_size) {
+            unsigned char *swap = mmap(NULL, snapshot->swap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                                       snapshot->fd, snapshot->swap_offset);
+            if (swap == MAP_FAILED) {
+                printf("Cannot map swap from a snapshot\n");
+                destroy_cocomp(cocomp);
+                return NULL;
+            }
+            paging->swap = swap;
+        }
+    }
+    return cocomp;
+}
+
+// Forks live on after their snapshot is destroyed
+void destroy_snapshot(CocompSnapshot *snapshot) {
+    if (!snapshot) {
+        return;
+    }
+    close(snapshot->fd);
+    free(snapshot);
+}
+
+void destroy_cocomp(Cocomp *cocomp) {
+    if (!cocomp) {
+        return;
+    }
+    free_paging(cocomp);
+    free_component(cocomp, cocomp->heap);
+    free_component(cocomp, cocomp->network);
+    free_ipc(cocomp);
+    unmount_fs(cocomp);
+    flush_console(cocomp);
+    free_component(cocomp, cocomp->console);
+#if COCOMP_JIT
+    if (cocomp->jit_code) {
+        munmap(cocomp->jit_code, JIT_BUFFER_SIZE);
+    }
+#endif
+    if (cocomp->mapped_size) {
+        munmap(cocomp, cocomp->mapped_size);
+    } else {
+        free(cocomp);
+    }
+}
+
+// Code is fetched without translation, so the frames holding the loaded
+// program must stay put.
+static void pin_code_frames(Cocomp *cocomp) {
+    CocompPaging *paging = cocomp->paging;
+    paging->pinned_frames = 0;
+    for (int frame = 0; frame < cocomp->num_frames; frame++) {
+        paging->frame_pinned[frame] = frame * VM_PAGE_SIZE(cocomp) < cocomp->code_size;
+        paging->pinned_frames += paging->frame_pinned[frame];
+    }
+}
+
+// The VM's paging state, created on first use with virtual page n in
+// frame n. NULL if it cannot be allocated.
+CocompPaging *get_paging(Cocomp *cocomp) {
+    if (!cocomp->paging) {
+        CocompPaging *paging = allocate_component(sizeof(CocompPaging), "paging state");
+        if (!paging) {
+            return NULL;
+        }
+        paging->page_directory = &paging->first_directory_entry;
+        paging->swap_fd = -1;
+        paging->resident_frames = cocomp->num_frames;
+        memset(paging->frame_pages, -1, sizeof(paging->frame_pages));
+        cocomp->paging = paging;
+        reset_mmu(cocomp);
+        pin_code_frames(cocomp);
+        unverify_program(cocomp);  // STOREs have to be translated from now on
+    }
+    return cocomp->paging;
+}
+
+CocompHeap *get_heap(Cocomp *cocomp) {
+    if (!cocomp->heap) {
+        CocompHeap *heap = allocate_component(layout_heap(cocomp, NULL, NULL), "a heap");
+        if (!heap) {
+            return NULL;
+        }
+        layout_heap(cocomp, heap, heap);
+        cocomp->heap = heap;
+        reset_heap(cocomp);
+    }
+    return cocomp->heap;
+}
+
+// Weights start out random, as set by initialize_neural_network
+CocompNetwork *get_network(Cocomp *cocomp) {
+    if (!cocomp->network) {
+        CocompNetwork *network = allocate_component(layout_network(cocomp, NULL, NULL), "a neural network");
+        if (!network) {
+            return NULL;
+        }
+        layout_network(cocomp, network, network);
+        cocomp->network = network;
+        initialize_neural_network(cocomp);
+    }
+    return cocomp->network;
+}
+
+CocompIpc *get_ipc(Cocomp *cocomp) {
+    if (!cocomp->ipc) {
+        cocomp->ipc = allocate_component(sizeof(CocompIpc), "IPC state");
+    }
+    return cocomp->ipc;
+}
+
+static FILE *console_file(Cocomp *cocomp) {
+    return cocomp->console_file ? cocomp->console_file : stdout;
+}
+
+CocompConsole *get_console(Cocomp *cocomp) {
+    if (!cocomp->console) {
+        cocomp->console = allocate_component(sizeof(CocompConsole), "a console");
+    }
+    return cocomp->console;
+}
+
+// Send the console's output to `file` (NULL for stdout) in `mode`, after
+// writing out what it has collected so far.
+void set_console(Cocomp *cocomp, int mode, FILE *file) {
+    flush_console(cocomp);
+    cocomp->console_mode = mode;
+    cocomp->console_file = file;
+}
+
+// Batches of CONSOLE_BACKGROUND output on their way to the writer thread,
+// which is started by the first one and drained at exit.
+typedef struct ConsoleBatch {
+    struct ConsoleBatch *next;
+    FILE *file;
+    size_t size;
+    char text[];
+} ConsoleBatch;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t idle;     // nothing queued or being written
+    ConsoleBatch *head;
+    ConsoleBatch *tail;
+    int writing;
+    int started;
+} console_writer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .queued = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+};
+
+static void *console_writer_main(void *unused) {
+    (void)unused;
+    pthread_mutex_lock(&console_writer.lock);
+    for (;;) {
+        while (!console_writer.head) {
+            console_writer.writing = 0;
+            pthread_cond_broadcast(&console_writer.idle);
+            pthread_cond_wait(&console_writer.queued, &console_writer.lock);
+        }
+        ConsoleBatch *batch = console_writer.head;
+        console_writer.head = batch->next;
+        if (!console_writer.head) {
+            console_writer.tail = NULL;
+        }
+        console_writer.writing = 1;
+        pthread_mutex_unlock(&console_writer.lock);
+        fwrite(batch->text, 1, batch->size, batch->file);
+        fflush(batch->file);
+        free(batch);
+        pthread_mutex_lock(&console_writer.lock);
+    }
+    return NULL;
+}
+
+// Returns 0 if the batch cannot be queued, and should be written by the
+// caller.
+static int queue_console_batch(FILE *file, const char *text, size_t size) {
+    ConsoleBatch *batch = malloc(sizeof(ConsoleBatch) + size);
+    if (!batch) {
+        return 0;
+    }
+    batch->next = NULL;
+    batch->file = file;
+    batch->size = size;
+    memcpy(batch->text, text, size);
+    pthread_mutex_lock(&console_writer.lock);
+    if (!console_writer.started) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, console_writer_main, NULL) != 0) {
+            pthread_mutex_unlock(&console_writer.lock);
+            free(batch);
+            return 0;
+        }
+        pthread_detach(thread);
+        console_writer.started = 1;
+        atexit(sync_console);
+    }
+    if (console_writer.tail) {
+        console_writer.tail->next = batch;
+    } else {
+        console_writer.head = batch;
+    }
+    console_writer.tail = batch;
+    console_writer.writing = 1;
+    pthread_cond_signal(&console_writer.queued);
+    pthread_mutex_unlock(&console_writer.lock);
+    return 1;
+}
+
+// Wait until the writer thread has written every batch handed to it
+void sync_console(void) {
+    pthread_mutex_lock(&console_writer.lock);
+    while (console_writer.started && console_writer.writing) {
+        pthread_cond_wait(&console_writer.idle, &console_writer.lock);
+    }
+    pthread_mutex_unlock(&console_writer.lock);
+}
+
+// Write out, or hand to the writer thread, what a buffered console has
+// collected.
+void flush_console(Cocomp *cocomp) {
+    CocompConsole *console = cocomp->console;
+    if (!console || !console->used) {
+        return;
+    }
+    FILE *file = console_file(cocomp);
+    if (cocomp->console_mode != CONSOLE_BACKGROUND || !queue_console_batch(file, console->text, console->used)) {
+        fwrite(console->text, 1, console->used, file);
+    }
+    console->used = 0;
+    console->batches++;
+}
+
+static void console_vprint(Cocomp *cocomp, const char *format, va_list args) {
+    CocompConsole *console = cocomp->console_mode == CONSOLE_DIRECT ? NULL : get_console(cocomp);
+    if (!console) {
+        vfprintf(console_file(cocomp), format, args);
+        return;
+    }
+    va_list retry;
+    va_copy(retry, args);
+    size_t room = CONSOLE_BUFFER_SIZE - console->used;
+    int length = vsnprintf(console->text + console->used, room, format, args);
+    if (length >= 0 && (size_t)length >= room) {
+        flush_console(cocomp);
+        if (length < CONSOLE_BUFFER_SIZE) {
+            vsnprintf(console->text, CONSOLE_BUFFER_SIZE, format, retry);
+        } else {
+            sync_console();  // longer than a whole buffer: after what came before it
+            vfprintf(console_file(cocomp), format, retry);
+            length = 0;
+        }
+    }
+    if (length > 0) {
+        console->used += length;
+    }
+    va_end(retry);
+}
+
+// printf to the VM's console. Nothing is formatted while it is silent.
+void console_print(Cocomp *cocomp, const char *format, ...) {
+    if (cocomp->console_mode == CONSOLE_SILENT) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    console_vprint(cocomp, format, args);
+    va_end(args);
+}
+
+// Record why a call failed in the VM's status, and describe it on the
+// console unless that is silent.
+void report_error(Cocomp *cocomp, int status, const char *format, ...) {
+    cocomp->status = status;
+    if (cocomp->console_mode == CONSOLE_SILENT) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    console_vprint(cocomp, format, args);
+    va_end(args);
+}
+
+const char *status_name(int status) {
+    static const char *names[COCOMP_STATUS_COUNT] = {
+        "ok", "stack overflow", "stack underflow", "invalid memory address", "unknown instruction",
+        "unknown syscall", "program too large", "thread limit", "deadlock", "invalid heap call",
+        "heap full", "out of memory", "invalid process ID", "channel full", "channel empty",
+        "no file system", "no such file", "bad file descriptor", "file system full", "bad program image"
+    };
+    return status >= 0 && status < COCOMP_STATUS_COUNT ? names[status] : "unknown status";
+}
+
+// Reset a VM created by create_cocomp to its starting state. Components
+// are dropped, to be created afresh when next used, and the file system is
+// unmounted; paging with a swap file is kept, with the file emptied.
+void initialize(Cocomp *cocomp) {
+    if (cocomp->paging && cocomp->paging->swap_fd < 0) {
+        free_paging(cocomp);
+    }
+    memset(cocomp->memory, 0, cocomp->memory_size + MEMORY_PADDING);
+    cocomp->code_size = 0;
+    cocomp->code_format = CODE_RAW;
+    cocomp->constant_pool = 0;
+    cocomp->constant_count = 0;
+    reset_mmu(cocomp);
+    free_component(cocomp, cocomp->heap);
+    free_component(cocomp, cocomp->network);
+    free_ipc(cocomp);
+    unmount_fs(cocomp);
+    cocomp->heap = NULL;
+    cocomp->network = NULL;
+    reset_decoded(cocomp);
+    cocomp->fusion_enabled = 1;
+    memset(cocomp->fusion_counts, 0, sizeof(cocomp->fusion_counts));
+    cocomp->jit_enabled = COCOMP_JIT;
+#ifdef COCOMP_PROFILE
+    // Every guest instruction has to pass through dispatch to be counted.
+    cocomp->fusion_enabled = 0;
+    cocomp->jit_enabled = 0;
+    reset_profile(cocomp);
+#endif
+#if COCOMP_JIT
+    jit_flush(cocomp);
+#endif
+
+    cocomp->instruction_pointer = 0;
+    cocomp->accumulator = 0;
+    cocomp->stack_pointer = cocomp->memory_size;  // empty
+    cocomp->process_id = 0;
+    cocomp->task_id = 0;
+    reset_threads(cocomp);
+    cocomp->time_slice = THREAD_TIME_SLICE;
+    flush_console(cocomp);  // the console's mode and file are the host's to keep
+    cocomp->status = COCOMP_OK;
+}
+
+// Switch the STOREs of a program verify_program accepted to their unchecked
+// forms, which are only right while no code lies outside the program and
+// memory is not paged.
+static void mark_verified(Cocomp *cocomp) {
+    for (int i = 1; i < cocomp->decoded_count; i++) {
+        DecodedInstruction *d = &cocomp->decoded[i];
+        if (d->op == OP_STORE) {
+            d->op = OP_STORE_VERIFIED;
+        } else if (d->op == OP_FUSED_LOAD_ARITH_STORE) {
+            d->op = OP_FUSED_LOAD_ARITH_STORE_VERIFIED;
+        }
+    }
+    cocomp->verified = 1;
+}
+
+// Go back to checked STOREs, when code is about to be decoded outside the
+// verified program or memory becomes paged. Safe to call from a handler:
+// entries are rewritten in place.
+void unverify_program(Cocomp *cocomp) {
+    if (!cocomp->verified) {
+        return;
+    }
+    for (int i = 1; i < cocomp->decoded_count; i++) {
+        DecodedInstruction *d = &cocomp->decoded[i];
+        if (d->op == OP_STORE_VERIFIED) {
+            d->op = OP_STORE;
+        } else if (d->op == OP_FUSED_LOAD_ARITH_STORE_VERIFIED) {
+            d->op = OP_FUSED_LOAD_ARITH_STORE;
+        }
+    }
+    cocomp->verified = 0;
+}
+
+// A stack slot above a verified program cannot hold decoded code and memory
+// is not paged, so it is copied directly; anything else goes through the MMU.
+static void write_stack_slot(Cocomp *cocomp, int address, double value) {
+    if (cocomp->verified && address >= cocomp->code_size) {
+        memcpy(&cocomp->memory[address], &value, sizeof(double));
+    } else {
+        mmu_write(cocomp, address, &value, sizeof(double));
+    }
+}
+
+static double read_stack_slot(Cocomp *cocomp, int address) {
+    double value = 0;
+    if (cocomp->verified && address >= cocomp->code_size) {
+        memcpy(&value, &cocomp->memory[address], sizeof(double));
+    } else {
+        mmu_read(cocomp, address, &value, sizeof(double));
+    }
+    return value;
+}
+
+// CALL and RETURN use the running thread's return stack, which lives
+// outside guest memory, so PUSH and POP can neither see nor overwrite
+// return addresses. Returns 0 when the stack is full.
+static int push_return(Cocomp *cocomp, int address) {
+    if (cocomp->return_depth == CALL_DEPTH) {
+        report_error(cocomp, COCOMP_STACK_OVERFLOW, "Call stack overflow!\n");
+        return 0;
+    }
+    cocomp->return_stacks[cocomp->thread_id * CALL_DEPTH + cocomp->return_depth++] = address;
+    return 1;
+}
+
+// The address to return to, or -1 after a RETURN with no CALL
+static int pop_return(Cocomp *cocomp) {
+    if (cocomp->return_depth == 0) {
+        report_error(cocomp, COCOMP_STACK_UNDERFLOW, "RETURN without a CALL!\n");
+        return -1;
+    }
+    return cocomp->return_stacks[cocomp->thread_id * CALL_DEPTH + --cocomp->return_depth];
+}
+
+// Size a compact image takes in memory: its code, padded to 8 bytes, and
+// then its constant pool. -1 if `image` is not a compact image this VM can
+// read.
+static long compact_program_size(const unsigned char *image, long size, CompactHeader *header) {
+    if (size < (long)sizeof(CompactHeader)) {
+        return -1;
+    }
+    memcpy(header, image, sizeof(CompactHeader));
+    if (memcmp(header->magic, COMPACT_MAGIC, 4) || header->version != COMPACT_VERSION || header->flags ||
+        header->constant_count > INT_MAX / sizeof(double) ||
+        size != (long)sizeof(CompactHeader) + (long)(header->constant_count * sizeof(double)) + (long)header->code_size) {
+        return -1;
+    }
+    return ((long)header->code_size + 7) / 8 * 8 + (long)(header->constant_count * sizeof(double));
+}
+
+// Copy a raw program, or the code and constant pool of a compact image, to
+// address 0. Returns the bytes of code, or -1 if the program is malformed
+// or does not fit.
+static int place_program(Cocomp *cocomp, const unsigned char *program, long size) {
+    CompactHeader header;
+    int compact = size >= 4 && !memcmp(program, COMPACT_MAGIC, 4);
+    long program_size = compact ? compact_program_size(program, size, &header) : size;
+    if (program_size < 0) {
+        report_error(cocomp, COCOMP_BAD_PROGRAM, "Not a version %d compact bytecode image\n", COMPACT_VERSION);
+        return -1;
+    }
+    if (program_size > VM_MEMORY_SIZE(cocomp)) {
+        report_error(cocomp, COCOMP_PROGRAM_TOO_LARGE, "Program size exceeds memory capacity!\n");
+        return -1;
+    }
+    reset_page_mapping(cocomp);
+    if (compact) {
+        const unsigned char *pool = program + sizeof(CompactHeader);
+        int pool_size = header.constant_count * sizeof(double);
+        cocomp->constant_pool = program_size - pool_size;
+        cocomp->constant_count = header.constant_count;
+        memcpy(cocomp->memory, pool + pool_size, header.code_size);
+        memset(&cocomp->memory[header.code_size], 0, cocomp->constant_pool - header.code_size);
+        memcpy(&cocomp->memory[cocomp->constant_pool], pool, pool_size);
+        cocomp->code_format = CODE_COMPACT;
+    } else {
+        memcpy(cocomp->memory, program, size);
+        cocomp->constant_pool = size;
+        cocomp->constant_count = 0;
+        cocomp->code_format = CODE_RAW;
+    }
+    cocomp->code_size = program_size;
+    if (cocomp->paging) {
+        pin_code_frames(cocomp);
+    }
+    return compact ? (int)header.code_size : size;
+}
+
+// Decode the instruction at `address` of a program of `size` bytes without
+// reading past its end; `pool` is NULL for raw code. Returns 0 if the
+// instruction does not fit.
+static int decode_in_program(const unsigned char *program, int size, int address,
+                             const unsigned char *pool, int pool_count, DecodedInstruction *d) {
+    unsigned char bytes[MAX_INSTRUCTION_LENGTH] = {0};
+    const unsigned char *code = program;
+    int at = address;
+    if (size - address < MAX_INSTRUCTION_LENGTH) {
+        memcpy(bytes, &program[address], size - address);
+        code = bytes;
+        at = 0;
+    }
+    if (pool) {
+        decode_compact(code, at, pool, pool_count, d);
+    } else {
+        decode_bytes(code, at, d);
+    }
+    return address + d->length <= size;
+}
+
+// JUMP, CALL and the conditional branches hold a code address in ivalue
+static int has_code_target(int op) {
+    return op == OP_JUMP || op == OP_CALL || (op >= OP_BRANCH_EQUAL && op <= OP_DECREMENT_BRANCH);
+}
+
+// Whether vector instruction `d` keeps within `limit` bytes of memory. VADD
+// and VMUL ranges must be the same or apart; VCOPY ranges may overlap.
+static int vector_in_range(const DecodedInstruction *d, long limit) {
+    long bytes = (long)d->vector_count * sizeof(double);
+    if (d->vector_count < 0 || d->ivalue < 0 || d->ivalue + bytes > limit) {
+        return 0;
+    }
+    if (d->opcode == 0x1C) {  // VFILL has no source
+        return 1;
+    }
+    if (d->vector_source < 0 || d->vector_source + bytes > limit) {
+        return 0;
+    }
+    return d->opcode == 0x1B || d->opcode == 0x1D || d->ivalue == d->vector_source ||
+           d->ivalue + bytes <= d->vector_source || d->vector_source + bytes <= d->ivalue;
+}
+
+// verify_program for `code_end` bytes of code, which with their constant
+// pool (NULL for raw code) take `program_size` bytes of memory.
+static const char *verify_code(const unsigned char *code, int code_end, int program_size, int memory_size,
+                               const unsigned char *pool, int pool_count, int *address) {
+    const char *problem = NULL;
+    int at = -1;
+    DecodedInstruction d;
+    if (code_end <= 0 || program_size > memory_size) {
+        problem = "program does not fit in memory";
+    }
+    unsigned char *starts = problem ? NULL : calloc(code_end, 1);
+    if (!problem && !starts) {
+        problem = "out of memory";
+    }
+    for (int i = 0; !problem && i < code_end; i += d.length) {
+        if (!decode_in_program(code, code_end, i, pool, pool_count, &d)) {
+            problem = "immediate runs past the end of the program";
+            at = i;
+        } else if (d.op == OP_UNKNOWN) {
+            problem = "unknown instruction";
+            at = i;
+        } else if (d.op == OP_STORE && (d.ivalue < program_size || d.ivalue > memory_size - (int)sizeof(double))) {
+            problem = d.ivalue >= 0 && d.ivalue < program_size ? "STORE into the program" : "STORE outside memory";
+            at = i;
+        } else if (d.op == OP_VECTOR && (!vector_in_range(&d, memory_size) ||
+                                         (d.opcode != 0x1B && d.vector_count > 0 && d.ivalue < program_size))) {
+            problem = vector_in_range(&d, memory_size) ? "vector write into the program" : "bad vector range";
+            at = i;
+        }
+        if (!problem) {
+            starts[i] = 1;
+        }
+    }
+    for (int i = 0; !problem && i < code_end; i += d.length) {
+        decode_in_program(code, code_end, i, pool, pool_count, &d);
+        if (has_code_target(d.op) && (d.ivalue < 0 || d.ivalue >= code_end || !starts[d.ivalue])) {
+            problem = d.op == OP_JUMP ? "JUMP target is not an instruction" :
+                      d.op == OP_CALL ? "CALL target is not an instruction" : "branch target is not an instruction";
+            at = i;
+        }
+    }
+    free(starts);
+    if (address) {
+        *address = at;
+    }
+    return problem;
+}
+
+// Check a program, raw or a compact image, before it runs in a VM with
+// `memory_size` bytes of memory. A sweep from address 0 splits its code
+// into instructions; each must be known and end within the code, each
+// JUMP, CALL and branch must land on the start of one, and each STORE must
+// write 8 bytes of memory past the program (a compact program's constant
+// pool included), as must each vector instruction that writes its range. Returns NULL if the program passes; otherwise what is
+// wrong, with the address of the instruction in *address if that is not
+// NULL.
+const char *verify_program(const unsigned char *program, int size, int memory_size, int *address) {
+    CompactHeader header;
+    if (size >= 4 && !memcmp(program, COMPACT_MAGIC, 4)) {
+        long program_size = compact_program_size(program, size, &header);
+        if (program_size < 0) {
+            if (address) {
+                *address = -1;
+            }
+            return "malformed compact image";
+        }
+        const unsigned char *pool = program + sizeof(CompactHeader);
+        return verify_code(pool + header.constant_count * sizeof(double), header.code_size,
+                           program_size > INT_MAX ? INT_MAX : program_size, memory_size, pool,
+                           header.constant_count, address);
+    }
+    return verify_code(program, size, size, memory_size, NULL, 0, address);
+}
+
+// Decode a program place_program has put in memory. One verify_code
+// accepts, on a VM without paging, runs with unchecked STOREs.
+static void prepare_program(Cocomp *cocomp, int code_end) {
+    reset_decoded(cocomp);
+    memset(cocomp->fusion_counts, 0, sizeof(cocomp->fusion_counts));
+#if COCOMP_JIT
+    jit_flush(cocomp);
+#endif
+    predecode_program(cocomp, 0, code_end);
+    const unsigned char *pool = cocomp->code_format == CODE_COMPACT ? &cocomp->memory[cocomp->constant_pool] : NULL;
+    if (!cocomp->paging && !verify_code(cocomp->memory, code_end, cocomp->code_size, VM_MEMORY_SIZE(cocomp),
+                                        pool, cocomp->constant_count, NULL)) {
+        mark_verified(cocomp);
+    }
+}
+
+// Copy a program to address 0 and decode it. The program is raw bytecode,
+// or a compact image (see COMPACT_MAGIC).
+void load_program(Cocomp *cocomp, unsigned char *program, int size) {
+    int code_end = place_program(cocomp, program, size);
+    if (code_end >= 0) {
+        prepare_program(cocomp, code_end);
+    }
+}
+
+static struct {
+    pthread_mutex_t lock;
+    CocompModule *slots[MODULE_CACHE_SLOTS];
+    long hits;
+    long misses;
+} module_cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// FNV-1a over 8-byte words, then the tail, with a final mix so the low bits
+// that pick a cache slot depend on every word.
+static unsigned long long hash_module(const unsigned char *code, long size) {
+    const unsigned long long prime = 1099511628211ULL;
+    unsigned long long hash = 14695981039346656037ULL ^ (unsigned long long)size;
+    long i = 0;
+    for (; i + 8 <= size; i += 8) {
+        unsigned long long word;
+        memcpy(&word, &code[i], sizeof(word));
+        hash = (hash ^ word) * prime;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ code[i]) * prime;
+    }
+    hash ^= hash >> 32;
+    return (hash * prime) ^ (hash >> 29);
+}
+
+static void free_module(CocompModule *module) {
+    if (module->mapped_size) {
+        munmap((void *)module->code, module->mapped_size);
+    } else {
+        free((void *)module->code);
+    }
+    ModuleTrace *trace = atomic_load(&module->trace);
+    if (trace) {
+        free(trace->decoded_index);
+        free(trace);
+    }
+    free(module);
+}
+
+// The cached module with these bytes, or a new one put in the cache. `code`
+// is a file mapping of `mapped_size` bytes, which is given to the new module
+// or unmapped, or, if `mapped_size` is 0, a buffer to copy. The caller holds
+// one reference. Candidates are compared outside the lock, as that reads the
+// whole module.
+static CocompModule *cache_module(const unsigned char *code, long size, size_t mapped_size) {
+    unsigned long long hash = hash_module(code, size);
+    int slot = hash % MODULE_CACHE_SLOTS;
+
+    pthread_mutex_lock(&module_cache.lock);
+    CocompModule *cached = module_cache.slots[slot];
+    if (cached && cached->hash == hash && cached->size == size) {
+        atomic_fetch_add(&cached->references, 1);
+    } else {
+        cached = NULL;
+    }
+    pthread_mutex_unlock(&module_cache.lock);
+    if (cached && memcmp(cached->code, code, size) == 0) {
+        pthread_mutex_lock(&module_cache.lock);
+        module_cache.hits++;
+        pthread_mutex_unlock(&module_cache.lock);
+        if (mapped_size) {
+            munmap((void *)code, mapped_size);
+        }
+        return cached;
+    }
+    release_module(cached);
+
+    CocompModule *module = allocate_component(sizeof(CocompModule), "a module");
+    if (module && !mapped_size) {
+        unsigned char *copy = malloc(size);
+        if (copy) {
+            memcpy(copy, code, size);
+            code = copy;
+        } else {
+            printf("Cannot allocate a module of %ld bytes\n", size);
+            free(module);
+            module = NULL;
+        }
+    }
+    if (!module) {
+        if (mapped_size) {
+            munmap((void *)code, mapped_size);
+        }
+        return NULL;
+    }
+    module->hash = hash;
+    module->code = code;
+    module->size = size;
+    module->mapped_size = mapped_size;
+    atomic_init(&module->references, 2);
+    atomic_init(&module->trace, NULL);
+
+    pthread_mutex_lock(&module_cache.lock);
+    module_cache.misses++;
+    CocompModule *replaced = module_cache.slots[slot];
+    module_cache.slots[slot] = module;
+    pthread_mutex_unlock(&module_cache.lock);
+    release_module(replaced);
+    return module;
+}
+
+// The bytecode file at `path`, mapped read-only, whatever its size. NULL if
+// it cannot be read. The caller holds one reference.
+CocompModule *open_module(const char *path) {
+    int fd = open(path, O_RDONLY);
+    off_t size = fd >= 0 ? lseek(fd, 0, SEEK_END) : -1;
+    if (size <= 0 || size > LONG_MAX) {
+        printf("Cannot open module %s\n", path);
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    unsigned char *code = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (code == MAP_FAILED) {
+        printf("Cannot map module %s\n", path);
+        return NULL;
+    }
+    // Hashing streams through the file once; loads copy it the same way
+    madvise(code, size, MADV_SEQUENTIAL);
+    return cache_module(code, size, size);
+}
+
+// A module with a copy of `size` bytes of `code`. The caller holds one
+// reference.
+CocompModule *module_from_code(const unsigned char *code, long size) {
+    if (size <= 0) {
+        printf("Invalid module size %ld\n", size);
+        return NULL;
+    }
+    return cache_module(code, size, 0);
+}
+
+// Give up a reference. A module is freed once the cache has dropped it and
+// no one else holds it.
+void release_module(CocompModule *module) {
+    if (module && atomic_fetch_sub(&module->references, 1) == 1) {
+        free_module(module);
+    }
+}
+
+// Keep the trace load_program just decoded in the module, unless another VM
+// got there first.
+static void share_trace(Cocomp *cocomp, CocompModule *module) {
+    ModuleTrace *trace = malloc(sizeof(ModuleTrace) + cocomp->decoded_count * sizeof(DecodedInstruction));
+    int *index = malloc(cocomp->code_size * sizeof(int));
+    if (!trace || !index) {
+        free(trace);
+        free(index);
+        return;
+    }
+    trace->memory_size = VM_MEMORY_SIZE(cocomp);
+    trace->fusion_enabled = cocomp->fusion_enabled;
+    trace->count = cocomp->decoded_count;
+    trace->verified = cocomp->verified;
+    memcpy(trace->fusion_counts, cocomp->fusion_counts, sizeof(trace->fusion_counts));
+    memcpy(trace->decoded, cocomp->decoded, trace->count * sizeof(DecodedInstruction));
+    memcpy(index, cocomp->decoded_index, cocomp->code_size * sizeof(int));
+    trace->decoded_index = index;
+    ModuleTrace *expected = NULL;
+    if (!atomic_compare_exchange_strong(&module->trace, &expected, trace)) {
+        free(index);
+        free(trace);
+    }
+}
+
+// load_program for a module. A VM of the memory size and fusion setting the
+// module was first decoded with copies its trace; any other decodes it
+// itself. Returns 0, or -1 if the module is malformed or does not fit in
+// memory.
+int load_module(Cocomp *cocomp, CocompModule *module) {
+    int code_end = place_program(cocomp, module->code, module->size);
+    if (code_end < 0) {
+        return -1;
+    }
+    int size = cocomp->code_size;
+    ModuleTrace *trace = atomic_load_explicit(&module->trace, memory_order_acquire);
+    if (!trace || trace->memory_size != VM_MEMORY_SIZE(cocomp) || trace->fusion_enabled != cocomp->fusion_enabled) {
+        prepare_program(cocomp, code_end);
+        if (!trace) {
+            share_trace(cocomp, module);
+        }
+        return 0;
+    }
+    memcpy(cocomp->decoded, trace->decoded, trace->count * sizeof(DecodedInstruction));
+    cocomp->decoded_count = trace->count;
+    memcpy(cocomp->decoded_index, trace->decoded_index, size * sizeof(int));
+    memset(cocomp->decoded_index + size, 0, (VM_MEMORY_SIZE(cocomp) - size) * sizeof(int));
+    memcpy(cocomp->fusion_counts, trace->fusion_counts, sizeof(cocomp->fusion_counts));
+    cocomp->verified = trace->verified;
+    if (cocomp->paging) {
+        unverify_program(cocomp);
+    }
+#if COCOMP_JIT
+    jit_flush(cocomp);
+#endif
+    return 0;
+}
+
+int load_module_file(Cocomp *cocomp, const char *path) {
+    CocompModule *module = open_module(path);
+    if (!module) {
+        return -1;
+    }
+    int loaded = load_module(cocomp, module);
+    release_module(module);
+    return loaded;
+}
+
+ModuleCacheStats module_cache_stats(void) {
+    ModuleCacheStats stats = {0};
+    pthread_mutex_lock(&module_cache.lock);
+    stats.hits = module_cache.hits;
+    stats.misses = module_cache.misses;
+    for (int slot = 0; slot < MODULE_CACHE_SLOTS; slot++) {
+        if (module_cache.slots[slot]) {
+            stats.modules++;
+            stats.bytes += module_cache.slots[slot]->size;
+        }
+    }
+    pthread_mutex_unlock(&module_cache.lock);
+    return stats;
+}
+
+void print_module_cache_stats(void) {
+    ModuleCacheStats stats = module_cache_stats();
+    printf("Module cache: %ld hits, %ld misses, %d modules, %ld bytes\n", stats.hits, stats.misses,
+           stats.modules, stats.bytes);
+}
+
+// Drop every module from the cache. Modules still held elsewhere stay valid.
+void flush_module_cache(void) {
+    CocompModule *dropped[MODULE_CACHE_SLOTS];
+    pthread_mutex_lock(&module_cache.lock);
+    memcpy(dropped, module_cache.slots, sizeof(dropped));
+    memset(module_cache.slots, 0, sizeof(module_cache.slots));
+    pthread_mutex_unlock(&module_cache.lock);
+    for (int slot = 0; slot < MODULE_CACHE_SLOTS; slot++) {
+        release_module(dropped[slot]);
+    }
+}
+
+void execute_program(Cocomp *cocomp) {
+    execute_program_decoded(cocomp);
+}
+
+// Immediates are unaligned; reading them through a cast is undefined.
+static double immediate_double(const unsigned char *ptr) {
+    double value;
+    memcpy(&value, ptr, sizeof(double));
+    return value;
+}
+
+static int immediate_int(const unsigned char *ptr) {
+    int value;
+    memcpy(&value, ptr, sizeof(int));
+    return value;
+}
+
+// FLAG_* for COMPARE of `accumulator` with `value`
+static int compare_flags(double accumulator, double value) {
+    return (accumulator == value ? FLAG_EQUAL : 0) | (accumulator < value ? FLAG_LESS : 0) |
+           (accumulator > value ? FLAG_GREATER : 0);
+}
+
+// The flag each flag-testing branch takes its jump on
+static const unsigned char branch_flags[OP_COUNT] = {
+    [OP_BRANCH_EQUAL] = FLAG_EQUAL,
+    [OP_BRANCH_LESS] = FLAG_LESS,
+    [OP_BRANCH_GREATER] = FLAG_GREATER,
+};
+
+// Kernels behind the vector instructions, over `count` doubles at guest
+// addresses, which need not be aligned. The scalar kernels are the
+// fallback; the AVX2 ones do the same work four doubles at a time. VDOT
+// adds the product of element i into sums[i % VECTOR_SUMS] in both, so the
+// two give the same result. VCOPY is a memmove either way.
+#define VECTOR_SUMS 8
+#define VECTOR_CHUNK 256  // doubles staged per step when the ranges go through the MMU
+
+typedef struct {
+    void (*add)(unsigned char *destination, const unsigned char *source, int count);
+    void (*multiply)(unsigned char *destination, const unsigned char *source, int count);
+    void (*dot)(const unsigned char *first, const unsigned char *second, int count, double *sums);
+    void (*fill)(unsigned char *destination, double value, int count);
+} VectorKernels;
+
+static void vector_add_scalar(unsigned char *destination, const unsigned char *source, int count) {
+    for (int i = 0; i < count; i++) {
+        double a, b;
+        memcpy(&a, &destination[i * sizeof(double)], sizeof(double));
+        memcpy(&b, &source[i * sizeof(double)], sizeof(double));
+        a += b;
+        memcpy(&destination[i * sizeof(double)], &a, sizeof(double));
+    }
+}
+
+static void vector_multiply_scalar(unsigned char *destination, const unsigned char *source, int count) {
+    for (int i = 0; i < count; i++) {
+        double a, b;
+        memcpy(&a, &destination[i * sizeof(double)], sizeof(double));
+        memcpy(&b, &source[i * sizeof(double)], sizeof(double));
+        a *= b;
+        memcpy(&destination[i * sizeof(double)], &a, sizeof(double));
+    }
+}
+
+static void vector_dot_scalar(const unsigned char *first, const unsigned char *second, int count, double *sums) {
+    for (int i = 0; i < count; i++) {
+        double a, b;
+        memcpy(&a, &first[i * sizeof(double)], sizeof(double));
+        memcpy(&b, &second[i * sizeof(double)], sizeof(double));
+        sums[i % VECTOR_SUMS] += a * b;
+    }
+}
+
+static void vector_fill_scalar(unsigned char *destination, double value, int count) {
+    for (int i = 0; i < count; i++) {
+        memcpy(&destination[i * sizeof(double)], &value, sizeof(double));
+    }
+}
+
+#if COCOMP_AVX2
+static void vector_add_avx2(unsigned char *destination, const unsigned char *source, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        double *to = (double *)&destination[i * sizeof(double)];
+        _mm256_storeu_pd(to, _mm256_add_pd(_mm256_loadu_pd(to), _mm256_loadu_pd((const double *)&source[i * sizeof(double)])));
+    }
+    vector_add_scalar(&destination[i * sizeof(double)], &source[i * sizeof(double)], count - i);
+}
+
+static void vector_multiply_avx2(unsigned char *destination, const unsigned char *source, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        double *to = (double *)&destination[i * sizeof(double)];
+        _mm256_storeu_pd(to, _mm256_mul_pd(_mm256_loadu_pd(to), _mm256_loadu_pd((const double *)&source[i * sizeof(double)])));
+    }
+    vector_multiply_scalar(&destination[i * sizeof(double)], &source[i * sizeof(double)], count - i);
+}
+
+// Two accumulators, for sums[0..3] and sums[4..7], so consecutive adds do
+// not wait on each other.
+static void vector_dot_avx2(const unsigned char *first, const unsigned char *second, int count, double *sums) {
+    __m256d low = _mm256_loadu_pd(&sums[0]);
+    __m256d high = _mm256_loadu_pd(&sums[4]);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const double *a = (const double *)&first[i * sizeof(double)];
+        const double *b = (const double *)&second[i * sizeof(double)];
+        low = _mm256_add_pd(low, _mm256_mul_pd(_mm256_loadu_pd(a), _mm256_loadu_pd(b)));
+        high = _mm256_add_pd(high, _mm256_mul_pd(_mm256_loadu_pd(a + 4), _mm256_loadu_pd(b + 4)));
+    }
+    _mm256_storeu_pd(&sums[0], low);
+    _mm256_storeu_pd(&sums[4], high);
+    vector_dot_scalar(&first[i * sizeof(double)], &second[i * sizeof(double)], count - i, sums);
+}
+
+static void vector_fill_avx2(unsigned char *destination, double value, int count) {
+    __m256d values = _mm256_set1_pd(value);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd((double *)&destination[i * sizeof(double)], values);
+    }
+    vector_fill_scalar(&destination[i * sizeof(double)], value, count - i);
+}
+
+#endif
+
+// The scalar kernels, then the AVX2 ones if built; the VM uses the last.
+static const VectorKernels vector_kernel_sets[] = {
+    {vector_add_scalar, vector_multiply_scalar, vector_dot_scalar, vector_fill_scalar},
+#if COCOMP_AVX2
+    {vector_add_avx2, vector_multiply_avx2, vector_dot_avx2, vector_fill_avx2},
+#endif
+};
+#define vector_kernels (&vector_kernel_sets[COCOMP_AVX2])
+
+// Run vector instruction `opcode` with `kernels` on flat memory, the
+// ranges already checked. VDOT adds into `sums`.
+static void run_vector_kernel(const VectorKernels *kernels, unsigned char *memory, unsigned char opcode,
+                              int destination, int source, int count, double accumulator, double *sums) {
+    switch (opcode) {
+        case 0x19: kernels->add(&memory[destination], &memory[source], count); break;
+        case 0x1A: kernels->multiply(&memory[destination], &memory[source], count); break;
+        case 0x1B: kernels->dot(&memory[destination], &memory[source], count, sums); break;
+        case 0x1C: kernels->fill(&memory[destination], accumulator, count); break;
+        default: memmove(&memory[destination], &memory[source], (size_t)count * sizeof(double)); break;
+    }
+}
+
+static double vector_total(const double *sums) {
+    double total = 0;
+    for (int i = 0; i < VECTOR_SUMS; i++) {
+        total += sums[i];
+    }
+    return total;
+}
+
+// Run vector instruction `d` on guest memory and return the accumulator,
+// which only VDOT changes. The ranges are checked once, up front; a bad one
+// reports COCOMP_INVALID_ADDRESS and changes nothing. Ranges in physical
+// memory run the kernels in place; with paging they are staged through the
+// MMU a chunk at a time.
+static double execute_vector(Cocomp *cocomp, const DecodedInstruction *d, double accumulator) {
+    int destination = d->ivalue, source = d->vector_source, count = d->vector_count;
+    long bytes = (long)count * sizeof(double);
+    int writes = d->opcode != 0x1B;
+    double sums[VECTOR_SUMS] = {0};
+    if (!vector_in_range(d, (long)cocomp->virtual_pages * VM_PAGE_SIZE(cocomp))) {
+        report_error(cocomp, COCOMP_INVALID_ADDRESS, "Invalid vector range: %d doubles at %d and %d\n",
+                     count, destination, source);
+        return accumulator;
+    }
+    if (!cocomp->paging && vector_in_range(d, cocomp->memory_size)) {
+        run_vector_kernel(vector_kernels, cocomp->memory, d->opcode, destination, source, count, accumulator, sums);
+        if (writes && !(cocomp->verified && destination >= cocomp->code_size)) {
+            invalidate_decoded(cocomp, destination, bytes);
+        }
+        return d->opcode == 0x1B ? vector_total(sums) : accumulator;
+    }
+
+    // Staged: the destination chunk at 0 and the source chunk after it.
+    // VCOPY walks down when the destination is above the source, as
+    // memmove does.
+    double staged[2 * VECTOR_CHUNK];
+    unsigned char *bytes_staged = (unsigned char *)staged;
+    int source_at = VECTOR_CHUNK * sizeof(double);
+    int downward = d->opcode == 0x1D && destination > source;
+    for (int done = 0; done < count; done += VECTOR_CHUNK) {
+        int chunk = count - done < VECTOR_CHUNK ? count - done : VECTOR_CHUNK;
+        int offset = (downward ? count - done - chunk : done) * sizeof(double);
+        int length = chunk * sizeof(double);
+        int failed = -1;  // address the MMU could not reach
+        if (d->opcode <= 0x1B && !mmu_read(cocomp, destination + offset, bytes_staged, length)) {
+            failed = destination + offset;
+        } else if (d->opcode != 0x1C && !mmu_read(cocomp, source + offset, &bytes_staged[source_at], length)) {
+            failed = source + offset;
+        } else {
+            run_vector_kernel(vector_kernels, bytes_staged, d->opcode, 0, source_at, chunk, accumulator, sums);
+            if (writes && !mmu_write(cocomp, destination + offset, bytes_staged, length)) {
+                failed = destination + offset;
+            }
+        }
+        if (failed >= 0) {
+            report_error(cocomp, COCOMP_INVALID_ADDRESS, "Invalid memory address %d\n", failed);
+            return accumulator;
+        }
+    }
+    return d->opcode == 0x1B ? vector_total(sums) : accumulator;
+}
+
+// Reference interpreter for raw bytecode; compact programs, which only
+// exist decoded, run in execute_program_decoded.
+void execute_program_switch(Cocomp *cocomp) {
+    int running = 1;
+    if (cocomp->code_format == CODE_COMPACT) {
+        execute_program_decoded(cocomp);
+        return;
+    }
+resume:
+    while (running && (unsigned)cocomp->instruction_pointer < (unsigned)VM_MEMORY_SIZE(cocomp)) {
+        unsigned char instruction = cocomp->memory[cocomp->instruction_pointer];
+        switch (instruction) {
+            case 0x01:  // LOAD_FLOAT immediate value into accumulator
+                {
+                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
+                    cocomp->accumulator = immediate_double(ptr);
+                    cocomp->instruction_pointer += sizeof(double);
+                }
+                break;
+            case 0x02:  // ADD immediate value to accumulator
+                {
+                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
+                    cocomp->accumulator += immediate_double(ptr);
+                    cocomp->instruction_pointer += sizeof(double);
+                }
+                break;
+            case 0x03:  // STORE accumulator to memory
+                {
+                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
+                    int address = immediate_int(ptr);
+                    if (!mmu_write(cocomp, address, &cocomp->accumulator, sizeof(double))) {
+                        report_error(cocomp, COCOMP_INVALID_ADDRESS, "Invalid memory address %d\n", address);
+                    }
+                    cocomp->instruction_pointer += sizeof(int);
+                }
+                break;
+            case 0x04:  // PUSH accumulator onto stack
+                push_stack(cocomp, cocomp->accumulator);
+                break;
+            case 0x05:  // POP from stack into accumulator
+                cocomp->accumulator = pop_stack(cocomp);
+                break;
+            case 0x06:  // JUMP to address
+                {
+                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
+                    cocomp->instruction_pointer = immediate_int(ptr) - 1;
+                }
+                break;
+            case 0x07:  // CALL function
+                if (!push_return(cocomp, cocomp->instruction_pointer + 1)) {
+                    cocomp->instruction_pointer++;  // stop past the target byte
+                    running = 0;
+                    break;
+                }
+                cocomp->instruction_pointer++;
+                cocomp->instruction_pointer = cocomp->memory[cocomp->instruction_pointer] - 1;
+                break;
+            case 0x08:  // RETURN from function
+                {
+                    int address = pop_return(cocomp);
+                    if (address < 0) {
+                        running = 0;
+                        break;
+                    }
+                    cocomp->instruction_pointer = address - 1;
+                }
+                break;
+            case 0x09:  // NOP (No Operation)
+                cocomp->instruction_pointer++;
+                break;
+            case 0x0A:  // SUBTRACT immediate value from accumulator
+                {
+                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
+                    cocomp->accumulator -= immediate_double(ptr);
+                    cocomp->instruction_pointer += sizeof(double);
+                }
+                break;
+            case 0x0B:  // COMPARE accumulator with immediate value, setting the flags
+                {
+                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
+                    cocomp->flags = compare_flags(cocomp->accumulator, immediate_double(ptr));
+                    cocomp->instruction_pointer += sizeof(double);
+                }
+                break;
+            case 0x0C:  // SYSTEM CALL (for I/O or other operations)
+                handle_interrupt(cocomp, cocomp->memory[++cocomp->instruction_pointer]);
+                if (cocomp->reschedule) {
+                    cocomp->reschedule = 0;
+                    if (thread_waiting(cocomp)) {
+                        cocomp->instruction_pointer--;  // runs the SYSCALL again when woken
+                    } else {
+                        cocomp->instruction_pointer++;
+                    }
+                    if (!schedule_thread(cocomp)) {
+                        return;
+                    }
+                    continue;
+                }
+                break;
+            case 0x0D:  // CALL function
+                if (!push_return(cocomp, cocomp->instruction_pointer + 1)) {
+                    cocomp->instruction_pointer++;
+                    running = 0;
+                    break;
+                }
+                cocomp->instruction_pointer++;
+                cocomp->instruction_pointer = cocomp->memory[cocomp->instruction_pointer] - 1;
+                break;
+            case 0x0E:  // RETURN from function
+                {
+                    int address = pop_return(cocomp);
+                    if (address < 0) {
+                        running = 0;
+                        break;
+                    }
+                    cocomp->instruction_pointer = address - 1;
+                }
+                break;
+            case 0x0F:  // BITWISE AND accumulator with immediate value
+                {
+                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
+                    int value = immediate_int(ptr);
+                    cocomp->accumulator = (int)cocomp->accumulator & value;
+                    cocomp->instruction_pointer += sizeof(int);
+                }
+                break;
+            case 0x10:  // BITWISE OR accumulator with immediate value
+                {
+                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
+                    int value = immediate_int(ptr);
+                    cocomp->accumulator = (int)cocomp->accumulator | value;
+                    cocomp->instruction_pointer += sizeof(int);
+                }
+                break;
+            case 0x11:  // BITWISE XOR accumulator with immediate value
+                {
+                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
+                    int value = immediate_int(ptr);
+                    cocomp->accumulator = (int)cocomp->accumulator ^ value;
+                    cocomp->instruction_pointer += sizeof(int);
+                }
+                break;
+            case 0x12:  // SHIFT LEFT accumulator by immediate value
+                {
+                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
+                    int value = immediate_int(ptr);
+                    cocomp->accumulator = (int)cocomp->accumulator << value;
+                    cocomp->instruction_pointer += sizeof(int);
+                }
+                break;
+            case 0x13:  // SHIFT RIGHT accumulator by immediate value
+                {
+                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
+                    int value = immediate_int(ptr);
+                    cocomp->accumulator = (int)cocomp->accumulator >> value;
+                    cocomp->instruction_pointer += sizeof(int);
+                }
+                break;
+            case 0x14:  // BEQ: branch if the last COMPARE found them equal
+            case 0x15:  // BLT: ... the accumulator less
+            case 0x16:  // BGT: ... the accumulator greater
+            case 0x17:  // BZ: branch if the accumulator is 0
+                {
+                    static const unsigned char tested[] = {FLAG_EQUAL, FLAG_LESS, FLAG_GREATER};
+                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
+                    int taken = instruction == 0x17 ? cocomp->accumulator == 0 : cocomp->flags & tested[instruction - 0x14];
+                    if (taken) {
+                        cocomp->instruction_pointer = immediate_int(ptr) - 1;
+                    } else {
+                        cocomp->instruction_pointer += sizeof(int);
+                    }
+                }
+                break;
+            case 0x18:  // DBNZ: take 1 from the top stack slot, branch unless that leaves 0
+                {
+                    unsigned char *ptr = &cocomp->memory[cocomp->instruction_pointer + 1];
+                    int target = immediate_int(ptr);
+                    if (cocomp->stack_pointer >= cocomp->stack_limit) {
+                        report_error(cocomp, COCOMP_STACK_UNDERFLOW, "Stack underflow!\n");
+                        cocomp->instruction_pointer += sizeof(int);
+                        break;
+                    }
+                    double count = read_stack_slot(cocomp, cocomp->stack_pointer) - 1;
+                    write_stack_slot(cocomp, cocomp->stack_pointer, count);
+                    if (count != 0) {
+                        cocomp->instruction_pointer = target - 1;
+                    } else {
+                        cocomp->instruction_pointer += sizeof(int);
+                    }
+                }
+                break;
+            case 0x19:  // VADD destination, source, count: destination[i] += source[i]
+            case 0x1A:  // VMUL destination, source, count: destination[i] *= source[i]
+            case 0x1B:  // VDOT first, second, count: sum of first[i] * second[i] into the accumulator
+            case 0x1C:  // VFILL destination, count: destination[i] = accumulator
+            case 0x1D:  // VCOPY destination, source, count
+                {
+                    DecodedInstruction d;
+                    decode_bytes(cocomp->memory, cocomp->instruction_pointer, &d);
+                    cocomp->accumulator = execute_vector(cocomp, &d, cocomp->accumulator);
+                    cocomp->instruction_pointer += d.length - 1;
+                }
+                break;
+            case 0xFF:  // END program
                 running = 0;
                 break;
             default:
-                printf("Unknown instruction %02x at address %d\n", instruction, cocomp->instruction_pointer);
+                report_error(cocomp, COCOMP_UNKNOWN_INSTRUCTION, "Unknown instruction %02x at address %d\n",
+                             instruction, cocomp->instruction_pointer);
                 running = 0;
                 break;
         }
-        cocomp->instruction_pointer++;
+        cocomp->instruction_pointer++;
+    }
+    // The running thread has stopped; carry on with any other guest thread.
+    if (end_thread(cocomp)) {
+        running = 1;
+        goto resume;
+    }
+    flush_console(cocomp);
+}
+
+// Decode the instruction at `address` into `d`, in the format of the loaded
+// program. Operands of raw code are read from the same bytes
+// execute_program_switch would read.
+void decode_instruction(Cocomp *cocomp, int address, DecodedInstruction *d) {
+    if (cocomp->code_format == CODE_COMPACT) {
+        decode_compact(cocomp->memory, address, &cocomp->memory[cocomp->constant_pool], cocomp->constant_count, d);
+    } else {
+        decode_bytes(cocomp->memory, address, d);
+    }
+}
+
+// Decode one instruction out of a raw memory image (also used by the batch
+// engine, whose lanes have no Cocomp of their own).
+void decode_bytes(const unsigned char *memory, int address, DecodedInstruction *d) {
+    const unsigned char *ptr = &memory[address + 1];
+    unsigned char opcode = memory[address];
+
+    d->opcode = opcode;
+    d->fvalue = 0;
+    d->ivalue = 0;
+    d->span = 1;
+    switch (opcode) {
+        case 0x01: d->op = OP_LOAD_FLOAT; break;
+        case 0x02: d->op = OP_ADD; break;
+        case 0x03: d->op = OP_STORE; break;
+        case 0x04: d->op = OP_PUSH; break;
+        case 0x05: d->op = OP_POP; break;
+        case 0x06: d->op = OP_JUMP; break;
+        case 0x07: case 0x0D: d->op = OP_CALL; break;
+        case 0x08: case 0x0E: d->op = OP_RETURN; break;
+        case 0x09: d->op = OP_NOP; break;
+        case 0x0A: d->op = OP_SUBTRACT; break;
+        case 0x0B: d->op = OP_COMPARE; break;
+        case 0x0C: d->op = OP_SYSCALL; break;
+        case 0x0F: d->op = OP_AND; break;
+        case 0x10: d->op = OP_OR; break;
+        case 0x11: d->op = OP_XOR; break;
+        case 0x12: d->op = OP_SHIFT_LEFT; break;
+        case 0x13: d->op = OP_SHIFT_RIGHT; break;
+        case 0x14: d->op = OP_BRANCH_EQUAL; break;
+        case 0x15: d->op = OP_BRANCH_LESS; break;
+        case 0x16: d->op = OP_BRANCH_GREATER; break;
+        case 0x17: d->op = OP_BRANCH_ZERO; break;
+        case 0x18: d->op = OP_DECREMENT_BRANCH; break;
+        case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D: d->op = OP_VECTOR; break;
+        case 0xFF: d->op = OP_END; break;
+        default: d->op = OP_UNKNOWN; break;
+    }
+    switch (d->op) {
+        case OP_LOAD_FLOAT:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_COMPARE:
+            memcpy(&d->fvalue, ptr, sizeof(double));
+            d->length = 1 + sizeof(double);
+            break;
+        case OP_STORE:
+        case OP_AND:
+        case OP_OR:
+        case OP_XOR:
+        case OP_SHIFT_LEFT:
+        case OP_SHIFT_RIGHT:
+        case OP_JUMP:
+        case OP_BRANCH_EQUAL:
+        case OP_BRANCH_LESS:
+        case OP_BRANCH_GREATER:
+        case OP_BRANCH_ZERO:
+        case OP_DECREMENT_BRANCH:
+            memcpy(&d->ivalue, ptr, sizeof(int));
+            d->length = 1 + sizeof(int);
+            break;
+        case OP_CALL:
+            d->ivalue = *ptr;
+            d->length = 2;
+            d->return_offset = 1;
+            break;
+        case OP_SYSCALL:
+            d->ivalue = *ptr;
+            d->length = 2;
+            break;
+        case OP_VECTOR:  // destination, then VFILL's count or a source and a count
+            memcpy(&d->ivalue, ptr, sizeof(int));
+            if (opcode == 0x1C) {
+                memcpy(&d->vector_count, ptr + sizeof(int), sizeof(int));
+                d->length = 1 + 2 * sizeof(int);
+            } else {
+                memcpy(&d->vector_source, ptr + sizeof(int), sizeof(int));
+                memcpy(&d->vector_count, ptr + 2 * sizeof(int), sizeof(int));
+                d->length = 1 + 3 * sizeof(int);
+            }
+            break;
+        case OP_NOP:
+            d->length = 2;  // NOP skips its padding byte as well
+            break;
+        default:
+            d->length = 1;
+            break;
+    }
+}
+
+// Read a varint of at most MAX_VARINT_LENGTH bytes. Returns its length, or
+// 0 if it runs on for longer.
+static int read_varint(const unsigned char *ptr, unsigned int *value) {
+    unsigned int result = 0;
+    for (int i = 0; i < MAX_VARINT_LENGTH; i++) {
+        result |= (unsigned int)(ptr[i] & 0x7F) << (7 * i);
+        if (!(ptr[i] & 0x80)) {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static int unzigzag(unsigned int value) {
+    return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+// Decode one instruction of compact code, with its constants taken from the
+// `pool_count` doubles at `pool`. A varint that runs on too long, or a
+// constant past the end of the pool, decodes as an unknown instruction.
+// Reads at most MAX_INSTRUCTION_LENGTH bytes at `address`.
+void decode_compact(const unsigned char *code, int address, const unsigned char *pool, int pool_count,
+                    DecodedInstruction *d) {
+    unsigned int operand = 0;
+    int used = 1;
+    decode_bytes(code, address, d);
+    switch (d->op) {
+        case OP_LOAD_FLOAT:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_COMPARE:
+            used = read_varint(&code[address + 1], &operand);
+            if (!(operand & 1)) {
+                d->fvalue = unzigzag(operand >> 1);
+            } else if (operand >> 1 < (unsigned int)pool_count) {
+                memcpy(&d->fvalue, &pool[(operand >> 1) * sizeof(double)], sizeof(double));
+            } else {
+                used = 0;
+            }
+            break;
+        case OP_STORE:
+        case OP_AND:
+        case OP_OR:
+        case OP_XOR:
+        case OP_SHIFT_LEFT:
+        case OP_SHIFT_RIGHT:
+        case OP_JUMP:
+        case OP_CALL:
+        case OP_BRANCH_EQUAL:
+        case OP_BRANCH_LESS:
+        case OP_BRANCH_GREATER:
+        case OP_BRANCH_ZERO:
+        case OP_DECREMENT_BRANCH:
+            used = read_varint(&code[address + 1], &operand);
+            d->ivalue = unzigzag(operand);
+            break;
+        case OP_VECTOR:
+            {
+                int values[3] = {0};
+                int operands = d->opcode == 0x1C ? 2 : 3;
+                used = 0;
+                for (int i = 0; i < operands; i++) {
+                    int length = read_varint(&code[address + 1 + used], &operand);
+                    if (!length) {
+                        used = 0;
+                        break;
+                    }
+                    values[i] = unzigzag(operand);
+                    used += length;
+                }
+                d->ivalue = values[0];
+                d->vector_source = operands == 3 ? values[1] : 0;
+                d->vector_count = values[operands - 1];
+            }
+            break;
+        case OP_NOP:
+            d->length = 1;
+            return;
+        default:
+            return;  // SYSCALL keeps its byte; the rest have no operand
+    }
+    if (!used) {
+        d->op = OP_UNKNOWN;
+        d->fvalue = 0;
+        d->ivalue = 0;
+        d->length = 1;
+        return;
+    }
+    d->length = 1 + used;
+    if (d->op == OP_CALL) {
+        d->return_offset = d->length;  // the next instruction
+    }
+}
+
+void reset_decoded(Cocomp *cocomp) {
+    memset(cocomp->decoded_index, 0, VM_MEMORY_SIZE(cocomp) * sizeof(int));
+    cocomp->decoded[0].op = OP_RESOLVE;
+    cocomp->decoded_count = 1;
+    cocomp->verified = 0;
+}
+
+// Decode a straight-line trace starting at `address` into fresh consecutive
+// entries and return the first one. A lazy trace (sweep_end < 0) stops after
+// an instruction that never falls through, or links to an address that is
+// already decoded. A load-time sweep decodes every instruction up to
+// sweep_end. Falling off the end of a trace goes through OP_RESOLVE.
+int decode_trace(Cocomp *cocomp, int address, int sweep_end) {
+    if (cocomp->decoded_count + VM_MEMORY_SIZE(cocomp) + 1 > DECODED_CAPACITY(VM_MEMORY_SIZE(cocomp))) {
+        reset_decoded(cocomp);  // only reached by heavily self-modifying code
+    }
+    if (sweep_end < 0) {
+        unverify_program(cocomp);  // code the verifier has not seen, which unchecked STOREs could overwrite
+    }
+    int first = cocomp->decoded_count;
+    for (;;) {
+        DecodedInstruction *d = &cocomp->decoded[cocomp->decoded_count];
+        if (address >= VM_MEMORY_SIZE(cocomp) || (sweep_end >= 0 && address >= sweep_end)) {
+            d->op = OP_LINK;
+            d->ivalue = 0;
+            d->span = 1;
+            cocomp->decoded_count++;
+            break;
+        }
+        if (cocomp->decoded_count != first && cocomp->decoded_index[address]) {
+            d->op = OP_LINK;
+            d->ivalue = cocomp->decoded_index[address];
+            d->span = 1;
+            cocomp->decoded_count++;
+            break;
+        }
+        decode_instruction(cocomp, address, d);
+        cocomp->decoded_index[address] = cocomp->decoded_count++;
+        address += d->length;
+        if (sweep_end < 0 && (d->op == OP_JUMP || d->op == OP_CALL || d->op == OP_RETURN ||
+                              d->op == OP_END || d->op == OP_UNKNOWN)) {
+            break;
+        }
+    }
+    if (cocomp->fusion_enabled) {
+        for (int i = first; i < cocomp->decoded_count; i += cocomp->decoded[i].span) {
+            fuse_instructions(cocomp, i);
+        }
+    }
+    return first;
+}
+
+// Decode an invalidated entry again. If the instruction kept its length the
+// entry is rewritten in place and its successor is still the next entry;
+// otherwise a new trace is started and the old entry links to it.
+int redecode_instruction(Cocomp *cocomp, int index, int address) {
+    DecodedInstruction fresh;
+    DecodedInstruction *old = &cocomp->decoded[index];
+    int old_length = old->length;
+    for (int i = 1; i < old->span; i++) {
+        old_length -= old[i].length;  // a superinstruction's own bytes are what its run leaves over
+    }
+    decode_instruction(cocomp, address, &fresh);
+    if (fresh.length == old_length) {
+        *old = fresh;
+        if (cocomp->fusion_enabled) {
+            fuse_instructions(cocomp, index);
+        }
+        return index;
+    }
+    if (cocomp->decoded_count + VM_MEMORY_SIZE(cocomp) + 1 > DECODED_CAPACITY(VM_MEMORY_SIZE(cocomp))) {
+        reset_decoded(cocomp);
+        return decode_trace(cocomp, address, -1);
+    }
+    int head = decode_trace(cocomp, address, -1);
+    cocomp->decoded[index].op = OP_LINK;
+    cocomp->decoded[index].ivalue = head;
+    return head;
+}
+
+// Pre-decode a freshly loaded program as a single linear sweep. Addresses
+// reached any other way (jumps into immediates, re-decodes after a write) are
+// decoded lazily by the interpreter.
+void predecode_program(Cocomp *cocomp, int start, int size) {
+    decode_trace(cocomp, start, start + size);
+}
+
+// Peephole pass over one trace position: if the entries starting at `index`
+// form a known pattern, rewrite the head into a superinstruction that does
+// the whole run in one dispatch. Constants are folded in the order the
+// original instructions would compute them, so results are bit-identical.
+// Returns the number of entries the head now covers.
+int fuse_instructions(Cocomp *cocomp, int index) {
+    DecodedInstruction *d = &cocomp->decoded[index];
+    DecodedInstruction *limit = &cocomp->decoded[cocomp->decoded_count];
+    DecodedInstruction fused = *d;
+    int count = 1;
+    int length = d->length;
+
+    if (d->op == OP_LOAD_FLOAT) {
+        if (d + 1 < limit && d[1].op == OP_PUSH) {
+            fused.op = OP_FUSED_LOAD_PUSH;
+            count = 2;
+            length += d[1].length;
+        } else {
+            while (d + count < limit && (d[count].op == OP_ADD || d[count].op == OP_SUBTRACT) &&
+                   length + d[count].length + 1 + MAX_VARINT_LENGTH <= MAX_FUSED_LENGTH) {
+                if (d[count].op == OP_ADD) {
+                    fused.fvalue += d[count].fvalue;
+                } else {
+                    fused.fvalue -= d[count].fvalue;
+                }
+                length += d[count].length;
+                count++;
+            }
+            if (d + count < limit && d[count].op == OP_STORE) {
+                fused.op = OP_FUSED_LOAD_ARITH_STORE;
+                fused.ivalue = d[count].ivalue;
+                length += d[count].length;
+                count++;
+            } else if (count > 1) {
+                fused.op = OP_FUSED_LOAD_ARITH;
+            }
+        }
+    } else if (d->op == OP_COMPARE) {
+        if (d + 1 < limit && branch_flags[d[1].op]) {
+            fused.op = OP_FUSED_COMPARE_BRANCH;
+            fused.ivalue = d[1].ivalue;
+            count = 2;
+            length += d[1].length;
+        }
+    } else if (d->op == OP_AND || d->op == OP_OR || d->op == OP_XOR ||
+               d->op == OP_SHIFT_LEFT || d->op == OP_SHIFT_RIGHT) {
+        int and_mask = -1, xor_mask = 0, shifts = 0;
+        count = 0;
+        length = 0;
+        while (d + count < limit && length + d[count].length <= MAX_FUSED_LENGTH) {
+            int value = d[count].ivalue;
+            if (d[count].op == OP_AND) {
+                and_mask &= value;
+                xor_mask &= value;
+            } else if (d[count].op == OP_OR) {
+                and_mask &= ~value;
+                xor_mask = (xor_mask & ~value) | value;
+            } else if (d[count].op == OP_XOR) {
+                xor_mask ^= value;
+            } else if (d[count].op == OP_SHIFT_LEFT || d[count].op == OP_SHIFT_RIGHT) {
+                shifts++;
+            } else {
+                break;
+            }
+            length += d[count].length;
+            count++;
+        }
+        if (count > 1) {
+            fused.op = shifts ? OP_FUSED_INT_CHAIN : OP_FUSED_BITWISE;
+            if (!shifts) {
+                fused.ivalue = and_mask;
+                fused.xor_mask = xor_mask;
+            }
+        } else {
+            count = 1;
+        }
+    }
+    if (count == 1) {
+        return 1;
+    }
+    fused.length = length;
+    fused.span = count;
+    *d = fused;
+    cocomp->fusion_counts[fused.op]++;
+    return count;
+}
+
+void print_fusion_stats(Cocomp *cocomp) {
+    static const char *names[OP_COUNT] = {
+        [OP_FUSED_LOAD_PUSH] = "LOAD_FLOAT+PUSH",
+        [OP_FUSED_LOAD_ARITH] = "LOAD_FLOAT+ADD/SUBTRACT",
+        [OP_FUSED_LOAD_ARITH_STORE] = "LOAD_FLOAT+ADD/SUBTRACT+STORE",
+        [OP_FUSED_BITWISE] = "AND/OR/XOR chain",
+        [OP_FUSED_INT_CHAIN] = "AND/OR/XOR/SHIFT chain",
+        [OP_FUSED_COMPARE_BRANCH] = "COMPARE+BEQ/BLT/BGT",
+    };
+    printf("Superinstruction fusions:\n");
+    for (int op = OP_FUSED_LOAD_PUSH; op <= OP_FUSED_COMPARE_BRANCH; op++) {
+        printf("  %-30s %d\n", names[op], cocomp->fusion_counts[op]);
+    }
+}
+
+// Mark every decoded instruction that could overlap the written range
+// [address, address + length) for re-decoding, including superinstructions
+// whose run reaches into it.
+void invalidate_decoded(Cocomp *cocomp, int address, int length) {
+    // Constants are copied into the entries that use them, so a write to
+    // the constant pool invalidates all of the code.
+    if (cocomp->constant_count && address < cocomp->code_size && address + length > cocomp->constant_pool) {
+        invalidate_decoded(cocomp, 0, cocomp->constant_pool);
+    }
+    int first = address - (MAX_FUSED_LENGTH - 1);
+    int last = address + length;
+    if (first < 0) first = 0;
+    if (last > VM_MEMORY_SIZE(cocomp)) last = VM_MEMORY_SIZE(cocomp);
+    for (int i = first; i < last; i++) {
+        int index = cocomp->decoded_index[i];
+        if (index) {
+            cocomp->decoded[index].op = OP_UNDECODED;
+        }
+    }
+#if COCOMP_JIT
+    if (cocomp->jit_block_count > 0) {
+        jit_invalidate(cocomp, address, length);
+    }
+#endif
+}
+
+void set_jit_enabled(Cocomp *cocomp, int enabled) {
+    cocomp->jit_enabled = COCOMP_JIT && enabled;
+}
+
+#if COCOMP_JIT
+static void jit_emit(Cocomp *cocomp, const void *bytes, int count) {
+    memcpy(&cocomp->jit_code[cocomp->jit_code_used], bytes, count);
+    cocomp->jit_code_used += count;
+}
+
+static void jit_emit_imm32(Cocomp *cocomp, int value) {
+    jit_emit(cocomp, &value, sizeof(int));
+}
+
+static void jit_emit_imm64(Cocomp *cocomp, const void *value) {
+    jit_emit(cocomp, value, 8);
+}
+
+// COMPARE from compiled code, with its operand in xmm1
+static double jit_compare(double accumulator, Cocomp *cocomp, double value) {
+    cocomp->flags = compare_flags(accumulator, value);
+    return accumulator;
+}
+
+// STORE from compiled code goes through the same translation and
+// invalidation as the interpreter, so writes into other blocks' code are
+// still noticed.
+static double jit_store(double accumulator, Cocomp *cocomp, int address) {
+    if (!mmu_write(cocomp, address, &accumulator, sizeof(double))) {
+        report_error(cocomp, COCOMP_INVALID_ADDRESS, "Invalid memory address %d\n", address);
+    }
+    return accumulator;
+}
+
+// Drop every compiled block and forget the hotness counters.
+void jit_flush(Cocomp *cocomp) {
+    memset(cocomp->jit_counters, 0, VM_MEMORY_SIZE(cocomp) * sizeof(unsigned short));
+    memset(cocomp->jit_block_at, 0, VM_MEMORY_SIZE(cocomp) * sizeof(short));
+    memset(cocomp->jit_covered, 0, VM_MEMORY_SIZE(cocomp));
+    cocomp->jit_block_count = 0;
+    cocomp->jit_code_used = 0;
+}
+
+// Unlink compiled blocks whose code bytes overlap [address, address + length).
+// Their machine code is only reclaimed by the next flush, so a block that is
+// still running when this is called from jit_store stays intact.
+void jit_invalidate(Cocomp *cocomp, int address, int length) {
+    int hit = 0;
+    for (int i = address; i < address + length && i < VM_MEMORY_SIZE(cocomp); i++) {
+        hit |= cocomp->jit_covered[i];
+    }
+    if (!hit) {
+        return;
+    }
+    for (int i = 0; i < cocomp->jit_block_count; i++) {
+        JitBlock *block = &cocomp->jit_blocks[i];
+        if (block->code && address < block->end && address + length > block->start) {
+            cocomp->jit_block_at[block->start] = 0;
+            cocomp->jit_counters[block->start] = 0;
+            block->code = NULL;
+        }
+    }
+}
+
+// Compile the straight-line run starting at `address` into x86-64 code. The
+// block covers LOAD_FLOAT/ADD/SUBTRACT/COMPARE/NOP, the bitwise and shift
+// immediates and in-range STOREs, and ends with a JUMP or just before any
+// other instruction, such as a conditional branch, which the interpreter
+// then executes. Returns the block number, or -1 if nothing at `address`
+// can be compiled or the block is too short to be worth a call.
+int jit_compile_block(Cocomp *cocomp, int address) {
+    DecodedInstruction body[JIT_MAX_BLOCK_INSTRUCTIONS];
+    int addresses[JIT_MAX_BLOCK_INSTRUCTIONS];
+    int count = 0;
+    int end = address;
+    int ends_in_jump = 0;
+
+    // Find the natural end of the block. Unchecked STOREs do not invalidate
+    // blocks, so a verified program's blocks stay inside the program.
+    int limit = cocomp->verified ? cocomp->code_size : VM_MEMORY_SIZE(cocomp);
+    while (count < JIT_MAX_BLOCK_INSTRUCTIONS && end < limit) {
+        DecodedInstruction *d = &body[count];
+        decode_instruction(cocomp, end, d);
+        int supported = d->op == OP_LOAD_FLOAT || d->op == OP_ADD || d->op == OP_SUBTRACT ||
+                        d->op == OP_COMPARE || d->op == OP_NOP || d->op == OP_AND ||
+                        d->op == OP_OR || d->op == OP_XOR || d->op == OP_SHIFT_LEFT ||
+                        d->op == OP_SHIFT_RIGHT || d->op == OP_JUMP ||
+                        (d->op == OP_STORE && d->ivalue >= 0 && d->ivalue <= cocomp->virtual_pages * VM_PAGE_SIZE(cocomp) - (long)sizeof(double));
+        if (!supported) {
+            break;
+        }
+        addresses[count++] = end;
+        end += d->length;
+        if (d->op == OP_JUMP) {
+            ends_in_jump = 1;
+            break;
+        }
+    }
+    // A STORE into the block's own bytes would leave stale native code
+    // running, so the block stops before the first such STORE.
+    for (int i = 0; i < count; i++) {
+        if (body[i].op == OP_STORE && body[i].ivalue < end &&
+            body[i].ivalue + (int)sizeof(double) > address) {
+            count = i;
+            end = addresses[i];
+            ends_in_jump = 0;
+            i = -1;
+        }
+    }
+    // A loop body in front of a conditional branch is often just an ADD or
+    // an ADD; COMPARE, which the interpreter runs (fused with the branch)
+    // faster than a call into native code.
+    if (count == 0 || (!ends_in_jump && count < JIT_MIN_BLOCK_INSTRUCTIONS)) {
+        return -1;
+    }
+
+    if (cocomp->jit_code == NULL) {
+        void *code = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code == MAP_FAILED) {
+            printf("JIT disabled: cannot map code buffer\n");
+            cocomp->jit_enabled = 0;
+            return -1;
+        }
+        cocomp->jit_code = code;
+    }
+    if (cocomp->jit_block_count == JIT_MAX_BLOCKS ||
+        cocomp->jit_code_used + 32 * (count + 2) > JIT_BUFFER_SIZE) {
+        jit_flush(cocomp);
+    }
+    if (mprotect(cocomp->jit_code, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        cocomp->jit_enabled = 0;
+        return -1;
+    }
+
+    unsigned char *entry = &cocomp->jit_code[cocomp->jit_code_used];
+    // push rbx; push r12; mov rbx, rdi; mov r12, rsi; sub rsp, 8
+    static const unsigned char prologue[] = {0x53, 0x41, 0x54, 0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4,
+                                             0x48, 0x83, 0xEC, 0x08};
+    // add rsp, 8; pop r12; pop rbx; ret
+    static const unsigned char epilogue[] = {0x48, 0x83, 0xC4, 0x08, 0x41, 0x5C, 0x5B, 0xC3};
+    static const unsigned char movq_xmm0_rax[] = {0x66, 0x48, 0x0F, 0x6E, 0xC0};
+    static const unsigned char movq_xmm1_rax[] = {0x66, 0x48, 0x0F, 0x6E, 0xC8};
+    static const unsigned char addsd_xmm0_xmm1[] = {0xF2, 0x0F, 0x58, 0xC1};
+    static const unsigned char subsd_xmm0_xmm1[] = {0xF2, 0x0F, 0x5C, 0xC1};
+    static const unsigned char cvttsd2si_eax_xmm0[] = {0xF2, 0x0F, 0x2C, 0xC0};
+    static const unsigned char cvtsi2sd_xmm0_eax[] = {0xF2, 0x0F, 0x2A, 0xC0};
+    static const unsigned char mov_rdi_rbx[] = {0x48, 0x89, 0xDF};
+    static const unsigned char call_rax[] = {0xFF, 0xD0};
+    static const unsigned char mov_r12_ptr_imm32[] = {0x41, 0xC7, 0x04, 0x24};
+    unsigned char op;
+    double (*store_helper)(double, Cocomp *, int) = jit_store;
+    double (*compare_helper)(double, Cocomp *, double) = jit_compare;
+
+    jit_emit(cocomp, prologue, sizeof(prologue));
+    for (int i = 0; i < count; i++) {
+        DecodedInstruction *d = &body[i];
+        switch (d->op) {
+            case OP_LOAD_FLOAT:  // mov rax, imm64; movq xmm0, rax
+                jit_emit(cocomp, (unsigned char[]){0x48, 0xB8}, 2);
+                jit_emit_imm64(cocomp, &d->fvalue);
+                jit_emit(cocomp, movq_xmm0_rax, sizeof(movq_xmm0_rax));
+                break;
+            case OP_ADD:
+            case OP_SUBTRACT:  // mov rax, imm64; movq xmm1, rax; addsd/subsd xmm0, xmm1
+                jit_emit(cocomp, (unsigned char[]){0x48, 0xB8}, 2);
+                jit_emit_imm64(cocomp, &d->fvalue);
+                jit_emit(cocomp, movq_xmm1_rax, sizeof(movq_xmm1_rax));
+                if (d->op == OP_ADD) {
+                    jit_emit(cocomp, addsd_xmm0_xmm1, sizeof(addsd_xmm0_xmm1));
+                } else {
+                    jit_emit(cocomp, subsd_xmm0_xmm1, sizeof(subsd_xmm0_xmm1));
+                }
+                break;
+            case OP_COMPARE:  // mov rax, imm64; movq xmm1, rax; mov rdi, rbx; mov rax, jit_compare; call rax
+                jit_emit(cocomp, (unsigned char[]){0x48, 0xB8}, 2);
+                jit_emit_imm64(cocomp, &d->fvalue);
+                jit_emit(cocomp, movq_xmm1_rax, sizeof(movq_xmm1_rax));
+                jit_emit(cocomp, mov_rdi_rbx, sizeof(mov_rdi_rbx));
+                jit_emit(cocomp, (unsigned char[]){0x48, 0xB8}, 2);
+                jit_emit_imm64(cocomp, &compare_helper);
+                jit_emit(cocomp, call_rax, sizeof(call_rax));
+                break;
+            case OP_AND:
+            case OP_OR:
+            case OP_XOR:  // cvttsd2si eax, xmm0; and/or/xor eax, imm32; cvtsi2sd xmm0, eax
+                op = d->op == OP_AND ? 0x25 : d->op == OP_OR ? 0x0D : 0x35;
+                jit_emit(cocomp, cvttsd2si_eax_xmm0, sizeof(cvttsd2si_eax_xmm0));
+                jit_emit(cocomp, &op, 1);
+                jit_emit_imm32(cocomp, d->ivalue);
+                jit_emit(cocomp, cvtsi2sd_xmm0_eax, sizeof(cvtsi2sd_xmm0_eax));
+                break;
+            case OP_SHIFT_LEFT:
+            case OP_SHIFT_RIGHT:  // shl/sar eax, imm8 (the host masks the count to 5 bits)
+                jit_emit(cocomp, cvttsd2si_eax_xmm0, sizeof(cvttsd2si_eax_xmm0));
+                jit_emit(cocomp, (unsigned char[]){0xC1, d->op == OP_SHIFT_LEFT ? 0xE0 : 0xF8,
+                                                   d->ivalue & 31}, 3);
+                jit_emit(cocomp, cvtsi2sd_xmm0_eax, sizeof(cvtsi2sd_xmm0_eax));
+                break;
+            case OP_STORE:  // mov esi, address; mov rdi, rbx; mov rax, jit_store; call rax
+                jit_emit(cocomp, (unsigned char[]){0xBE}, 1);
+                jit_emit_imm32(cocomp, d->ivalue);
+                jit_emit(cocomp, mov_rdi_rbx, sizeof(mov_rdi_rbx));
+                jit_emit(cocomp, (unsigned char[]){0x48, 0xB8}, 2);
+                jit_emit_imm64(cocomp, &store_helper);
+                jit_emit(cocomp, call_rax, sizeof(call_rax));
+                break;
+            default:  // NOP and the closing JUMP emit nothing
+                break;
+        }
+    }
+    // mov dword [r12], next_ip
+    jit_emit(cocomp, mov_r12_ptr_imm32, sizeof(mov_r12_ptr_imm32));
+    jit_emit_imm32(cocomp, ends_in_jump ? body[count - 1].ivalue : end);
+    jit_emit(cocomp, epilogue, sizeof(epilogue));
+
+    if (mprotect(cocomp->jit_code, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        cocomp->jit_enabled = 0;
+        return -1;
+    }
+    int index = cocomp->jit_block_count++;
+    JitBlock *block = &cocomp->jit_blocks[index];
+    block->start = address;
+    block->end = end;
+    block->code = (JitFunction)(void *)entry;
+    cocomp->jit_block_at[address] = index + 1;
+    memset(&cocomp->jit_covered[address], 1, end - address);
+    return index;
+}
+#endif
+
+// Interpreter over the pre-decoded instruction cache. The instruction pointer,
+// accumulator, flags and a copy of the top stack slot live in locals and
+// straight-line code simply steps to the next entry, so only control
+// transfers pay for a range check and address lookup. A conditional branch
+// that is not taken is straight-line code too.
+// With computed goto every handler ends in its own indirect jump, giving the
+// host predictor one branch site per opcode. Results are identical to
+// execute_program_switch.
+void execute_program_decoded(Cocomp *cocomp) {
+    // Parked threads wait for VMs on other host threads
+    while (!execute_program_quantum(cocomp, 0)) {
+        sched_yield();
+    }
+}
+
+// Run until the program stops or `quantum` basic blocks have been entered
+// (jumps, calls, returns and trace ends each count one; quantum <= 0 means no
+// limit). Returns 1 once the program has stopped, 0 if the quantum ran out
+// or every guest thread is waiting on a channel; calling it again resumes
+// exactly where it left off.
+int execute_program_quantum(Cocomp *cocomp, int quantum) {
+    DecodedInstruction *decoded = cocomp->decoded;
+    DecodedInstruction *d;
+    int ip = cocomp->instruction_pointer;
+    double acc = cocomp->accumulator;
+    double tos = 0;      // the top stack slot, while tos_cached
+    int tos_cached = 0;
+    int flags = cocomp->flags;
+    long budget = quantum > 0 ? quantum : -1;
+    int slice = cocomp->time_slice > 0 ? cocomp->time_slice : -1;
+    int stopped = 1;
+    cocomp->parked = 0;
+
+#if COCOMP_THREADED_DISPATCH
+    static void *dispatch_table[OP_COUNT] = {
+        [OP_RESOLVE] = &&L_OP_RESOLVE,
+        [OP_LINK] = &&L_OP_LINK,
+        [OP_UNDECODED] = &&L_OP_UNDECODED,
+        [OP_LOAD_FLOAT] = &&L_OP_LOAD_FLOAT,
+        [OP_ADD] = &&L_OP_ADD,
+        [OP_STORE] = &&L_OP_STORE,
+        [OP_PUSH] = &&L_OP_PUSH,
+        [OP_POP] = &&L_OP_POP,
+        [OP_JUMP] = &&L_OP_JUMP,
+        [OP_CALL] = &&L_OP_CALL,
+        [OP_RETURN] = &&L_OP_RETURN,
+        [OP_NOP] = &&L_OP_NOP,
+        [OP_SUBTRACT] = &&L_OP_SUBTRACT,
+        [OP_COMPARE] = &&L_OP_COMPARE,
+        [OP_SYSCALL] = &&L_OP_SYSCALL,
+        [OP_AND] = &&L_OP_AND,
+        [OP_OR] = &&L_OP_OR,
+        [OP_XOR] = &&L_OP_XOR,
+        [OP_SHIFT_LEFT] = &&L_OP_SHIFT_LEFT,
+        [OP_SHIFT_RIGHT] = &&L_OP_SHIFT_RIGHT,
+        [OP_BRANCH_EQUAL] = &&L_OP_BRANCH_EQUAL,
+        [OP_BRANCH_LESS] = &&L_OP_BRANCH_LESS,
+        [OP_BRANCH_GREATER] = &&L_OP_BRANCH_GREATER,
+        [OP_BRANCH_ZERO] = &&L_OP_BRANCH_ZERO,
+        [OP_DECREMENT_BRANCH] = &&L_OP_DECREMENT_BRANCH,
+        [OP_VECTOR] = &&L_OP_VECTOR,
+        [OP_END] = &&L_OP_END,
+        [OP_UNKNOWN] = &&L_OP_UNKNOWN,
+        [OP_FUSED_LOAD_PUSH] = &&L_OP_FUSED_LOAD_PUSH,
+        [OP_FUSED_LOAD_ARITH] = &&L_OP_FUSED_LOAD_ARITH,
+        [OP_FUSED_LOAD_ARITH_STORE] = &&L_OP_FUSED_LOAD_ARITH_STORE,
+        [OP_FUSED_BITWISE] = &&L_OP_FUSED_BITWISE,
+        [OP_FUSED_INT_CHAIN] = &&L_OP_FUSED_INT_CHAIN,
+        [OP_FUSED_COMPARE_BRANCH] = &&L_OP_FUSED_COMPARE_BRANCH,
+        [OP_STORE_VERIFIED] = &&L_OP_STORE_VERIFIED,
+        [OP_FUSED_LOAD_ARITH_STORE_VERIFIED] = &&L_OP_FUSED_LOAD_ARITH_STORE_VERIFIED,
+    };
+#define HANDLER(op) L_##op:
+#define DISPATCH() \
+    do { \
+        PROFILE(); \
+        goto *dispatch_table[d->op]; \
+    } while (0)
+#else
+#define HANDLER(op) case op:
+#define DISPATCH() goto dispatch
+#endif
+#ifdef COCOMP_PROFILE
+#define PROFILE() if (d->op >= OP_LOAD_FLOAT) profile_instruction(cocomp, ip, d)
+#else
+#define PROFILE()
+#endif
+// Fall through to the successor entry; ip advances past this instruction.
+#define NEXT() \
+    do { \
+        ip += d->length; \
+        d++; \
+        DISPATCH(); \
+    } while (0)
+// Skip the entries a superinstruction covers.
+#define NEXT_FUSED() \
+    do { \
+        ip += d->length; \
+        d += d->span; \
+        DISPATCH(); \
+    } while (0)
+// Continue at an arbitrary ip (after a jump, call or return).
+#define JUMP_TO(target) \
+    do { \
+        ip = (target); \
+        d = &decoded[0]; \
+        DISPATCH(); \
+    } while (0)
+// PUSH writes the slot through to memory and keeps it in tos too, so a POP
+// straight after it reads no memory. Anything that may write memory or
+// switch stacks (STOREs, system calls, compiled blocks, thread switches)
+// drops the copy.
+#define PUSH_ACC() \
+    do { \
+        int slot = cocomp->stack_pointer - (int)sizeof(double); \
+        if (slot < cocomp->stack_base) { \
+            report_error(cocomp, COCOMP_STACK_OVERFLOW, "Stack overflow!\n"); \
+        } else { \
+            write_stack_slot(cocomp, slot, acc); \
+            cocomp->stack_pointer = slot; \
+            tos = acc; \
+            tos_cached = 1; \
+        } \
+    } while (0)
+// Park the running guest thread and continue with the next ready one.
+#define RESCHEDULE() \
+    do { \
+        cocomp->instruction_pointer = ip; \
+        cocomp->accumulator = acc; \
+        cocomp->flags = flags; \
+        tos_cached = 0; \
+        if (!schedule_thread(cocomp)) goto done; \
+        acc = cocomp->accumulator; \
+        flags = cocomp->flags; \
+        JUMP_TO(cocomp->instruction_pointer); \
+    } while (0)
+
+    d = &decoded[0];
+resume:
+#if COCOMP_THREADED_DISPATCH
+    DISPATCH();
+    {
+#else
+dispatch:
+    PROFILE();
+    switch (d->op) {
+#endif
+        HANDLER(OP_RESOLVE)
+            if ((unsigned)ip >= (unsigned)VM_MEMORY_SIZE(cocomp)) goto thread_done;
+            if (--budget == 0) {
+                stopped = 0;
+                goto done;
+            }
+            if (--slice == 0) {  // preempt only at block entries
+                slice = cocomp->time_slice;
+                if (cocomp->thread_count > 1) {
+                    RESCHEDULE();
+                }
+            }
+#if COCOMP_JIT
+            if (cocomp->jit_enabled) {
+                int block = cocomp->jit_block_at[ip] - 1;
+                if (block < 0 && ++cocomp->jit_counters[ip] == JIT_THRESHOLD) {
+                    block = jit_compile_block(cocomp, ip);
+                }
+                if (block >= 0) {
+                    int next_ip;
+                    cocomp->flags = flags;
+                    acc = cocomp->jit_blocks[block].code(acc, cocomp, &next_ip);
+                    flags = cocomp->flags;
+                    tos_cached = 0;
+                    JUMP_TO(next_ip);
+                }
+            }
+#endif
+            d = &decoded[cocomp->decoded_index[ip]];
+            if (d == &decoded[0]) {
+                d = &decoded[decode_trace(cocomp, ip, -1)];
+            }
+            DISPATCH();
+        HANDLER(OP_LINK)
+            d = &decoded[d->ivalue];
+            DISPATCH();
+        HANDLER(OP_UNDECODED)
+            d = &decoded[redecode_instruction(cocomp, d - decoded, ip)];
+            DISPATCH();
+        HANDLER(OP_LOAD_FLOAT)  // LOAD_FLOAT immediate value into accumulator
+            acc = d->fvalue;
+            NEXT();
+        HANDLER(OP_ADD)  // ADD immediate value to accumulator
+            acc += d->fvalue;
+            NEXT();
+        HANDLER(OP_SUBTRACT)  // SUBTRACT immediate value from accumulator
+            acc -= d->fvalue;
+            NEXT();
+        HANDLER(OP_COMPARE)  // COMPARE accumulator with immediate value, setting the flags
+            flags = compare_flags(acc, d->fvalue);
+            NEXT();
+        HANDLER(OP_STORE)  // STORE accumulator to memory
+            if (!mmu_write(cocomp, d->ivalue, &acc, sizeof(double))) {
+                report_error(cocomp, COCOMP_INVALID_ADDRESS, "Invalid memory address %d\n", d->ivalue);
+            }
+            tos_cached = 0;
+            NEXT();
+        HANDLER(OP_STORE_VERIFIED)
+            memcpy(&cocomp->memory[d->ivalue], &acc, sizeof(double));
+            tos_cached = 0;
+            NEXT();
+        HANDLER(OP_PUSH)  // PUSH accumulator onto stack
+            PUSH_ACC();
+            NEXT();
+        HANDLER(OP_POP)  // POP from stack into accumulator
+            if (tos_cached) {
+                acc = tos;
+                cocomp->stack_pointer += sizeof(double);
+                tos_cached = 0;
+            } else {
+                acc = pop_stack(cocomp);
+            }
+            NEXT();
+        HANDLER(OP_JUMP)  // JUMP to address
+            JUMP_TO(d->ivalue);
+        HANDLER(OP_CALL)  // CALL function (0x07 and 0x0D)
+            if (!push_return(cocomp, ip + d->return_offset)) {
+                ip += d->length;
+                goto thread_done;
+            }
+            JUMP_TO(d->ivalue);
+        HANDLER(OP_RETURN)  // RETURN from function (0x08 and 0x0E)
+            {
+                int target = pop_return(cocomp);
+                if (target < 0) {
+                    ip += d->length;
+                    goto thread_done;
+                }
+                JUMP_TO(target);
+            }
+        HANDLER(OP_NOP)  // NOP (No Operation)
+            NEXT();
+        HANDLER(OP_SYSCALL)  // SYSTEM CALL (for I/O or other operations)
+            cocomp->instruction_pointer = ip + 1;
+            cocomp->accumulator = acc;
+            handle_interrupt(cocomp, d->ivalue);
+            acc = cocomp->accumulator;
+            tos_cached = 0;
+            if (cocomp->reschedule) {  // YIELD, JOIN, or SEND/RECV having to wait
+                cocomp->reschedule = 0;
+                if (!thread_waiting(cocomp)) {
+                    ip += d->length;
+                }
+                RESCHEDULE();
+            }
+            NEXT();
+        HANDLER(OP_AND)  // BITWISE AND accumulator with immediate value
+            acc = (int)acc & d->ivalue;
+            NEXT();
+        HANDLER(OP_OR)  // BITWISE OR accumulator with immediate value
+            acc = (int)acc | d->ivalue;
+            NEXT();
+        HANDLER(OP_XOR)  // BITWISE XOR accumulator with immediate value
+            acc = (int)acc ^ d->ivalue;
+            NEXT();
+        HANDLER(OP_SHIFT_LEFT)  // SHIFT LEFT accumulator by immediate value
+            acc = (int)acc << d->ivalue;
+            NEXT();
+        HANDLER(OP_SHIFT_RIGHT)  // SHIFT RIGHT accumulator by immediate value
+            acc = (int)acc >> d->ivalue;
+            NEXT();
+        HANDLER(OP_BRANCH_EQUAL)  // BEQ: branch if the last COMPARE found them equal
+            if (flags & FLAG_EQUAL) JUMP_TO(d->ivalue);
+            NEXT();
+        HANDLER(OP_BRANCH_LESS)  // BLT: ... the accumulator less
+            if (flags & FLAG_LESS) JUMP_TO(d->ivalue);
+            NEXT();
+        HANDLER(OP_BRANCH_GREATER)  // BGT: ... the accumulator greater
+            if (flags & FLAG_GREATER) JUMP_TO(d->ivalue);
+            NEXT();
+        HANDLER(OP_BRANCH_ZERO)  // BZ: branch if the accumulator is 0
+            if (acc == 0) JUMP_TO(d->ivalue);
+            NEXT();
+        HANDLER(OP_DECREMENT_BRANCH)  // DBNZ: take 1 from the top stack slot, branch unless that leaves 0
+            if (!tos_cached) {
+                if (cocomp->stack_pointer >= cocomp->stack_limit) {
+                    report_error(cocomp, COCOMP_STACK_UNDERFLOW, "Stack underflow!\n");
+                    NEXT();
+                }
+                tos = read_stack_slot(cocomp, cocomp->stack_pointer);
+                tos_cached = 1;
+            }
+            tos -= 1;
+            write_stack_slot(cocomp, cocomp->stack_pointer, tos);
+            if (tos != 0) JUMP_TO(d->ivalue);
+            NEXT();
+        HANDLER(OP_VECTOR)  // VADD, VMUL, VDOT, VFILL, VCOPY over ranges of doubles
+            acc = execute_vector(cocomp, d, acc);
+            tos_cached = 0;
+            NEXT();
+        HANDLER(OP_END)  // END program
+            ip += d->length;
+            goto thread_done;
+        HANDLER(OP_UNKNOWN)
+            report_error(cocomp, COCOMP_UNKNOWN_INSTRUCTION, "Unknown instruction %02x at address %d\n", d->opcode, ip);
+            ip += d->length;
+            goto thread_done;
+        HANDLER(OP_FUSED_LOAD_PUSH)
+            acc = d->fvalue;
+            PUSH_ACC();
+            NEXT_FUSED();
+        HANDLER(OP_FUSED_LOAD_ARITH)
+            acc = d->fvalue;
+            NEXT_FUSED();
+        HANDLER(OP_FUSED_LOAD_ARITH_STORE)
+            acc = d->fvalue;
+            if (!mmu_write(cocomp, d->ivalue, &acc, sizeof(double))) {
+                report_error(cocomp, COCOMP_INVALID_ADDRESS, "Invalid memory address %d\n", d->ivalue);
+            }
+            tos_cached = 0;
+            NEXT_FUSED();
+        HANDLER(OP_FUSED_LOAD_ARITH_STORE_VERIFIED)
+            acc = d->fvalue;
+            memcpy(&cocomp->memory[d->ivalue], &acc, sizeof(double));
+            tos_cached = 0;
+            NEXT_FUSED();
+        HANDLER(OP_FUSED_BITWISE)
+            acc = ((int)acc & d->ivalue) ^ d->xor_mask;
+            NEXT_FUSED();
+        HANDLER(OP_FUSED_INT_CHAIN)
+            {
+                int value = (int)acc;
+                for (int i = 0; i < d->span; i++) {
+                    switch (d[i].opcode) {
+                        case 0x0F: value &= d[i].ivalue; break;
+                        case 0x10: value |= d[i].ivalue; break;
+                        case 0x11: value ^= d[i].ivalue; break;
+                        case 0x12: value <<= d[i].ivalue; break;
+                        default: value >>= d[i].ivalue; break;
+                    }
+                }
+                acc = value;
+            }
+            NEXT_FUSED();
+        HANDLER(OP_FUSED_COMPARE_BRANCH)
+            flags = compare_flags(acc, d->fvalue);
+            if (flags & branch_flags[d[1].op]) JUMP_TO(d->ivalue);
+            NEXT_FUSED();
+#if !COCOMP_THREADED_DISPATCH
+        default:
+            goto done;
+#endif
+    }
+
+#undef HANDLER
+#undef DISPATCH
+#undef NEXT
+#undef NEXT_FUSED
+#undef JUMP_TO
+#undef PUSH_ACC
+#undef RESCHEDULE
+#undef PROFILE
+thread_done:
+    // The running thread has stopped; carry on with any other guest thread.
+    cocomp->instruction_pointer = ip;
+    cocomp->accumulator = acc;
+    cocomp->flags = flags;
+    if (end_thread(cocomp)) {
+        ip = cocomp->instruction_pointer;
+        acc = cocomp->accumulator;
+        flags = cocomp->flags;
+        tos_cached = 0;
+        d = &decoded[0];
+        goto resume;
+    }
+done:
+    cocomp->instruction_pointer = ip;
+    cocomp->accumulator = acc;
+    cocomp->flags = flags;
+#ifdef COCOMP_PROFILE
+    profile_flush(cocomp);
+#endif
+    flush_console(cocomp);
+    return stopped && !cocomp->parked;
+}
+
+const char *opcode_name(unsigned char opcode) {
+    switch (opcode) {
+        case 0x01: return "LOAD_FLOAT";
+        case 0x02: return "ADD";
+        case 0x03: return "STORE";
+        case 0x04: return "PUSH";
+        case 0x05: return "POP";
+        case 0x06: return "JUMP";
+        case 0x07: case 0x0D: return "CALL";
+        case 0x08: case 0x0E: return "RETURN";
+        case 0x09: return "NOP";
+        case 0x0A: return "SUBTRACT";
+        case 0x0B: return "COMPARE";
+        case 0x0C: return "SYSCALL";
+        case 0x0F: return "AND";
+        case 0x10: return "OR";
+        case 0x11: return "XOR";
+        case 0x12: return "SHIFT_LEFT";
+        case 0x13: return "SHIFT_RIGHT";
+        case 0x14: return "BEQ";
+        case 0x15: return "BLT";
+        case 0x16: return "BGT";
+        case 0x17: return "BZ";
+        case 0x18: return "DBNZ";
+        case 0x19: return "VADD";
+        case 0x1A: return "VMUL";
+        case 0x1B: return "VDOT";
+        case 0x1C: return "VFILL";
+        case 0x1D: return "VCOPY";
+        case 0xFF: return "END";
+        default: return "UNKNOWN";
+    }
+}
+
+// What follows an opcode in compact code
+enum {
+    OPERAND_NONE,
+    OPERAND_BYTE,    // SYSCALL code
+    OPERAND_INT,     // zigzag varint
+    OPERAND_NUMBER,  // small integer or constant pool index
+    OPERAND_DATA     // BYTE directive: the byte itself, with no opcode
+};
+
+static int compact_operand(unsigned char opcode) {
+    switch (opcode) {
+        case 0x01: case 0x02: case 0x0A: case 0x0B:
+            return OPERAND_NUMBER;
+        case 0x03: case 0x06: case 0x07: case 0x0D:
+        case 0x0F: case 0x10: case 0x11: case 0x12: case 0x13:
+        case 0x14: case 0x15: case 0x16: case 0x17: case 0x18:
+        case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D:
+            return OPERAND_INT;
+        case 0x0C:
+            return OPERAND_BYTE;
+        default:
+            return OPERAND_NONE;
+    }
+}
+
+static unsigned int zigzag(int value) {
+    return ((unsigned int)value << 1) ^ -(unsigned int)(value < 0);
+}
+
+static int varint_length(unsigned int value) {
+    int length = 1;
+    while (value >>= 7) {
+        length++;
+    }
+    return length;
+}
+
+static int write_varint(unsigned char *out, unsigned int value) {
+    int length = 0;
+    do {
+        out[length] = value & 0x7F;
+        value >>= 7;
+        out[length++] |= value ? 0x80 : 0;
+    } while (value);
+    return length;
+}
+
+typedef struct {
+    unsigned char opcode;
+    unsigned char kind;    // OPERAND_*
+    int line;
+    int label;             // label the operand names, or -1
+    int value;             // integer operand, SYSCALL code or data byte
+    unsigned int number;   // encoded OPERAND_NUMBER
+    int extra[2];          // a vector instruction's further operands
+    int extra_label[2];    // label each names, or -1
+    const char *extra_reference[2];
+    int extra_count;
+    int address;
+    int length;
+} AsmInstruction;
+
+// Operands an instruction takes in assembler source: a vector instruction
+// takes a destination and a count, with a source between them for all but
+// VFILL.
+static int asm_operand_count(const AsmInstruction *in) {
+    if (in->kind == OPERAND_DATA) {
+        return 1;
+    }
+    if (in->opcode >= 0x19 && in->opcode <= 0x1D) {
+        return in->opcode == 0x1C ? 2 : 3;
+    }
+    return in->kind != OPERAND_NONE;
+}
+
+// Bytes of a vector instruction's further operands
+static int asm_extra_length(const AsmInstruction *in) {
+    int length = 0;
+    for (int i = 0; i < in->extra_count; i++) {
+        length += varint_length(zigzag(in->extra[i]));
+    }
+    return length;
+}
+
+typedef struct {
+    const char *name;
+    int instruction;       // index of the instruction it comes before
+} AsmLabel;
+
+static int find_label(AsmLabel *labels, int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (!strcmp(labels[i].name, name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Assemble source text into a compact image. Each line holds an optional
+// `label:`, then a mnemonic (as opcode_name spells it, in any case) and its
+// operand, or a vector instruction's operands separated by commas; `;`
+// starts a comment. JUMP, CALL, the branches, STORE and a vector
+// instruction's addresses take an address or a label; BYTE n emits a raw
+// byte. Numbers that are small
+// integers are encoded inline and the rest go to the constant pool, once
+// each. Returns the image (free it), with its size in *size; or NULL, with
+// what is wrong in `error`.
+unsigned char *assemble(const char *source, long *size, char *error, int error_size) {
+    char *text = strdup(source);
+    AsmInstruction *instructions = NULL;
+    AsmLabel *labels = NULL;
+    double *constants = NULL;
+    char **references = NULL;  // label names used as operands, per instruction
+    int count = 0, capacity = 0, label_count = 0, label_capacity = 0, constant_count = 0, constant_capacity = 0;
+    unsigned char *image = NULL;
+    int line = 0;
+    snprintf(error, error_size, "out of memory");
+    if (!text) {
+        return NULL;
+    }
+    for (char *next = text; next; ) {
+        char *p = next;
+        line++;
+        next = strchr(p, '\n');
+        if (next) {
+            *next++ = '\0';
+        }
+        char *comment = strchr(p, ';');
+        if (comment) {
+            *comment = '\0';
+        }
+        char *tokens[5];
+        int token_count = 0;
+        char *save = NULL;
+        for (char *token = strtok_r(p, " \t\r,", &save); token; token = strtok_r(NULL, " \t\r,", &save)) {
+            if (token_count == 5) {
+                snprintf(error, error_size, "line %d: unexpected %s", line, token);
+                goto failed;
+            }
+            tokens[token_count++] = token;
+        }
+        int t = 0;
+        if (token_count > 0 && tokens[0][strlen(tokens[0]) - 1] == ':') {
+            char *name = tokens[t++];
+            name[strlen(name) - 1] = '\0';
+            if (!(isalpha((unsigned char)name[0]) || name[0] == '_') || find_label(labels, label_count, name) >= 0) {
+                snprintf(error, error_size, "line %d: bad or repeated label %s", line, name);
+                goto failed;
+            }
+            if (label_count == label_capacity) {
+                label_capacity = label_capacity ? 2 * label_capacity : 16;
+                AsmLabel *grown = realloc(labels, label_capacity * sizeof(AsmLabel));
+                if (!grown) goto failed;
+                labels = grown;
+            }
+            labels[label_count].name = name;
+            labels[label_count++].instruction = count;
+        }
+        if (t == token_count) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            AsmInstruction *grown = realloc(instructions, capacity * sizeof(AsmInstruction));
+            char **grown_references = realloc(references, capacity * sizeof(char *));
+            if (grown) instructions = grown;
+            if (grown_references) references = grown_references;
+            if (!grown || !grown_references) goto failed;
+        }
+        AsmInstruction *in = &instructions[count];
+        memset(in, 0, sizeof(*in));
+        in->line = line;
+        in->label = -1;
+        references[count] = NULL;
+        const char *mnemonic = tokens[t++];
+        const char *operand = t < token_count ? tokens[t] : NULL;
+        static const unsigned char opcodes[] = {
+            0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A,
+            0x0B, 0x0C, 0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16,
+            0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0xFF
+        };
+        int found = !strcasecmp(mnemonic, "BYTE");
+        in->kind = OPERAND_DATA;
+        for (int i = 0; !found && i < (int)sizeof(opcodes); i++) {
+            if (!strcasecmp(mnemonic, opcode_name(opcodes[i]))) {
+                in->opcode = opcodes[i];
+                in->kind = compact_operand(opcodes[i]);
+                found = 1;
+            }
+        }
+        if (!found) {
+            snprintf(error, error_size, "line %d: unknown instruction %s", line, mnemonic);
+            goto failed;
+        }
+        int operands = asm_operand_count(in);
+        if (token_count - t != operands) {
+            static const char *counts[] = {"no operand", "one operand", "two operands", "three operands"};
+            snprintf(error, error_size, "line %d: %s takes %s", line, mnemonic, counts[operands]);
+            goto failed;
+        }
+        char *end = NULL;
+        in->extra_count = operands - 1;
+        for (int i = 0; i < in->extra_count; i++) {
+            const char *extra = tokens[t + 1 + i];
+            in->extra_label[i] = -1;
+            if (isalpha((unsigned char)extra[0]) || extra[0] == '_') {
+                in->extra_reference[i] = extra;
+                in->extra[i] = INT_MAX;  // the longest varint, until the label has an address
+                continue;
+            }
+            long value = strtol(extra, &end, 0);
+            if (*end || value < INT_MIN || value > INT_MAX) {
+                snprintf(error, error_size, "line %d: bad operand %s", line, extra);
+                goto failed;
+            }
+            in->extra[i] = value;
+        }
+        if (in->kind == OPERAND_NUMBER) {
+            double number = strtod(operand, &end);
+            if (*end) {
+                snprintf(error, error_size, "line %d: bad number %s", line, operand);
+                goto failed;
+            }
+            if (fabs(number) < (1 << 26) && number == floor(number) && !(number == 0 && signbit(number))) {
+                in->number = zigzag((int)number) << 1;
+            } else {
+                int index = 0;
+                while (index < constant_count && memcmp(&constants[index], &number, sizeof(double))) {
+                    index++;
+                }
+                if (index == constant_count) {
+                    if (constant_count == constant_capacity) {
+                        constant_capacity = constant_capacity ? 2 * constant_capacity : 16;
+                        double *grown = realloc(constants, constant_capacity * sizeof(double));
+                        if (!grown) goto failed;
+                        constants = grown;
+                    }
+                    constants[constant_count++] = number;
+                }
+                in->number = (unsigned int)index << 1 | 1;
+            }
+            in->length = 1 + varint_length(in->number);
+        } else if (in->kind == OPERAND_INT && (isalpha((unsigned char)operand[0]) || operand[0] == '_')) {
+            references[count] = (char *)operand;
+            in->length = 1 + MAX_VARINT_LENGTH + asm_extra_length(in);  // until the label has an address
+        } else if (in->kind != OPERAND_NONE) {
+            long value = strtol(operand, &end, 0);
+            int low = in->kind == OPERAND_INT ? INT_MIN : 0;
+            int high = in->kind == OPERAND_INT ? INT_MAX : 255;
+            if (*end || value < low || value > high) {
+                snprintf(error, error_size, "line %d: bad operand %s", line, operand);
+                goto failed;
+            }
+            in->value = value;
+            in->length = in->kind == OPERAND_INT ? 1 + varint_length(zigzag(in->value)) + asm_extra_length(in) :
+                                                   1 + (in->kind == OPERAND_BYTE);
+        } else {
+            in->length = 1;
+        }
+        count++;
+    }
+    for (int i = 0; i < count; i++) {
+        AsmInstruction *in = &instructions[i];
+        if (references[i] && (in->label = find_label(labels, label_count, references[i])) < 0) {
+            snprintf(error, error_size, "line %d: undefined label %s", in->line, references[i]);
+            goto failed;
+        }
+        for (int k = 0; k < in->extra_count; k++) {
+            if (in->extra_reference[k] && (in->extra_label[k] = find_label(labels, label_count, in->extra_reference[k])) < 0) {
+                snprintf(error, error_size, "line %d: undefined label %s", in->line, in->extra_reference[k]);
+                goto failed;
+            }
+        }
+    }
+    // Lay the code out with every label operand at its longest, then shrink
+    // them to fit their labels' addresses until nothing moves. Addresses
+    // only go down, so this ends.
+    int code_size;
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        code_size = 0;
+        for (int i = 0; i < count; i++) {
+            instructions[i].address = code_size;
+            code_size += instructions[i].length;
+        }
+        for (int i = 0; i < count; i++) {
+            AsmInstruction *in = &instructions[i];
+            int labelled = in->label >= 0;
+            if (in->label >= 0) {
+                int target = labels[in->label].instruction;
+                in->value = target < count ? instructions[target].address : code_size;
+            }
+            for (int k = 0; k < in->extra_count; k++) {
+                if (in->extra_label[k] >= 0) {
+                    int target = labels[in->extra_label[k]].instruction;
+                    in->extra[k] = target < count ? instructions[target].address : code_size;
+                    labelled = 1;
+                }
+            }
+            if (labelled) {
+                int length = 1 + varint_length(zigzag(in->value)) + asm_extra_length(in);
+                changed |= length != in->length;
+                in->length = length;
+            }
+        }
+    }
+    *size = sizeof(CompactHeader) + constant_count * sizeof(double) + code_size;
+    image = malloc(*size);
+    if (!image) goto failed;
+    CompactHeader header = {.version = COMPACT_VERSION, .constant_count = constant_count, .code_size = code_size};
+    memcpy(header.magic, COMPACT_MAGIC, 4);
+    memcpy(image, &header, sizeof(header));
+    if (constant_count) {
+        memcpy(image + sizeof(header), constants, constant_count * sizeof(double));
+    }
+    unsigned char *out = image + sizeof(header) + constant_count * sizeof(double);
+    for (int i = 0; i < count; i++) {
+        AsmInstruction *in = &instructions[i];
+        if (in->kind == OPERAND_DATA) {
+            *out++ = in->value;
+            continue;
+        }
+        *out++ = in->opcode;
+        if (in->kind == OPERAND_BYTE) {
+            *out++ = in->value;
+        } else if (in->kind == OPERAND_INT) {
+            out += write_varint(out, zigzag(in->value));
+            for (int k = 0; k < in->extra_count; k++) {
+                out += write_varint(out, zigzag(in->extra[k]));
+            }
+        } else if (in->kind == OPERAND_NUMBER) {
+            out += write_varint(out, in->number);
+        }
+    }
+    error[0] = '\0';
+
+failed:
+    free(text);
+    free(instructions);
+    free(references);
+    free(labels);
+    free(constants);
+    return image;
+}
+
+// Write a number so that strtod reads back the same double.
+static void format_number(char *text, int size, double value) {
+    snprintf(text, size, "%.15g", value);
+    if (strtod(text, NULL) != value) {
+        snprintf(text, size, "%.17g", value);
+    }
+}
+
+// Write a raw program or a compact image as assembler source. Instructions
+// that a JUMP, CALL or branch targets get labels; bytes that do not decode come out
+// as BYTE. Returns 0, or -1 if the image is malformed.
+int disassemble(const unsigned char *program, long size, FILE *out) {
+    CompactHeader header;
+    const unsigned char *code = program;
+    const unsigned char *pool = NULL;
+    int code_end = size;
+    int pool_count = 0;
+    DecodedInstruction d;
+    if (size >= 4 && !memcmp(program, COMPACT_MAGIC, 4)) {
+        if (compact_program_size(program, size, &header) < 0) {
+            return -1;
+        }
+        pool = program + sizeof(CompactHeader);
+        pool_count = header.constant_count;
+        code = pool + pool_count * sizeof(double);
+        code_end = header.code_size;
+        fprintf(out, "; compact bytecode version %d: %d bytes of code, %d constants\n", header.version,
+                code_end, pool_count);
+    } else {
+        fprintf(out, "; raw bytecode: %d bytes\n", code_end);
+    }
+    // starts: 1 for an instruction, 2 for one with a label
+    unsigned char *starts = calloc(code_end + 1, 1);
+    if (!starts) {
+        return -1;
+    }
+    for (int i = 0; i < code_end; i += d.length) {
+        if (!decode_in_program(code, code_end, i, pool, pool_count, &d) || d.op == OP_UNKNOWN) {
+            d.length = 1;
+        }
+        starts[i] = 1;
+    }
+    for (int i = 0; i < code_end; i += d.length) {
+        if (!decode_in_program(code, code_end, i, pool, pool_count, &d) || d.op == OP_UNKNOWN) {
+            d.length = 1;
+        } else if (has_code_target(d.op) && d.ivalue >= 0 && d.ivalue < code_end && starts[d.ivalue]) {
+            starts[d.ivalue] = 2;
+        }
+    }
+    for (int i = 0; i < code_end; i += d.length) {
+        char text[64];
+        char number[32];
+        const char *name = opcode_name(code[i]);
+        if (starts[i] == 2) {
+            fprintf(out, "L%d:\n", i);
+        }
+        if (!decode_in_program(code, code_end, i, pool, pool_count, &d) || d.op == OP_UNKNOWN) {
+            d.length = 1;
+            snprintf(text, sizeof(text), "BYTE 0x%02X", code[i]);
+        } else if (d.op == OP_LOAD_FLOAT || d.op == OP_ADD || d.op == OP_SUBTRACT || d.op == OP_COMPARE) {
+            format_number(number, sizeof(number), d.fvalue);
+            snprintf(text, sizeof(text), "%s %s", name, number);
+        } else if (has_code_target(d.op) && d.ivalue >= 0 && d.ivalue < code_end && starts[d.ivalue] == 2) {
+            snprintf(text, sizeof(text), "%s L%d", name, d.ivalue);
+        } else if (d.op == OP_VECTOR && code[i] == 0x1C) {
+            snprintf(text, sizeof(text), "%s %d, %d", name, d.ivalue, d.vector_count);
+        } else if (d.op == OP_VECTOR) {
+            snprintf(text, sizeof(text), "%s %d, %d, %d", name, d.ivalue, d.vector_source, d.vector_count);
+        } else if (compact_operand(code[i]) != OPERAND_NONE) {
+            snprintf(text, sizeof(text), "%s %d", name, d.ivalue);
+        } else {
+            snprintf(text, sizeof(text), "%s", name);
+        }
+        fprintf(out, "    %-32s ; %d\n", text, i);
+    }
+    free(starts);
+    return 0;
+}
+
+#ifdef COCOMP_PROFILE
+void reset_profile(Cocomp *cocomp) {
+    Profile *profile = &cocomp->profile;
+    long *address_counts = profile->address_counts;
+    long *address_samples = profile->address_samples;
+    unsigned long long *address_cycles = profile->address_cycles;
+    int *current_frame = profile->current_frame;
+    memset(profile, 0, sizeof(Profile));
+    memset(address_counts, 0, cocomp->memory_size * sizeof(long));
+    memset(address_samples, 0, cocomp->memory_size * sizeof(long));
+    memset(address_cycles, 0, cocomp->memory_size * sizeof(unsigned long long));
+    profile->address_counts = address_counts;
+    profile->address_samples = address_samples;
+    profile->address_cycles = address_cycles;
+    profile->current_frame = current_frame;
+    for (int i = 0; i < cocomp->max_threads; i++) {
+        profile->frames[i].parent = -1;
+        profile->frames[i].function = -1;
+        profile->frames[i].first_child = -1;
+        profile->frames[i].next_sibling = -1;
+        profile->current_frame[i] = i;
+    }
+    profile->frame_count = cocomp->max_threads;
+    profile->countdown = PROFILE_SAMPLE_INTERVAL;
+    profile->sample_ip = -1;
+}
+
+// Finish timing the sampled instruction, if one is in flight.
+void profile_flush(Cocomp *cocomp) {
+    Profile *profile = &cocomp->profile;
+    if (profile->sample_ip >= 0) {
+        unsigned long long cycles = profile_clock() - profile->sample_start;
+        profile->opcode_cycles[profile->sample_opcode] += cycles;
+        profile->opcode_samples[profile->sample_opcode]++;
+        profile->address_cycles[profile->sample_ip] += cycles;
+        profile->address_samples[profile->sample_ip]++;
+        profile->sample_ip = -1;
+    }
+}
+
+// Called by the interpreter as each guest instruction is dispatched. A
+// sampled instruction is timed until the next dispatch.
+void profile_instruction(Cocomp *cocomp, int address, const DecodedInstruction *d) {
+    Profile *profile = &cocomp->profile;
+    int *frame = &profile->current_frame[cocomp->thread_id];
+
+    profile_flush(cocomp);
+    profile->opcode_counts[d->opcode]++;
+    profile->address_counts[address]++;
+    profile->frames[*frame].count++;
+
+    if (d->op == OP_CALL) {
+        int child = profile->frames[*frame].first_child;
+        while (child >= 0 && profile->frames[child].function != d->ivalue) {
+            child = profile->frames[child].next_sibling;
+        }
+        if (child < 0 && profile->frame_count < PROFILE_MAX_FRAMES) {
+            child = profile->frame_count++;
+            profile->frames[child].parent = *frame;
+            profile->frames[child].function = d->ivalue;
+            profile->frames[child].first_child = -1;
+            profile->frames[child].next_sibling = profile->frames[*frame].first_child;
+            profile->frames[*frame].first_child = child;
+        }
+        if (child >= 0) {
+            *frame = child;
+        }
+    } else if (d->op == OP_RETURN && profile->frames[*frame].parent >= 0) {
+        *frame = profile->frames[*frame].parent;
+    }
+
+    if (--profile->countdown == 0) {
+        profile->seed = profile->seed * 1103515245 + 12345;
+        profile->countdown = 1 + (profile->seed >> 16) % (2 * PROFILE_SAMPLE_INTERVAL - 1);
+        profile->sample_ip = address;
+        profile->sample_opcode = d->opcode;
+        profile->sample_start = profile_clock();
+    }
+}
+
+typedef struct {
+    int key;
+    long count;
+    double cycles;  // estimated: sampled cycles scaled up to every execution
+} ProfileEntry;
+
+static int compare_profile_entries(const void *a, const void *b) {
+    const ProfileEntry *x = a, *y = b;
+    if (x->cycles != y->cycles) return x->cycles < y->cycles ? 1 : -1;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return x->key - y->key;
+}
+
+void print_profile(Cocomp *cocomp) {
+    Profile *profile = &cocomp->profile;
+    ProfileEntry opcodes[256];
+    int range_count = (cocomp->memory_size + PROFILE_RANGE_SIZE - 1) / PROFILE_RANGE_SIZE;
+    ProfileEntry *ranges = malloc(range_count * sizeof(ProfileEntry));
+    if (!ranges) {
+        return;
+    }
+    long total = 0;
+    double total_cycles = 0;
+
+    for (int i = 0; i < 256; i++) {
+        opcodes[i].key = i;
+        opcodes[i].count = profile->opcode_counts[i];
+        opcodes[i].cycles = profile->opcode_samples[i] ?
+            (double)profile->opcode_cycles[i] * profile->opcode_counts[i] / profile->opcode_samples[i] : 0;
+        total += opcodes[i].count;
+        total_cycles += opcodes[i].cycles;
+    }
+    for (int i = 0; i < range_count; i++) {
+        ranges[i].key = i * PROFILE_RANGE_SIZE;
+        ranges[i].count = 0;
+        ranges[i].cycles = 0;
+        for (int address = ranges[i].key; address < ranges[i].key + PROFILE_RANGE_SIZE && address < cocomp->memory_size; address++) {
+            ranges[i].count += profile->address_counts[address];
+            if (profile->address_samples[address]) {
+                ranges[i].cycles += (double)profile->address_cycles[address] *
+                    profile->address_counts[address] / profile->address_samples[address];
+            }
+        }
+    }
+    qsort(opcodes, 256, sizeof(ProfileEntry), compare_profile_entries);
+    qsort(ranges, range_count, sizeof(ProfileEntry), compare_profile_entries);
+
+    printf("Profile: %ld instructions, ~%.0f cycles (1 in ~%d timed)\n", total, total_cycles, PROFILE_SAMPLE_INTERVAL);
+    if (total_cycles == 0) total_cycles = 1;
+    printf("Hottest opcodes:\n");
+    for (int i = 0; i < 10 && opcodes[i].count; i++) {
+        printf("  %02x %-12s %10ld executed  %5.1f%% of cycles  %6.1f cycles each\n",
+               opcodes[i].key, opcode_name(opcodes[i].key), opcodes[i].count, 100 * opcodes[i].cycles / total_cycles,
+               opcodes[i].cycles / opcodes[i].count);
+    }
+    printf("Hottest address ranges:\n");
+    for (int i = 0; i < 10 && i < range_count && ranges[i].count; i++) {
+        printf("  %04x-%04x       %10ld executed  %5.1f%% of cycles\n", ranges[i].key,
+               ranges[i].key + PROFILE_RANGE_SIZE - 1, ranges[i].count, 100 * ranges[i].cycles / total_cycles);
+    }
+    free(ranges);
+}
+
+static void write_folded_frame(Profile *profile, int frame, FILE *file) {
+    if (profile->frames[frame].parent >= 0) {
+        write_folded_frame(profile, profile->frames[frame].parent, file);
+        fprintf(file, ";0x%04x", profile->frames[frame].function);
+    } else if (frame == 0) {
+        fprintf(file, "main");
+    } else {
+        fprintf(file, "thread%d", frame);
+    }
+}
+
+// Write the call tree as folded stacks ("main;0x0040;0x0100 <instructions>"),
+// the input format of flamegraph.pl and compatible tools. Returns 0, or -1 if
+// the file cannot be written.
+int export_folded_stacks(Cocomp *cocomp, const char *path) {
+    Profile *profile = &cocomp->profile;
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        printf("Cannot open %s for writing\n", path);
+        return -1;
+    }
+    for (int frame = 0; frame < profile->frame_count; frame++) {
+        if (profile->frames[frame].count == 0) {
+            continue;
+        }
+        write_folded_frame(profile, frame, file);
+        fprintf(file, " %ld\n", profile->frames[frame].count);
+    }
+    fclose(file);
+    return 0;
+}
+#endif
+
+static void *batch_alloc(size_t size) {
+    size = (size + 31) & ~(size_t)31;  // aligned_alloc wants a multiple of the alignment
+    void *block = aligned_alloc(32, size);
+    if (block) {
+        memset(block, 0, size);
+    }
+    return block;
+}
+
+// Load one program per lane. Lane 0's image is the shared code; any byte
+// where another lane's image differs is marked lane-private up front.
+CocompBatch *create_batch(unsigned char **programs, int *sizes, int count) {
+    for (int i = 0; i < count; i++) {
+        if (sizes[i] > MEMORY_SIZE) {
+            printf("Program size exceeds memory capacity!\n");
+            return NULL;
+        }
+    }
+    CocompBatch *batch = calloc(1, sizeof(CocompBatch));
+    if (!batch) {
+        printf("Batch allocation failed!\n");
+        return NULL;
+    }
+    batch->count = count;
+    batch->padded_count = (count + BATCH_VECTOR_LANES - 1) / BATCH_VECTOR_LANES * BATCH_VECTOR_LANES;
+    int lanes = batch->padded_count;
+    batch->accumulators = batch_alloc(lanes * sizeof(double));
+    batch->instruction_pointers = batch_alloc(lanes * sizeof(int));
+    batch->stack_pointers = batch_alloc(lanes * sizeof(int));
+    batch->return_stacks = batch_alloc((size_t)lanes * CALL_DEPTH * sizeof(int));
+    batch->return_depths = batch_alloc(lanes * sizeof(int));
+    batch->flags = batch_alloc(lanes * sizeof(int));
+    batch->final_ips = batch_alloc(lanes * sizeof(int));
+    batch->memory = batch_alloc((size_t)lanes * BATCH_MEMORY_STRIDE);
+    batch->shared_code = batch_alloc(BATCH_MEMORY_STRIDE);
+    batch->lane_private = batch_alloc(BATCH_MEMORY_STRIDE);
+    batch->code_state = batch_alloc(MEMORY_SIZE);
+    batch->code = batch_alloc(MEMORY_SIZE * sizeof(DecodedInstruction));
+    if (!batch->accumulators || !batch->instruction_pointers || !batch->stack_pointers ||
+        !batch->return_stacks || !batch->return_depths || !batch->flags || !batch->final_ips || !batch->memory || !batch->shared_code || !batch->lane_private ||
+        !batch->code_state || !batch->code) {
+        printf("Batch allocation failed!\n");
+        free_batch(batch);
+        return NULL;
+    }
+
+    if (count > 0) {
+        memcpy(batch->shared_code, programs[0], sizes[0]);
+    }
+    for (int lane = 0; lane < lanes; lane++) {
+        batch->stack_pointers[lane] = MEMORY_SIZE;
+        if (lane >= count) {
+            batch->instruction_pointers[lane] = BATCH_HALTED;
+            continue;
+        }
+        unsigned char *memory = batch_memory(batch, lane);
+        memcpy(memory, programs[lane], sizes[lane]);
+        if (memcmp(memory, batch->shared_code, MEMORY_SIZE) != 0) {
+            for (int i = 0; i < MEMORY_SIZE; i++) {
+                batch->lane_private[i] |= memory[i] != batch->shared_code[i];
+            }
+        }
+    }
+    return batch;
+}
+
+unsigned char *batch_memory(CocompBatch *batch, int index) {
+    return &batch->memory[(size_t)index * BATCH_MEMORY_STRIDE];
+}
+
+void free_batch(CocompBatch *batch) {
+    if (!batch) {
+        return;
+    }
+    free(batch->accumulators);
+    free(batch->instruction_pointers);
+    free(batch->stack_pointers);
+    free(batch->return_stacks);
+    free(batch->return_depths);
+    free(batch->flags);
+    free(batch->final_ips);
+    free(batch->memory);
+    free(batch->shared_code);
+    free(batch->lane_private);
+    free(batch->code_state);
+    free(batch->code);
+    free(batch);
+}
+
+// A lane wrote [address, address + length): those bytes can no longer be
+// assumed equal across lanes, so drop shared decodes that overlap them.
+static void batch_note_write(CocompBatch *batch, int address, int length) {
+    int first = address - (MAX_INSTRUCTION_LENGTH - 1);
+    int last = address + length;
+    if (first < 0) first = 0;
+    if (last > MEMORY_SIZE) last = MEMORY_SIZE;
+    memset(&batch->lane_private[address], 1, length);
+    for (int i = first; i < last; i++) {
+        if (batch->code_state[i] == BATCH_SHARED) {
+            batch->code_state[i] = BATCH_UNDECODED;
+        }
+    }
+}
+
+static void batch_decode(CocompBatch *batch, int address) {
+    if (memchr(&batch->lane_private[address], 1, MAX_INSTRUCTION_LENGTH)) {
+        batch->code_state[address] = BATCH_PER_LANE;
+    } else {
+        decode_bytes(batch->shared_code, address, &batch->code[address]);
+        batch->code_state[address] = BATCH_SHARED;
+    }
+}
+
+// Mirrors push_stack/pop_stack on a lane's memory.
+static void batch_push(CocompBatch *batch, int lane, double value) {
+    if (batch->stack_pointers[lane] - (int)sizeof(double) < MEMORY_SIZE - STACK_SIZE) {
+        printf("Stack overflow!\n");
+        return;
+    }
+    int address = batch->stack_pointers[lane] -= sizeof(double);
+    memcpy(&batch_memory(batch, lane)[address], &value, sizeof(double));
+    batch_note_write(batch, address, sizeof(double));
+}
+
+static double batch_pop(CocompBatch *batch, int lane) {
+    if (batch->stack_pointers[lane] >= MEMORY_SIZE) {
+        printf("Stack underflow!\n");
+        return 0;
+    }
+    double value;
+    memcpy(&value, &batch_memory(batch, lane)[batch->stack_pointers[lane]], sizeof(double));
+    batch->stack_pointers[lane] += sizeof(double);
+    return value;
+}
+
+// Mirrors push_return/pop_return; a lane whose return stack overflows or
+// underflows halts, as its thread would.
+static int batch_push_return(CocompBatch *batch, int lane, int address) {
+    if (batch->return_depths[lane] == CALL_DEPTH) {
+        printf("Call stack overflow!\n");
+        return 0;
+    }
+    batch->return_stacks[lane * CALL_DEPTH + batch->return_depths[lane]++] = address;
+    return 1;
+}
+
+static int batch_pop_return(CocompBatch *batch, int lane) {
+    if (batch->return_depths[lane] == 0) {
+        printf("RETURN without a CALL!\n");
+        return -1;
+    }
+    return batch->return_stacks[lane * CALL_DEPTH + --batch->return_depths[lane]];
+}
+
+// Run the instruction at `ip` on a single lane, the way
+// execute_program_decoded would. `d` is the shared decode, or NULL to decode
+// from the lane's own memory.
+static void batch_step_lane(CocompBatch *batch, int lane, int ip, const DecodedInstruction *d) {
+    DecodedInstruction own;
+    double acc = batch->accumulators[lane];
+    int next_ip;
+    int halted = 0;
+
+    if (!d) {
+        decode_bytes(batch_memory(batch, lane), ip, &own);
+        d = &own;
+    }
+    next_ip = ip + d->length;
+    switch (d->op) {
+        case OP_LOAD_FLOAT: acc = d->fvalue; break;
+        case OP_ADD: acc += d->fvalue; break;
+        case OP_SUBTRACT: acc -= d->fvalue; break;
+        case OP_AND: acc = (int)acc & d->ivalue; break;
+        case OP_OR: acc = (int)acc | d->ivalue; break;
+        case OP_XOR: acc = (int)acc ^ d->ivalue; break;
+        case OP_SHIFT_LEFT: acc = (int)acc << d->ivalue; break;
+        case OP_SHIFT_RIGHT: acc = (int)acc >> d->ivalue; break;
+        case OP_STORE:
+            if (d->ivalue >= 0 && d->ivalue < MEMORY_SIZE) {
+                memcpy(&batch_memory(batch, lane)[d->ivalue], &acc, sizeof(double));
+                batch_note_write(batch, d->ivalue, sizeof(double));
+            } else {
+                printf("Invalid memory address %d\n", d->ivalue);
+            }
+            break;
+        case OP_PUSH: batch_push(batch, lane, acc); break;
+        case OP_POP: acc = batch_pop(batch, lane); break;
+        case OP_JUMP: next_ip = d->ivalue; break;
+        case OP_COMPARE: batch->flags[lane] = compare_flags(acc, d->fvalue); break;
+        case OP_BRANCH_EQUAL:
+        case OP_BRANCH_LESS:
+        case OP_BRANCH_GREATER:
+            if (batch->flags[lane] & branch_flags[d->op]) {
+                next_ip = d->ivalue;
+            }
+            break;
+        case OP_BRANCH_ZERO:
+            if (acc == 0) {
+                next_ip = d->ivalue;
+            }
+            break;
+        case OP_DECREMENT_BRANCH:
+            if (batch->stack_pointers[lane] >= MEMORY_SIZE) {
+                printf("Stack underflow!\n");
+            } else {
+                int address = batch->stack_pointers[lane];
+                double count;
+                memcpy(&count, &batch_memory(batch, lane)[address], sizeof(double));
+                count -= 1;
+                memcpy(&batch_memory(batch, lane)[address], &count, sizeof(double));
+                batch_note_write(batch, address, sizeof(double));
+                if (count != 0) {
+                    next_ip = d->ivalue;
+                }
+            }
+            break;
+        case OP_VECTOR:
+            if (vector_in_range(d, MEMORY_SIZE)) {
+                double sums[VECTOR_SUMS] = {0};
+                run_vector_kernel(vector_kernels, batch_memory(batch, lane), d->opcode, d->ivalue,
+                                  d->vector_source, d->vector_count, acc, sums);
+                if (d->opcode == 0x1B) {
+                    acc = vector_total(sums);
+                } else {
+                    batch_note_write(batch, d->ivalue, d->vector_count * sizeof(double));
+                }
+            } else {
+                printf("Invalid vector range: %d doubles at %d and %d\n", d->vector_count, d->ivalue, d->vector_source);
+            }
+            break;
+        case OP_CALL:
+            if (batch_push_return(batch, lane, ip + 1)) {
+                next_ip = d->ivalue;
+            } else {
+                halted = 1;
+            }
+            break;
+        case OP_RETURN:
+            {
+                int address = batch_pop_return(batch, lane);
+                if (address >= 0) {
+                    next_ip = address;
+                } else {
+                    halted = 1;
+                }
+            }
+            break;
+        case OP_SYSCALL:
+            if (d->ivalue == 0x01) {
+                printf("I/O Interrupt: Accumulator value = %lf\n", acc);
+            } else {
+                printf("Unknown interrupt code %02x\n", d->ivalue);
+            }
+            break;
+        case OP_UNKNOWN:
+            printf("Unknown instruction %02x at address %d\n", d->opcode, ip);
+            halted = 1;
+            break;
+        case OP_END:
+            halted = 1;
+            break;
+        default:  // NOP
+            break;
+    }
+    if (halted || (unsigned)next_ip >= MEMORY_SIZE) {
+        batch->final_ips[lane] = next_ip;
+        next_ip = BATCH_HALTED;
+    }
+    batch->accumulators[lane] = acc;
+    batch->instruction_pointers[lane] = next_ip;
+}
+
+static int batch_uniform_op(int op) {
+    switch (op) {
+        case OP_LOAD_FLOAT: case OP_ADD: case OP_SUBTRACT: case OP_NOP:
+        case OP_JUMP: case OP_AND: case OP_OR: case OP_XOR: case OP_SHIFT_LEFT: case OP_SHIFT_RIGHT:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Apply a shared accumulator-only instruction to every lane at `ip` and move
+// those lanes to `next_ip`.
+static void batch_apply(CocompBatch *batch, int ip, const DecodedInstruction *d, int next_ip) {
+    double *accumulators = batch->accumulators;
+    int *ips = batch->instruction_pointers;
+    int lanes = batch->padded_count;
+
+#if COCOMP_AVX2
+    __m128i at = _mm_set1_epi32(ip);
+    __m128i next = _mm_set1_epi32(next_ip);
+    __m256d fvalue = _mm256_set1_pd(d->fvalue);
+    __m128i ivalue = _mm_set1_epi32(d->ivalue);
+    __m128i shift = _mm_cvtsi32_si128(d->ivalue & 31);  // what the scalar shl/sar do
+#define BATCH_LOOP(result) \
+    for (int lane = 0; lane < lanes; lane += 4) { \
+        __m128i lane_ips = _mm_load_si128((__m128i *)&ips[lane]); \
+        __m128i hit = _mm_cmpeq_epi32(lane_ips, at); \
+        if (_mm_testz_si128(hit, hit)) continue; \
+        __m256d acc = _mm256_load_pd(&accumulators[lane]); \
+        __m256d mask = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(hit)); \
+        _mm256_store_pd(&accumulators[lane], _mm256_blendv_pd(acc, (result), mask)); \
+        _mm_store_si128((__m128i *)&ips[lane], _mm_blendv_epi8(lane_ips, next, hit)); \
+    }
+#define BATCH_INT(op) _mm256_cvtepi32_pd(op(_mm256_cvttpd_epi32(acc), ivalue))
+#define BATCH_SHIFT(op) _mm256_cvtepi32_pd(op(_mm256_cvttpd_epi32(acc), shift))
+#else
+#define BATCH_LOOP(result) \
+    for (int lane = 0; lane < lanes; lane++) { \
+        if (ips[lane] != ip) continue; \
+        double acc = accumulators[lane]; \
+        (void)acc; \
+        accumulators[lane] = (result); \
+        ips[lane] = next_ip; \
+    }
+#endif
+
+    switch (d->op) {
+#if COCOMP_AVX2
+        case OP_LOAD_FLOAT: BATCH_LOOP(fvalue); break;
+        case OP_ADD: BATCH_LOOP(_mm256_add_pd(acc, fvalue)); break;
+        case OP_SUBTRACT: BATCH_LOOP(_mm256_sub_pd(acc, fvalue)); break;
+        case OP_AND: BATCH_LOOP(BATCH_INT(_mm_and_si128)); break;
+        case OP_OR: BATCH_LOOP(BATCH_INT(_mm_or_si128)); break;
+        case OP_XOR: BATCH_LOOP(BATCH_INT(_mm_xor_si128)); break;
+        case OP_SHIFT_LEFT: BATCH_LOOP(BATCH_SHIFT(_mm_sll_epi32)); break;
+        case OP_SHIFT_RIGHT: BATCH_LOOP(BATCH_SHIFT(_mm_sra_epi32)); break;
+#else
+        case OP_LOAD_FLOAT: BATCH_LOOP(d->fvalue); break;
+        case OP_ADD: BATCH_LOOP(acc + d->fvalue); break;
+        case OP_SUBTRACT: BATCH_LOOP(acc - d->fvalue); break;
+        case OP_AND: BATCH_LOOP((int)acc & d->ivalue); break;
+        case OP_OR: BATCH_LOOP((int)acc | d->ivalue); break;
+        case OP_XOR: BATCH_LOOP((int)acc ^ d->ivalue); break;
+        case OP_SHIFT_LEFT: BATCH_LOOP((int)acc << d->ivalue); break;
+        case OP_SHIFT_RIGHT: BATCH_LOOP((int)acc >> d->ivalue); break;
+#endif
+        default: BATCH_LOOP(acc); break;  // NOP and JUMP only move the lanes
+    }
+#undef BATCH_LOOP
+#undef BATCH_INT
+#undef BATCH_SHIFT
+}
+
+// Lowest instruction pointer among live lanes (BATCH_HALTED if none) and
+// whether every live lane is there.
+static int batch_next_ip(CocompBatch *batch, int *converged) {
+    int *ips = batch->instruction_pointers;
+    int lanes = batch->padded_count;
+
+#if COCOMP_AVX2
+    __m256i halted = _mm256_set1_epi32(BATCH_HALTED);
+    __m256i low = halted;
+    __m256i high = _mm256_set1_epi32(INT_MIN);
+    for (int lane = 0; lane < lanes; lane += 8) {
+        __m256i lane_ips = _mm256_load_si256((__m256i *)&ips[lane]);
+        __m256i live = _mm256_andnot_si256(_mm256_cmpeq_epi32(lane_ips, halted), lane_ips);
+        low = _mm256_min_epi32(low, lane_ips);
+        high = _mm256_max_epi32(high, live);  // stopped lanes count as 0
+    }
+    int lows[8], highs[8];
+    _mm256_storeu_si256((__m256i *)lows, low);
+    _mm256_storeu_si256((__m256i *)highs, high);
+    int min = lows[0], max = highs[0];
+    for (int i = 1; i < 8; i++) {
+        if (lows[i] < min) min = lows[i];
+        if (highs[i] > max) max = highs[i];
+    }
+#else
+    int min = BATCH_HALTED, max = 0;
+    for (int lane = 0; lane < lanes; lane++) {
+        if (ips[lane] == BATCH_HALTED) continue;
+        if (ips[lane] < min) min = ips[lane];
+        if (ips[lane] > max) max = ips[lane];
+    }
+#endif
+    *converged = min == max;
+    return min;
+}
+
+// Run every lane to completion.
+void execute_batch(CocompBatch *batch) {
+    int converged;
+    int ip;
+
+    while ((ip = batch_next_ip(batch, &converged)) != BATCH_HALTED) {
+        if (converged) {
+            batch->lockstep_steps++;
+        } else {
+            batch->divergent_steps++;
+        }
+        if (batch->code_state[ip] == BATCH_UNDECODED) {
+            batch_decode(batch, ip);
+        }
+        const DecodedInstruction *d = NULL;
+        if (batch->code_state[ip] == BATCH_SHARED) {
+            d = &batch->code[ip];
+            int next_ip = d->op == OP_JUMP ? d->ivalue : ip + d->length;
+            if (batch_uniform_op(d->op) && (unsigned)next_ip < MEMORY_SIZE) {
+                batch_apply(batch, ip, d, next_ip);
+                continue;
+            }
+        }
+        for (int lane = 0; lane < batch->count; lane++) {
+            if (batch->instruction_pointers[lane] == ip) {
+                batch_step_lane(batch, lane, ip, d);
+            }
+        }
+    }
+}
+
+void get_batch_results(CocompBatch *batch, BatchResult *results) {
+    for (int lane = 0; lane < batch->count; lane++) {
+        results[lane].accumulator = batch->accumulators[lane];
+        results[lane].instruction_pointer = batch->final_ips[lane];
+        results[lane].stack_pointer = batch->stack_pointers[lane];
+    }
+}
+
+// Run `count` programs to completion in one batch and fill in their final
+// state. Returns 0, or -1 if the batch could not be set up.
+int run_batch(unsigned char **programs, int *sizes, int count, BatchResult *results) {
+    CocompBatch *batch = create_batch(programs, sizes, count);
+    if (!batch) {
+        return -1;
+    }
+    execute_batch(batch);
+    get_batch_results(batch, results);
+    free_batch(batch);
+    return 0;
+}
+
+static long farm_nanoseconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Add a job to a worker's deque, at the tail (newest, taken next by the
+// owner) or at the head (taken last by the owner, first by thieves).
+// Returns 0, leaving the deque as it was, if it is full and cannot grow.
+static int farm_push(VmFarm *farm, FarmWorker *worker, FarmJob *job, int at_head) {
+    pthread_mutex_lock(&worker->lock);
+    if (worker->size == worker->capacity) {
+        int capacity = worker->capacity ? worker->capacity * 2 : 64;
+        FarmJob **deque = malloc(capacity * sizeof(FarmJob *));
+        if (!deque) {
+            pthread_mutex_unlock(&worker->lock);
+            printf("Farm queue allocation failed!\n");
+            return 0;
+        }
+        for (int i = 0; i < worker->size; i++) {
+            deque[i] = worker->deque[(worker->head + i) % worker->capacity];
+        }
+        free(worker->deque);
+        worker->deque = deque;
+        worker->head = 0;
+        worker->capacity = capacity;
+    }
+    if (at_head) {
+        worker->head = (worker->head + worker->capacity - 1) % worker->capacity;
+        worker->deque[worker->head] = job;
+    } else {
+        worker->deque[(worker->head + worker->size) % worker->capacity] = job;
+    }
+    worker->size++;
+    pthread_mutex_unlock(&worker->lock);
+
+    pthread_mutex_lock(&farm->lock);
+    farm->queued++;
+    pthread_cond_signal(&farm->work_ready);
+    pthread_mutex_unlock(&farm->lock);
+    return 1;
+}
+
+static FarmJob *farm_pop(FarmWorker *worker, int from_head) {
+    FarmJob *job = NULL;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->size > 0) {
+        worker->size--;
+        if (from_head) {
+            job = worker->deque[worker->head];
+            worker->head = (worker->head + 1) % worker->capacity;
+        } else {
+            job = worker->deque[(worker->head + worker->size) % worker->capacity];
+        }
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return job;
+}
+
+// Own deque first, then the oldest job of any other worker.
+static FarmJob *farm_take(VmFarm *farm, FarmWorker *worker) {
+    FarmJob *job = farm_pop(worker, 0);
+    int self = worker - farm->workers;
+    for (int i = 1; !job && i < farm->worker_count; i++) {
+        job = farm_pop(&farm->workers[(self + i) % farm->worker_count], 1);
+        if (job) {
+            atomic_fetch_add_explicit(&worker->steals, 1, memory_order_relaxed);
+        }
+    }
+    if (job) {
+        pthread_mutex_lock(&farm->lock);
+        farm->queued--;
+        pthread_mutex_unlock(&farm->lock);
+    }
+    return job;
+}
+
+static void farm_finish(VmFarm *farm, FarmJob *job, int state) {
+    pthread_mutex_lock(&farm->lock);
+    atomic_store(&job->state, state);
+    pthread_cond_broadcast(&farm->job_done);
+    pthread_mutex_unlock(&farm->lock);
+}
+
+static void *farm_worker(void *arg) {
+    FarmWorker *worker = arg;
+    VmFarm *farm = worker->farm;
+
+    for (;;) {
+        FarmJob *job = farm_take(farm, worker);
+        if (!job) {
+            pthread_mutex_lock(&farm->lock);
+            while (farm->queued <= 0 && !farm->shutdown) {
+                pthread_cond_wait(&farm->work_ready, &farm->lock);
+            }
+            int exit = farm->shutdown && farm->queued <= 0;
+            pthread_mutex_unlock(&farm->lock);
+            if (exit) {
+                break;
+            }
+            continue;
+        }
+        if (atomic_load(&job->cancel_requested)) {
+            farm_finish(farm, job, FARM_JOB_CANCELLED);
+            continue;
+        }
+        long start = farm_nanoseconds();
+        int stopped = execute_program_quantum(job->cocomp, farm->quantum);
+        atomic_fetch_add_explicit(&worker->busy_nanoseconds, farm_nanoseconds() - start, memory_order_relaxed);
+        atomic_fetch_add_explicit(&worker->quanta, 1, memory_order_relaxed);
+        job->quanta++;
+        if (stopped) {
+            atomic_fetch_add_explicit(&worker->jobs_completed, 1, memory_order_relaxed);
+            farm_finish(farm, job, FARM_JOB_DONE);
+        } else if (atomic_load(&job->cancel_requested)) {
+            farm_finish(farm, job, FARM_JOB_CANCELLED);
+        } else if (!farm_push(farm, worker, job, 1)) {
+            farm_finish(farm, job, FARM_JOB_CANCELLED);  // nowhere to put it back
+        }
+    }
+    return NULL;
+}
+
+// Start a farm with `num_workers` threads (one per online CPU if <= 0), each
+// running jobs `quantum` basic blocks at a time (FARM_QUANTUM if <= 0).
+VmFarm *create_farm(int num_workers, int quantum) {
+    if (num_workers <= 0) {
+        num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (num_workers <= 0) {
+            num_workers = 1;
+        }
+    }
+    VmFarm *farm = calloc(1, sizeof(VmFarm));
+    if (!farm || !(farm->workers = calloc(num_workers, sizeof(FarmWorker)))) {
+        printf("Farm allocation failed!\n");
+        free(farm);
+        return NULL;
+    }
+    farm->quantum = quantum > 0 ? quantum : FARM_QUANTUM;
+    pthread_mutex_init(&farm->lock, NULL);
+    pthread_cond_init(&farm->work_ready, NULL);
+    pthread_cond_init(&farm->job_done, NULL);
+    farm->worker_count = num_workers;  // fixed before any worker can look at it
+    for (int i = 0; i < num_workers; i++) {
+        farm->workers[i].farm = farm;
+        pthread_mutex_init(&farm->workers[i].lock, NULL);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&farm->workers[i].thread, NULL, farm_worker, &farm->workers[i]) != 0) {
+            printf("Failed to start farm worker %d\n", i);
+            pthread_mutex_lock(&farm->lock);
+            farm->shutdown = 1;
+            pthread_cond_broadcast(&farm->work_ready);
+            pthread_mutex_unlock(&farm->lock);
+            while (i-- > 0) {
+                pthread_join(farm->workers[i].thread, NULL);
+            }
+            for (i = 0; i < num_workers; i++) {
+                pthread_mutex_destroy(&farm->workers[i].lock);
+            }
+            pthread_mutex_destroy(&farm->lock);
+            pthread_cond_destroy(&farm->work_ready);
+            pthread_cond_destroy(&farm->job_done);
+            free(farm->workers);
+            free(farm);
+            return NULL;
+        }
+    }
+    return farm;
+}
+
+// Queue a prepared VM (program loaded, initial state set) to run until it
+// stops. Every job must be collected with farm_wait. Returns NULL if the job
+// cannot be queued.
+FarmJob *farm_submit(VmFarm *farm, Cocomp *cocomp) {
+    FarmJob *job = calloc(1, sizeof(FarmJob));
+    if (!job) {
+        printf("Farm job allocation failed!\n");
+        return NULL;
+    }
+    job->cocomp = cocomp;
+    atomic_init(&job->state, FARM_JOB_QUEUED);
+    atomic_init(&job->cancel_requested, 0);
+    pthread_mutex_lock(&farm->lock);
+    FarmWorker *worker = &farm->workers[farm->next_worker++ % farm->worker_count];
+    pthread_mutex_unlock(&farm->lock);
+    if (!farm_push(farm, worker, job, 0)) {
+        free(job);
+        return NULL;
+    }
+    return job;
+}
+
+// Ask a job to stop; it does so at its next quantum boundary.
+void farm_cancel(VmFarm *farm, FarmJob *job) {
+    (void)farm;
+    atomic_store(&job->cancel_requested, 1);
+}
+
+// Block until the job has finished or been cancelled, release it, and
+// return FARM_JOB_DONE or FARM_JOB_CANCELLED.
+int farm_wait(VmFarm *farm, FarmJob *job) {
+    pthread_mutex_lock(&farm->lock);
+    while (atomic_load(&job->state) == FARM_JOB_QUEUED) {
+        pthread_cond_wait(&farm->job_done, &farm->lock);
+    }
+    pthread_mutex_unlock(&farm->lock);
+    int state = atomic_load(&job->state);
+    free(job);
+    return state;
+}
+
+void print_farm_stats(VmFarm *farm) {
+    for (int i = 0; i < farm->worker_count; i++) {
+        FarmWorker *worker = &farm->workers[i];
+        long quanta = atomic_load(&worker->quanta);
+        double busy = atomic_load(&worker->busy_nanoseconds) / 1e9;
+        printf("Worker %d: %ld jobs, %ld quanta (%.0f quanta/s busy), %ld steals, %.3f s busy\n",
+               i, atomic_load(&worker->jobs_completed), quanta, busy > 0 ? quanta / busy : 0.0,
+               atomic_load(&worker->steals), busy);
+    }
+}
+
+// Stop the workers once their deques are empty and free the farm. Wait for
+// (or cancel and wait for) every submitted job first.
+void destroy_farm(VmFarm *farm) {
+    pthread_mutex_lock(&farm->lock);
+    farm->shutdown = 1;
+    pthread_cond_broadcast(&farm->work_ready);
+    pthread_mutex_unlock(&farm->lock);
+    for (int i = 0; i < farm->worker_count; i++) {
+        pthread_join(farm->workers[i].thread, NULL);
+        pthread_mutex_destroy(&farm->workers[i].lock);
+        free(farm->workers[i].deque);
+    }
+    pthread_mutex_destroy(&farm->lock);
+    pthread_cond_destroy(&farm->work_ready);
+    pthread_cond_destroy(&farm->job_done);
+    free(farm->workers);
+    free(farm);
+}
+
+#ifdef COCOMP_BENCH
+#define BENCH_REPEATS 5  // runs of each workload; the fastest one is reported
+
+static FILE *bench_output;  // JSON results, on the original stdout
+static FILE *bench_null;
+static int bench_records;
+
+// Results go to stdout as one JSON document. Everything printed for people,
+// by the benchmarks or by the VM, goes to stderr instead.
+void bench_begin(void) {
+    fflush(stdout);
+    bench_output = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    bench_null = fopen("/dev/null", "w");
+    fprintf(bench_output, "{\n  \"config\": {\"threaded_dispatch\": %d, \"jit\": %d, \"avx2\": %d, "
+            "\"layers\": [%d, %d, %d], \"repeats\": %d},\n  \"benchmarks\": [",
+            COCOMP_THREADED_DISPATCH, COCOMP_JIT, COCOMP_AVX2,
+            INPUT_LAYER_SIZE, HIDDEN_LAYER_SIZE, OUTPUT_LAYER_SIZE, BENCH_REPEATS);
+}
+
+static long bench_peak_rss(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;  // kilobytes on Linux
+}
+
+// One JSON record, with `extra` fields appended if not empty. Peak RSS is
+// the process-wide high-water mark so far.
+static void bench_record(const char *name, long ops, double seconds, const char *extra) {
+    fprintf(bench_output, "%s\n    {\"name\": \"%s\", \"ops\": %ld, \"seconds\": %.6f, "
+            "\"ns_per_op\": %.3f, \"ops_per_sec\": %.1f, \"peak_rss_kb\": %ld%s}",
+            bench_records++ ? "," : "", name, ops, seconds,
+            seconds / ops * 1e9, ops / seconds, bench_peak_rss(), extra);
+    fflush(bench_output);
+}
+
+void bench_report(const char *name, long ops, double seconds) {
+    bench_record(name, ops, seconds, "");
+}
+
+void bench_end(void) {
+    fprintf(bench_output, "\n  ],\n  \"peak_rss_kb\": %ld\n}\n", bench_peak_rss());
+    fclose(bench_output);
+    fclose(bench_null);
+}
+
+// Silence the VM while a workload that prints on its normal paths (page
+// faults, failed allocations, training) is timed.
+static void bench_quiet(int quiet) {
+    fflush(stdout);
+    dup2(quiet ? fileno(bench_null) : STDERR_FILENO, STDOUT_FILENO);
+}
+
+// Fixed-seed generator, so every run sees the same workload.
+static int bench_random(unsigned int *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) & 0x7FFF;
+}
+
+static double bench_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Time one engine over `passes` runs of the program already in memory.
+static double bench_engine(Cocomp *cocomp, void (*engine)(Cocomp *), int passes, double *result) {
+    double start = bench_seconds();
+    for (int pass = 0; pass < passes; pass++) {
+        cocomp->instruction_pointer = 0;
+        cocomp->accumulator = 0;
+        engine(cocomp);
+    }
+    *result = cocomp->accumulator;
+    return bench_seconds() - start;
+}
+
+// Straight-line arithmetic/bitwise code filling up to `capacity` bytes.
+static int bench_arithmetic_program(unsigned char *program, int capacity, long *instructions) {
+    double one = 1.0, half = 0.5;
+    int mask = 0x7FFF, shift = 1;
+    int size = 0;
+
+    *instructions = 0;
+    while (size + 4 * 9 + 2 * 5 + 1 < capacity) {
+        program[size] = 0x01; memcpy(&program[size + 1], &one, sizeof(double)); size += 9;
+        program[size] = 0x0A; memcpy(&program[size + 1], &half, sizeof(double)); size += 9;
+        program[size] = 0x0F; memcpy(&program[size + 1], &mask, sizeof(int)); size += 5;
+        program[size] = 0x02; memcpy(&program[size + 1], &one, sizeof(double)); size += 9;
+        program[size] = 0x12; memcpy(&program[size + 1], &shift, sizeof(int)); size += 5;
+        program[size] = 0x0B; memcpy(&program[size + 1], &one, sizeof(double)); size += 9;
+        *instructions += 6;
+    }
+    program[size++] = 0xFF;
+    (*instructions)++;
+    return size;
+}
+
+// ADD; JUMP blocks laid out in order but visited in a shuffled one, so
+// every instruction pair ends in a taken jump to somewhere else.
+static int bench_branch_program(unsigned char *program, int capacity, long *instructions) {
+    enum { block = 9 + 5 };
+    int blocks = (capacity - 1) / block;
+    int *order = malloc(blocks * sizeof(int));
+    unsigned int seed = 1;
+    double one = 1.0;
+
+    for (int i = 0; i < blocks; i++) {
+        order[i] = i;
+    }
+    for (int i = blocks - 1; i > 1; i--) {  // block 0 stays first: execution starts there
+        int j = 1 + bench_random(&seed) % i;
+        int swap = order[i]; order[i] = order[j]; order[j] = swap;
+    }
+    for (int i = 0; i < blocks; i++) {
+        int address = order[i] * block;
+        int next = i + 1 < blocks ? order[i + 1] * block : blocks * block;
+        program[address] = 0x02; memcpy(&program[address + 1], &one, sizeof(double));
+        program[address + 9] = 0x06; memcpy(&program[address + 10], &next, sizeof(int));
+    }
+    program[blocks * block] = 0xFF;
+    free(order);
+    *instructions = 2L * blocks + 1;
+    return blocks * block + 1;
+}
+
+// A run of calls to one small function. CALL pushes the address of its
+// operand byte and RETURN resumes there, so the operand (the function's
+// address, 9) is then executed as a NOP, which skips the padding byte after
+// it. Each call is CALL, ADD, RETURN, NOP.
+static int bench_call_program(unsigned char *program, int capacity, long *instructions) {
+    int function = 9, main_code = function + 9 + 1;
+    double one = 1.0;
+    int size = 0;
+
+    memset(program, 0, main_code);
+    program[0] = 0x06; memcpy(&program[1], &main_code, sizeof(int));
+    program[function] = 0x02; memcpy(&program[function + 1], &one, sizeof(double));
+    program[function + 9] = 0x08;
+    size = main_code;
+    *instructions = 2;  // JUMP ... END
+    while (size + 3 + 1 <= capacity) {
+        program[size++] = 0x07;
+        program[size++] = function;
+        program[size++] = 0x00;
+        *instructions += 4;
+    }
+    program[size++] = 0xFF;
+    return size;
+}
+
+// A counted loop, the counter on the stack: PUSH the count, then ADD; DBNZ
+// back to the ADD until DBNZ takes the counter to 0.
+static int bench_counted_loop_program(unsigned char *program, int capacity, long *instructions) {
+    enum { iterations = 1000 };
+    double count = iterations, zero = 0, one = 1.0;
+    int loop = 9 + 1 + 9;
+
+    if (capacity < loop + 16) {  // no room for the loop: just END
+        program[0] = 0xFF;
+        *instructions = 1;
+        return 1;
+    }
+
+    program[0] = 0x01; memcpy(&program[1], &count, sizeof(double));
+    program[9] = 0x04;
+    program[10] = 0x01; memcpy(&program[11], &zero, sizeof(double));
+    program[loop] = 0x02; memcpy(&program[loop + 1], &one, sizeof(double));
+    program[loop + 9] = 0x18; memcpy(&program[loop + 10], &loop, sizeof(int));
+    program[loop + 14] = 0x05;
+    program[loop + 15] = 0xFF;
+    *instructions = 3 + 2L * iterations + 2;
+    return loop + 16;
+}
+
+// The same loop counted in the accumulator: ADD; COMPARE; BLT back to the
+// ADD while the accumulator is below the count.
+static int bench_compare_loop_program(unsigned char *program, int capacity, long *instructions) {
+    enum { iterations = 1000 };
+    double count = iterations, zero = 0, one = 1.0;
+    int loop = 9;
+
+    if (capacity < loop + 24) {  // no room for the loop: just END
+        program[0] = 0xFF;
+        *instructions = 1;
+        return 1;
+    }
+
+    program[0] = 0x01; memcpy(&program[1], &zero, sizeof(double));
+    program[loop] = 0x02; memcpy(&program[loop + 1], &one, sizeof(double));
+    program[loop + 9] = 0x0B; memcpy(&program[loop + 10], &count, sizeof(double));
+    program[loop + 18] = 0x15; memcpy(&program[loop + 19], &loop, sizeof(int));
+    program[loop + 23] = 0xFF;
+    *instructions = 1 + 3L * iterations + 1;
+    return loop + 24;
+}
+
+// execute_program, as guests call it, on arithmetic, branch-heavy,
+// call-heavy and looping code, each run for about the same number of
+// instructions.
+void benchmark_programs(Cocomp *cocomp) {
+    const long target = 10000000;
+    static const char *names[] = {"arithmetic", "branch", "call", "counted_loop", "compare_loop"};
+    int (*generators[])(unsigned char *, int, long *) = {
+        bench_arithmetic_program, bench_branch_program, bench_call_program,
+        bench_counted_loop_program, bench_compare_loop_program
+    };
+    unsigned char program[MEMORY_SIZE - STACK_SIZE];
+    char name[64];
+
+    for (int kind = 0; kind < 5; kind++) {
+        long instructions;
+        int size = generators[kind](program, sizeof(program), &instructions);
+        int passes = target / instructions + 1;
+        load_program(cocomp, program, size);
+        double best = 0, result;
+        for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+            double elapsed = bench_engine(cocomp, execute_program, passes, &result);
+            if (repeat == 0 || elapsed < best) best = elapsed;
+        }
+        printf("execute_program %s: %.1f M instructions/s\n", names[kind], instructions * passes / best / 1e6);
+        snprintf(name, sizeof(name), "execute_program/%s", names[kind]);
+        bench_report(name, instructions * passes, best);
+    }
+
+#ifndef COCOMP_FIXED_CONFIG
+    // The arithmetic program again on a VM a quarter the size: sizes read
+    // from the VM should cost the interpreter nothing.
+    CocompConfig config = COCOMP_DEFAULT_CONFIG;
+    config.memory_size = 1024;
+    config.stack_size = 256;
+    config.heap_size = 256;
+    config.max_threads = 1;
+    Cocomp *small = create_cocomp(&config);
+    if (!small) {
+        return;
+    }
+    long instructions;
+    int size = bench_arithmetic_program(program, config.memory_size - config.stack_size, &instructions);
+    int passes = target / instructions + 1;
+    load_program(small, program, size);
+    double best = 0, result;
+    for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+        double elapsed = bench_engine(small, execute_program, passes, &result);
+        if (repeat == 0 || elapsed < best) best = elapsed;
+    }
+    printf("execute_program arithmetic, %d byte VM: %.1f M instructions/s\n",
+           config.memory_size, instructions * passes / best / 1e6);
+    bench_report("execute_program/arithmetic_1k_vm", instructions * passes, best);
+    destroy_cocomp(small);
+#endif
+}
+
+// Straight-line arithmetic/bitwise program filling the code area below the
+// stack, run repeatedly through each engine.
+void benchmark_dispatch(Cocomp *cocomp) {
+    unsigned char program[MEMORY_SIZE - STACK_SIZE];
+    long instructions;
+    int size = bench_arithmetic_program(program, sizeof(program), &instructions);
+    load_program(cocomp, program, size);
+
+    int passes = 200000;
+    double switch_result, decoded_result;
+    double switch_time = bench_engine(cocomp, execute_program_switch, passes, &switch_result);
+    printf("switch:   %.1f M instructions/s\n", instructions * passes / switch_time / 1e6);
+    bench_report("dispatch/switch", instructions * passes, switch_time);
+    set_jit_enabled(cocomp, 0);
+    cocomp->fusion_enabled = 0;
+    load_program(cocomp, program, size);
+    double unfused_time = bench_engine(cocomp, execute_program_decoded, passes, &decoded_result);
+    printf("unfused:  %.1f M instructions/s (%.2fx)\n",
+           instructions * passes / unfused_time / 1e6, switch_time / unfused_time);
+    bench_report("dispatch/unfused", instructions * passes, unfused_time);
+    cocomp->fusion_enabled = 1;
+    load_program(cocomp, program, size);
+    double decoded_time = bench_engine(cocomp, execute_program_decoded, passes, &decoded_result);
+    printf("decoded (%s): %.1f M instructions/s (%.2fx)\n",
+           COCOMP_THREADED_DISPATCH ? "threaded" : "switch",
+           instructions * passes / decoded_time / 1e6, switch_time / decoded_time);
+    bench_report("dispatch/decoded", instructions * passes, decoded_time);
+    if (decoded_result != switch_result) {
+        printf("Engine mismatch: switch %lf, decoded %lf\n", switch_result, decoded_result);
+    }
+#if COCOMP_JIT
+    set_jit_enabled(cocomp, 1);
+    double jit_result;
+    double jit_time = bench_engine(cocomp, execute_program_decoded, passes, &jit_result);
+    printf("jit:      %.1f M instructions/s (%.2fx), %d blocks\n",
+           instructions * passes / jit_time / 1e6, switch_time / jit_time, cocomp->jit_block_count);
+    bench_report("dispatch/jit", instructions * passes, jit_time);
+    if (jit_result != switch_result) {
+        printf("Engine mismatch: switch %lf, jit %lf\n", switch_result, jit_result);
+    }
+#endif
+}
+
+// Many guests running the same straight-line code on different inputs (each
+// guest starts with its input in the top stack slot, where POP reads it): one
+// at a time through execute_program, then all together through the batch
+// engine. The VM has the default sizes, so its stack ends at MEMORY_SIZE.
+void benchmark_batch(Cocomp *cocomp) {
+    enum { lanes = 1024, passes = 20 };
+    int code_end = MEMORY_SIZE - STACK_SIZE;
+    int input = MEMORY_SIZE - sizeof(double);
+    int size = MEMORY_SIZE;
+    unsigned char *images = calloc(lanes, size);
+    unsigned char *programs[lanes];
+    int sizes[lanes];
+    BatchResult *results = malloc(lanes * sizeof(BatchResult));
+    double *expected = malloc(lanes * sizeof(double));
+    double step = 1.5, quarter = 0.25;
+    int mask = 0x7FFF, shift = 1, pattern = 0x55;
+    long instructions = 2;  // POP ... END
+    int code = 0;
+
+    images[code++] = 0x05;
+    while (code + 3 * 9 + 3 * 5 + 1 < code_end) {
+        images[code] = 0x02; memcpy(&images[code + 1], &step, sizeof(double)); code += 9;
+        images[code] = 0x0F; memcpy(&images[code + 1], &mask, sizeof(int)); code += 5;
+        images[code] = 0x12; memcpy(&images[code + 1], &shift, sizeof(int)); code += 5;
+        images[code] = 0x0A; memcpy(&images[code + 1], &quarter, sizeof(double)); code += 9;
+        images[code] = 0x11; memcpy(&images[code + 1], &pattern, sizeof(int)); code += 5;
+        images[code] = 0x0B; memcpy(&images[code + 1], &step, sizeof(double)); code += 9;
+        instructions += 6;
+    }
+    images[code] = 0xFF;
+    for (int lane = 0; lane < lanes; lane++) {
+        programs[lane] = &images[(size_t)lane * size];
+        sizes[lane] = size;
+        memcpy(programs[lane], images, code + 1);
+        double value = lane;
+        memcpy(&programs[lane][input], &value, sizeof(double));
+    }
+
+    double start = bench_seconds();
+    for (int pass = 0; pass < passes; pass++) {
+        for (int lane = 0; lane < lanes; lane++) {
+            load_program(cocomp, programs[lane], sizes[lane]);
+            cocomp->instruction_pointer = 0;
+            cocomp->accumulator = 0;
+            cocomp->stack_pointer = cocomp->stack_limit - sizeof(double);
+            execute_program(cocomp);
+            expected[lane] = cocomp->accumulator;
+        }
+    }
+    double scalar_time = bench_seconds() - start;
+
+    start = bench_seconds();
+    for (int pass = 0; pass < passes; pass++) {
+        CocompBatch *batch = create_batch(programs, sizes, lanes);
+        for (int lane = 0; lane < lanes; lane++) {
+            batch->stack_pointers[lane] = input;
+        }
+        execute_batch(batch);
+        get_batch_results(batch, results);
+        free_batch(batch);
+    }
+    double batch_time = bench_seconds() - start;
+
+    long total = instructions * lanes * passes;
+    printf("scalar x%d: %.1f M instructions/s\n", lanes, total / scalar_time / 1e6);
+    printf("batch (%s) x%d: %.1f M instructions/s (%.2fx)\n", COCOMP_AVX2 ? "avx2" : "scalar",
+           lanes, total / batch_time / 1e6, scalar_time / batch_time);
+    bench_report("batch/scalar", total, scalar_time);
+    bench_report("batch/lockstep", total, batch_time);
+    for (int lane = 0; lane < lanes; lane++) {
+        if (results[lane].accumulator != expected[lane]) {
+            printf("Engine mismatch: lane %d scalar %lf, batch %lf\n", lane, expected[lane], results[lane].accumulator);
+            break;
+        }
+    }
+    free(images);
+    free(results);
+    free(expected);
+}
+
+// Independent looping guests spread over 1, 2, 4, ... workers (up to the
+// number of online CPUs). Each round runs for a fixed time, then cancels the
+// jobs; throughput comes from the quanta the workers completed.
+void benchmark_farm(Cocomp *cocomp) {
+    unsigned char program[64];
+    double step = 1.5, quarter = 0.25;
+    int mask = 0x7FFF, shift = 1, pattern = 0x55, start = 0;
+    int size = 0;
+    int per_block = 7;  // instructions per trip round the loop
+
+    program[size] = 0x02; memcpy(&program[size + 1], &step, sizeof(double)); size += 9;
+    program[size] = 0x0F; memcpy(&program[size + 1], &mask, sizeof(int)); size += 5;
+    program[size] = 0x12; memcpy(&program[size + 1], &shift, sizeof(int)); size += 5;
+    program[size] = 0x0A; memcpy(&program[size + 1], &quarter, sizeof(double)); size += 9;
+    program[size] = 0x11; memcpy(&program[size + 1], &pattern, sizeof(int)); size += 5;
+    program[size] = 0x0B; memcpy(&program[size + 1], &step, sizeof(double)); size += 9;
+    program[size] = 0x06; memcpy(&program[size + 1], &start, sizeof(int)); size += 5;
+    load_program(cocomp, program, size);
+
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    int jobs = 4 * cpus;
+    Cocomp **guests = malloc(jobs * sizeof(Cocomp *));
+    FarmJob **handles = malloc(jobs * sizeof(FarmJob *));
+    for (int i = 0; i < jobs; i++) {
+        guests[i] = clone_cocomp(cocomp);
+    }
+
+    double single = 0;
+    char name[64];
+    for (int workers = 1; ; workers *= 2) {
+        if (workers > cpus) workers = cpus;
+        VmFarm *farm = create_farm(workers, 0);
+        struct timespec run_for = {0, 250000000};
+        double begin = bench_seconds();
+        for (int i = 0; i < jobs; i++) {
+            guests[i]->instruction_pointer = 0;
+            guests[i]->accumulator = 0;
+            handles[i] = farm_submit(farm, guests[i]);
+        }
+        nanosleep(&run_for, NULL);
+        for (int i = 0; i < jobs; i++) {
+            farm_cancel(farm, handles[i]);
+        }
+        for (int i = 0; i < jobs; i++) {
+            farm_wait(farm, handles[i]);
+        }
+        double elapsed = bench_seconds() - begin;
+        long quanta = 0;
+        for (int i = 0; i < farm->worker_count; i++) {
+            quanta += atomic_load(&farm->workers[i].quanta);
+        }
+        double rate = (double)quanta * farm->quantum * per_block / elapsed / 1e6;
+        if (workers == 1) single = rate;
+        printf("farm x%d: %.1f M instructions/s (%.2fx)\n", workers, rate, rate / single);
+        snprintf(name, sizeof(name), "farm/x%d", workers);
+        bench_report(name, quanta * farm->quantum * per_block, elapsed);
+        if (workers == cpus) print_farm_stats(farm);
+        destroy_farm(farm);
+        if (workers == cpus) break;
+    }
+    for (int i = 0; i < jobs; i++) {
+        destroy_cocomp(guests[i]);
+    }
+    free(guests);
+    free(handles);
+}
+
+// Context-switch latency between two guest threads, switching on every YIELD
+// and then by preemption at every block (time slice 1). The same loop run
+// by a single thread, where nothing switches, gives the cost of a loop trip
+// without the switch.
+void benchmark_threads(Cocomp *cocomp) {
+    const int blocks = 2000000;
+    unsigned char program[64];
+
+    for (int preempt = 0; preempt < 2; preempt++) {
+        // main: LOAD_FLOAT thread; SYSCALL SPAWN; loop: [SYSCALL YIELD;] JUMP loop
+        // thread: [SYSCALL YIELD;] JUMP thread
+        int yield_length = preempt ? 0 : 2;
+        int size = 0;
+        int main_loop = 9 + 2;
+        int thread_loop = main_loop + yield_length + 5;
+        double entry = thread_loop;
+        program[size] = 0x01; memcpy(&program[size + 1], &entry, sizeof(double)); size += 9;
+        program[size++] = 0x0C; program[size++] = 0x02;
+        for (int loop = main_loop; loop <= thread_loop; loop = thread_loop + (loop == thread_loop)) {
+            if (!preempt) {
+                program[size++] = 0x0C; program[size++] = 0x03;
+            }
+            program[size] = 0x06; memcpy(&program[size + 1], &loop, sizeof(int)); size += 5;
+        }
+
+        double elapsed[2];
+        for (int threads = 1; threads <= 2; threads++) {
+            load_program(cocomp, program, size);
+            reset_threads(cocomp);
+            cocomp->time_slice = preempt ? 1 : 0;
+            cocomp->instruction_pointer = threads == 2 ? 0 : thread_loop;
+            cocomp->accumulator = 0;
+            cocomp->stack_pointer = cocomp->stack_limit;
+            double start = bench_seconds();
+            execute_program_quantum(cocomp, blocks);
+            elapsed[threads - 1] = bench_seconds() - start;
+        }
+        long switches = cocomp->context_switches;
+        long trips = preempt ? blocks : blocks / 2;  // a YIELD trip also re-enters through the scheduler
+        printf("%s: %ld switches, %.1f ns per switch (%.1f ns per loop trip with one thread)\n",
+               preempt ? "preempt" : "yield", switches, elapsed[1] / switches * 1e9, elapsed[0] / trips * 1e9);
+        bench_report(preempt ? "threads/preempt_switch" : "threads/yield_switch", switches, elapsed[1]);
+    }
+    cocomp->time_slice = THREAD_TIME_SLICE;
+    reset_threads(cocomp);
+}
+
+// allocate_heap/free_heap under two workloads, plus a fixed-size pool.
+// "random" allocates 1-16 bytes or frees a random live block with equal
+// odds. "fragmenting" fills half the arena with small blocks, frees every
+// other one, asks for blocks too big for the holes, then frees the rest.
+// "pool" does the random workload's allocate/free mix on pool objects.
+void benchmark_heap(Cocomp *cocomp) {
+    enum { operations = 1000000, live_max = 16, small = 8, large = 16 };
+    int small_count = cocomp->heap_arena_size / 2 / small;
+    int large_count = cocomp->heap_arena_size / 4 / large;
+    static const char *names[] = {"random", "fragmenting", "pool"};
+    int live[small_count + large_count + live_max];
+    char name[64];
+
+    bench_quiet(1);
+    for (int workload = 0; workload < 3; workload++) {
+        double best = 0;
+        long ops = 0;
+        for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+            unsigned int seed = 1;
+            int count = 0;
+            reset_heap(cocomp);
+            int pool = workload == 2 ? create_pool(cocomp, 16, live_max) : -1;
+            ops = 0;
+            double start = bench_seconds();
+            while (ops < operations) {
+                if (workload != 1) {
+                    if (count == 0 || (count < live_max && bench_random(&seed) % 2)) {
+                        int size = 1 + bench_random(&seed) % 16;
+                        int address = pool < 0 ? allocate_heap(cocomp, size) : pool_allocate(cocomp, pool);
+                        if (address >= 0) live[count++] = address;
+                    } else {
+                        int victim = bench_random(&seed) % count;
+                        if (pool < 0) {
+                            free_heap(cocomp, live[victim]);
+                        } else {
+                            pool_free(cocomp, pool, live[victim]);
+                        }
+                        live[victim] = live[--count];
+                    }
+                    ops++;
+                    continue;
+                }
+                for (int i = 0; i < small_count; i++) {
+                    live[i] = allocate_heap(cocomp, small);
+                }
+                for (int i = 1; i < small_count; i += 2) {
+                    free_heap(cocomp, live[i]);
+                }
+                for (int i = 0; i < large_count; i++) {
+                    live[small_count + i] = allocate_heap(cocomp, large);
+                }
+                for (int i = large_count - 1; i >= 0; i--) {
+                    free_heap(cocomp, live[small_count + i]);
+                }
+                for (int i = small_count - 2; i >= 0; i -= 2) {
+                    free_heap(cocomp, live[i]);
+                }
+                ops += 2 * small_count + 2 * large_count;
+            }
+            double elapsed = bench_seconds() - start;
+            if (repeat == 0 || elapsed < best) best = elapsed;
+        }
+        snprintf(name, sizeof(name), "heap/%s", names[workload]);
+        bench_report(name, ops, best);
+        bench_quiet(0);
+        printf("%s: %.1f ns per allocate/free\n", name, best / ops * 1e9);
+        bench_quiet(1);
+    }
+    bench_quiet(0);
+    reset_heap(cocomp);
+}
+
+// Reads of every double in the virtual address space through the MMU,
+// touched in order, one page after another (a page stride) and at random,
+// under each replacement policy. The address space is sixteen times the
+// physical frames, so every sweep keeps faulting; the MMU is reset before
+// each repeat so the policies start from the same state.
+void benchmark_page_faults(Cocomp *cocomp) {
+    enum { sweeps = 40 };
+    int pages = cocomp->virtual_pages;
+    int accesses = pages * VM_PAGE_SIZE(cocomp) / (int)sizeof(double);
+    static const char *names[] = {"sequential", "strided", "random"};
+    static const char *policies[] = {"clock", "lru", "random"};
+    int *addresses = malloc(accesses * sizeof(int));
+    char name[64];
+    CocompPaging *paging = get_paging(cocomp);  // so the first frames are translated too
+    if (!paging) {
+        free(addresses);
+        return;
+    }
+
+    for (int pattern = 0; pattern < 3; pattern++) {
+        unsigned int seed = 1;
+        for (int i = 0; i < accesses; i++) {
+            if (pattern == 0) addresses[i] = i * (int)sizeof(double);
+            else if (pattern == 1) addresses[i] = i % pages * VM_PAGE_SIZE(cocomp) + i / pages * (int)sizeof(double);
+            else addresses[i] = bench_random(&seed) % accesses * (int)sizeof(double);
+        }
+        for (int policy = PAGE_POLICY_CLOCK; policy <= PAGE_POLICY_RANDOM; policy++) {
+            double best = 0;
+            double value;
+            for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+                reset_mmu(cocomp);
+                paging->page_policy = policy;
+                double start = bench_seconds();
+                for (int sweep = 0; sweep < sweeps; sweep++) {
+                    for (int i = 0; i < accesses; i++) {
+                        mmu_read(cocomp, addresses[i], &value, sizeof(double));
+                    }
+                }
+                double elapsed = bench_seconds() - start;
+                if (repeat == 0 || elapsed < best) best = elapsed;
+            }
+            long ops = (long)sweeps * accesses;
+            printf("page faults %s/%s: %.1f ns per access, %.1f%% TLB hits, %.2f%% faulting\n",
+                   names[pattern], policies[policy], best / ops * 1e9,
+                   100.0 * paging->tlb_hits / ops, 100.0 * paging->page_faults / ops);
+            snprintf(name, sizeof(name), "page_fault/%s/%s", names[pattern], policies[policy]);
+            bench_report(name, ops, best);
+        }
+    }
+    reset_mmu(cocomp);
+    free(addresses);
+}
+
+// A guest address space of a gigabyte in a swap file, with 4 of the VM's
+// frames resident. One double is written into every page and read back in
+// order, then pages are read at random. Each pass is run once rather than
+// BENCH_REPEATS times, as a pass moves gigabytes through the swap file.
+void benchmark_swap(Cocomp *cocomp) {
+    static const char *names[] = {"write_sequential", "read_sequential", "read_random"};
+    const long size = 1L << 30;
+    char name[64];
+
+    if (!open_swap(cocomp, NULL, size)) {
+        return;
+    }
+    set_resident_frames(cocomp, 4);
+    CocompPaging *paging = cocomp->paging;
+    long pages = cocomp->virtual_pages;
+    long errors = 0;
+    for (int pass = 0; pass < 3; pass++) {
+        long ops = pass < 2 ? pages - cocomp->num_frames : pages / 4;
+        long faults = paging->page_faults;
+        long prefetches = paging->page_prefetches;
+        unsigned int seed = 1;
+        double start = bench_seconds();
+        for (long i = 0; i < ops; i++) {
+            long page = cocomp->num_frames + i;
+            if (pass == 2) {
+                page = cocomp->num_frames + ((long)bench_random(&seed) << 15 | bench_random(&seed)) % (pages - cocomp->num_frames);
+            }
+            double value = page;
+            if (pass == 0) {
+                mmu_write(cocomp, page * VM_PAGE_SIZE(cocomp), &value, sizeof(double));
+            } else {
+                mmu_read(cocomp, page * VM_PAGE_SIZE(cocomp), &value, sizeof(double));
+                errors += value != page;
+            }
+        }
+        double elapsed = bench_seconds() - start;
+        printf("swap %s: %.1f ns per page, %ld faults, %ld prefetched\n", names[pass], elapsed / ops * 1e9,
+               paging->page_faults - faults, paging->page_prefetches - prefetches);
+        snprintf(name, sizeof(name), "swap/%s", names[pass]);
+        bench_report(name, ops, elapsed);
+    }
+    if (errors) {
+        printf("swap: %ld pages read back wrong\n", errors);
+    }
+    set_resident_frames(cocomp, cocomp->num_frames);
+    close_swap(cocomp);
+}
+
+// Time `reads` READs of `length` bytes from the file system into `cocomp`:
+// in order from the start of the file, or from random offsets. Each goes
+// to the next of `pages` guest pages from `address`.
+static double bench_fs_reads(Cocomp *cocomp, int fd, long file_size, long reads, int length, int random,
+                             int address, int pages, int touch) {
+    double best = 0;
+    for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+        unsigned int seed = 1;
+        double start = bench_seconds();
+        fs_seek(cocomp, fd, 0, SEEK_SET);
+        for (long i = 0; i < reads; i++) {
+            int target = address + (i % pages) * VM_PAGE_SIZE(cocomp);
+            if (random) {
+                fs_seek(cocomp, fd, ((long)bench_random(&seed) << 15 | bench_random(&seed)) % (file_size - length), SEEK_SET);
+            }
+            fs_read(cocomp, fd, target, length);
+            if (touch) {
+                double value;
+                mmu_read(cocomp, target, &value, sizeof(double));
+            }
+        }
+        double elapsed = bench_seconds() - start;
+        if (repeat == 0 || elapsed < best) best = elapsed;
+    }
+    return best;
+}
+
+// READ throughput from a 32 MB file in a file system image: 4 KB reads in
+// order and at random offsets into the default VM, which copies them. Then,
+// on a VM with 64 KB pages, whole-page reads into resident pages (copied)
+// and into pages in swap (mapped from the image), the latter also with the
+// guest touching each page, which copies it in.
+void benchmark_file_system(Cocomp *cocomp) {
+    const long file_size = 32L << 20;
+    const int length = 4096;
+    char name[64];
+
+    CocompFs *fs = create_fs(NULL, file_size + (1 << 20));
+    unsigned char *data = malloc(file_size);
+    if (!fs || !data) {
+        release_fs(fs);
+        free(data);
+        return;
+    }
+    for (long i = 0; i < file_size; i++) {
+        data[i] = i * 7 + (i >> 12);
+    }
+    fs_add_file(fs, "data", data, file_size);
+    free(data);
+
+    initialize(cocomp);
+    mount_fs(cocomp, fs);
+    int fd = fs_open(cocomp, "data", FS_READ);
+    for (int random = 0; random < 2; random++) {
+        long reads = file_size / length;
+        double best = bench_fs_reads(cocomp, fd, file_size, reads, length, random, 0, 1, 0);
+        snprintf(name, sizeof(name), "file_system/%s_4k", random ? "random" : "sequential");
+        printf("%s: %.0f MB/s, %.1f us per read\n", name, reads * length / best / 1e6, best / reads * 1e6);
+        bench_report(name, reads, best);
+    }
+    initialize(cocomp);
+
+#ifndef COCOMP_FIXED_CONFIG
+    static const char *names[] = {"copied", "mapped", "mapped_touched"};
+    CocompConfig config = COCOMP_DEFAULT_CONFIG;
+    config.page_size = 64 * 1024;
+    config.memory_size = 16 * config.page_size;
+    config.stack_size = 4096;
+    Cocomp *large = create_cocomp(&config);
+    if (large && mount_fs(large, fs)) {
+        int page = VM_PAGE_SIZE(large);
+        int large_fd = fs_open(large, "data", FS_READ);
+        long reads = file_size / page;
+        for (int kind = 0; kind < 3; kind++) {
+            // Resident pages 1..14, or pages past the frames, which only live in swap
+            int address = kind == 0 ? page : large->num_frames * page;
+            int pages = kind == 0 ? large->num_frames - 2 : large->virtual_pages - large->num_frames;
+            long mapped = large->files ? large->files->zero_copy_pages : 0;
+            double best = bench_fs_reads(large, large_fd, file_size, reads, page, 0, address, pages, kind == 2);
+            snprintf(name, sizeof(name), "file_system/sequential_64k_pages/%s", names[kind]);
+            printf("%s: %.0f MB/s, %.1f us per read, %ld pages mapped\n", name, reads * page / best / 1e6,
+                   best / reads * 1e6, large->files->zero_copy_pages - mapped);
+            bench_report(name, reads, best);
+        }
+    }
+    destroy_cocomp(large);
+#endif
+    release_fs(fs);
+}
+
+// forward_pass and train_neural_network (one sample, one forward and one
+// backward pass per op) at the layer sizes of the VM.
+void benchmark_neural_network(Cocomp *cocomp) {
+    int input_size = cocomp->input_layer_size;
+    int hidden_size = cocomp->hidden_layer_size;
+    int output_size = cocomp->output_layer_size;
+    int weights = input_size * hidden_size + hidden_size * output_size;
+    int passes = 20000000 / weights + 1000;
+    double inputs[input_size], targets[output_size];
+    char name[64];
+
+    for (int i = 0; i < input_size; i++) {
+        inputs[i] = (i % 10) / 10.0;
+    }
+    for (int i = 0; i < output_size; i++) {
+        targets[i] = 0.5;
+    }
+    bench_quiet(1);
+    srand(1);
+    initialize_neural_network(cocomp);
+    memcpy(cocomp->network->input_layer, inputs, cocomp->input_layer_size * sizeof(double));
+    for (int training = 0; training < 2; training++) {
+        double best = 0;
+        for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+            double start = bench_seconds();
+            if (training) {
+                train_neural_network(cocomp, inputs, targets, 1, passes);
+            } else {
+                for (int pass = 0; pass < passes; pass++) {
+                    forward_pass(cocomp);
+                }
+            }
+            double elapsed = bench_seconds() - start;
+            if (repeat == 0 || elapsed < best) best = elapsed;
+        }
+        snprintf(name, sizeof(name), "%s/%dx%dx%d", training ? "train_neural_network" : "forward_pass",
+                 input_size, hidden_size, output_size);
+        bench_report(name, passes, best);
+        bench_quiet(0);
+        printf("%s: %.1f us per pass\n", name, best / passes * 1e6);
+        bench_quiet(1);
+    }
+    bench_quiet(0);
+}
+
+// A hardware cache event counted for this thread only, in user mode. -1 if
+// the kernel or the CPU does not provide it (no PMU, or perf_event_paranoid
+// set too high).
+static int bench_counter_open(int type, long config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long bench_counter_read(int fd) {
+    long long count;
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return -1;
+    }
+    return count;
+}
+
+// Cache misses of a host thread round-robining many small VMs a few blocks
+// at a time, as a scheduler would. Each switch brings the next VM's
+// registers and decoded code in from memory, so what matters is how many
+// cache lines a VM touches per quantum. The "lean" VMs never use their heap,
+// network or paging, so those are never created; the "full" ones have all
+// of them, and translate every STORE through the MMU.
+void benchmark_vm_state(Cocomp *cocomp) {
+    (void)cocomp;  // the VMs are created here, with their own sizes
+    CocompConfig config = COCOMP_DEFAULT_CONFIG;
+#ifndef COCOMP_FIXED_CONFIG
+    config.memory_size = 1024;
+    config.stack_size = 256;
+    config.heap_size = 256;
+    config.max_threads = 1;
+#endif
+    const int guests = 1024;
+    const int rounds = 200;
+    const int quantum = 4;
+    const int per_block = 6;  // instructions per trip round the loop
+    unsigned char program[64];
+    double step = 1.5, quarter = 0.25;
+    int slot = 512, start = 0;
+    int size = 0;
+    char name[64], extra[128];
+
+    program[size] = 0x01; memcpy(&program[size + 1], &step, sizeof(double)); size += 9;
+    program[size] = 0x0A; memcpy(&program[size + 1], &quarter, sizeof(double)); size += 9;
+    program[size] = 0x03; memcpy(&program[size + 1], &slot, sizeof(int)); size += 5;
+    program[size] = 0x04; size += 1;
+    program[size] = 0x05; size += 1;
+    program[size] = 0x06; memcpy(&program[size + 1], &start, sizeof(int)); size += 5;
+
+    int l1_misses = bench_counter_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                       PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    int cache_misses = bench_counter_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    if (l1_misses < 0 && cache_misses < 0) {
+        printf("vm_state: no hardware cache counters, reporting times only\n");
+    }
+    Cocomp **vms = malloc(guests * sizeof(Cocomp *));
+    for (int full = 0; full < 2; full++) {
+        for (int i = 0; i < guests; i++) {
+            vms[i] = create_cocomp(&config);
+            if (!vms[i]) {
+                while (i-- > 0) destroy_cocomp(vms[i]);
+                goto done;
+            }
+            load_program(vms[i], program, size);
+            if (full) {
+                bench_quiet(1);
+                get_paging(vms[i]);
+                get_heap(vms[i]);
+                get_network(vms[i]);
+                get_ipc(vms[i]);
+                bench_quiet(0);
+            }
+        }
+        double best = 0;
+        long best_l1 = -1, best_cache = -1;
+        for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+            ioctl(l1_misses, PERF_EVENT_IOC_RESET, 0);
+            ioctl(cache_misses, PERF_EVENT_IOC_RESET, 0);
+            ioctl(l1_misses, PERF_EVENT_IOC_ENABLE, 0);
+            ioctl(cache_misses, PERF_EVENT_IOC_ENABLE, 0);
+            double begin = bench_seconds();
+            for (int round = 0; round < rounds; round++) {
+                for (int i = 0; i < guests; i++) {
+                    execute_program_quantum(vms[i], quantum);
+                }
+            }
+            double elapsed = bench_seconds() - begin;
+            ioctl(l1_misses, PERF_EVENT_IOC_DISABLE, 0);
+            ioctl(cache_misses, PERF_EVENT_IOC_DISABLE, 0);
+            if (repeat == 0 || elapsed < best) {
+                best = elapsed;
+                best_l1 = bench_counter_read(l1_misses);
+                best_cache = bench_counter_read(cache_misses);
+            }
+        }
+        long ops = (long)rounds * guests * quantum * per_block;
+        snprintf(name, sizeof(name), "vm_state/%s/x%d", full ? "full" : "lean", guests);
+        // Counters that could not be opened are reported as null
+        char l1_field[32] = "null", cache_field[32] = "null";
+        if (best_l1 >= 0) snprintf(l1_field, sizeof(l1_field), "%.4f", (double)best_l1 / ops);
+        if (best_cache >= 0) snprintf(cache_field, sizeof(cache_field), "%.4f", (double)best_cache / ops);
+        snprintf(extra, sizeof(extra), ", \"l1d_misses_per_op\": %s, \"cache_misses_per_op\": %s",
+                 l1_field, cache_field);
+        bench_record(name, ops, best, extra);
+        printf("%s: %.1f ns per instruction, %s L1D misses and %s cache misses per instruction\n",
+               name, best / ops * 1e9, l1_field, cache_field);
+        for (int i = 0; i < guests; i++) {
+            destroy_cocomp(vms[i]);
+        }
+    }
+done:
+    free(vms);
+    if (l1_misses >= 0) close(l1_misses);
+    if (cache_misses >= 0) close(cache_misses);
+}
+
+// Starting a job from scratch (create_cocomp, load_program, and a prelude
+// that sets up the heap and the network) against forking a snapshot taken
+// after the same steps, on the default VM and on a 1 MB one. Each VM is
+// destroyed again straight away.
+void benchmark_snapshot(Cocomp *cocomp) {
+    (void)cocomp;  // the VMs are created here, with their own sizes
+    CocompConfig configs[2] = {COCOMP_DEFAULT_CONFIG, COCOMP_DEFAULT_CONFIG};
+    int config_count = 1;
+#ifndef COCOMP_FIXED_CONFIG
+    configs[1].memory_size = 1 << 20;
+    configs[1].page_size = 8192;
+    config_count = 2;
+#endif
+    unsigned char program[MEMORY_SIZE - STACK_SIZE];
+    long instructions;
+    int size = bench_arithmetic_program(program, sizeof(program), &instructions);
+    char name[64];
+
+    bench_quiet(1);
+    for (int c = 0; c < config_count; c++) {
+        double times[2];
+        long ops[2];
+        Cocomp *setup = create_cocomp(&configs[c]);
+        if (!setup) {
+            break;
+        }
+        load_program(setup, program, size);
+        allocate_heap(setup, 64);
+        get_network(setup);
+        CocompSnapshot *snapshot = snapshot_cocomp(setup);
+        destroy_cocomp(setup);
+        if (!snapshot) {
+            break;
+        }
+        for (int fork = 0; fork < 2; fork++) {
+            double best = 0;
+            ops[fork] = (fork ? 20000 : 2000) >> (c * 6);  // creating 1 MB VMs is slow
+            for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+                double start = bench_seconds();
+                for (long i = 0; i < ops[fork]; i++) {
+                    Cocomp *vm = fork ? fork_cocomp(snapshot) : create_cocomp(&configs[c]);
+                    if (!fork) {
+                        load_program(vm, program, size);
+                        allocate_heap(vm, 64);
+                        get_network(vm);
+                    }
+                    destroy_cocomp(vm);
+                }
+                double elapsed = bench_seconds() - start;
+                if (repeat == 0 || elapsed < best) best = elapsed;
+            }
+            times[fork] = best;
+            snprintf(name, sizeof(name), "snapshot/%s/%dk", fork ? "fork" : "create", configs[c].memory_size / 1024);
+            bench_report(name, ops[fork], best);
+        }
+        destroy_snapshot(snapshot);
+        bench_quiet(0);
+        printf("%d KB VM: %.1f us to create and set up, %.1f us to fork\n", configs[c].memory_size / 1024,
+               times[0] / ops[0] * 1e6, times[1] / ops[1] * 1e6);
+        bench_quiet(1);
+    }
+    bench_quiet(0);
+}
+
+// One host thread of an IPC benchmark: sends `count` messages, `batch` at a
+// time, on `out`, or receives them from `in`; with both, it echoes each
+// message back (the far end of a ping-pong).
+typedef struct {
+    IpcChannel *out;
+    IpcChannel *in;
+    long count;
+    int batch;
+} BenchChannelJob;
+
+static void bench_channel_send(IpcChannel *channel, const double *messages, int count) {
+    int sent = 0;
+    while (sent < count) {
+        int n = channel_send(channel, messages + sent, count - sent);
+        if (n == 0) sched_yield();  // the receiver may share our CPU
+        sent += n;
+    }
+}
+
+static void bench_channel_receive(IpcChannel *channel, double *messages, int count) {
+    int received = 0;
+    while (received < count) {
+        int n = channel_receive(channel, messages + received, count - received);
+        if (n == 0) sched_yield();
+        received += n;
+    }
+}
+
+static void *bench_channel_worker(void *arg) {
+    BenchChannelJob *job = arg;
+    double messages[256];
+    for (int i = 0; i < job->batch; i++) {
+        messages[i] = i;
+    }
+    for (long done = 0; done < job->count; done += job->batch) {
+        if (job->in) bench_channel_receive(job->in, messages, job->batch);
+        if (job->out) bench_channel_send(job->out, messages, job->batch);
+    }
+    return NULL;
+}
+
+// A guest VM on its own host thread, run a quantum at a time until told to
+// stop, or for good once it parks or ends
+typedef struct {
+    Cocomp *cocomp;
+    atomic_int *stop;
+} BenchGuestJob;
+
+static void *bench_guest_worker(void *arg) {
+    BenchGuestJob *job = arg;
+    while (!atomic_load(job->stop)) {
+        if (execute_program_quantum(job->cocomp, 64)) break;
+        if (job->cocomp->parked) sched_yield();
+    }
+    return NULL;
+}
+
+// Messages between host threads through channels: throughput one message
+// per call and 64 per call, SPSC and MPMC (two senders, two receivers),
+// then the round-trip latency of a ping-pong. Finally two VMs on their own
+// host threads, one running a SEND loop and the other a RECV loop, parking
+// whenever the channel between them is full or empty.
+void benchmark_ipc(Cocomp *cocomp) {
+    const long messages = 1 << 21;
+    const long round_trips = 1 << 16;
+    char name[64];
+
+    for (int kind = IPC_SPSC; kind <= IPC_MPMC; kind++) {
+        int pairs = kind == IPC_MPMC ? 2 : 1;
+        for (int batch = 1; batch <= 64; batch *= 64) {
+            double best = 0;
+            for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+                IpcChannel *channel = create_channel(1024, kind);
+                BenchChannelJob senders = {channel, NULL, messages / pairs, batch};
+                BenchChannelJob receivers = {NULL, channel, messages / pairs, batch};
+                pthread_t threads[4];
+                double start = bench_seconds();
+                for (int i = 0; i < pairs; i++) {
+                    pthread_create(&threads[2 * i], NULL, bench_channel_worker, &senders);
+                    pthread_create(&threads[2 * i + 1], NULL, bench_channel_worker, &receivers);
+                }
+                for (int i = 0; i < 2 * pairs; i++) {
+                    pthread_join(threads[i], NULL);
+                }
+                double elapsed = bench_seconds() - start;
+                if (repeat == 0 || elapsed < best) best = elapsed;
+                release_channel(channel);
+            }
+            snprintf(name, sizeof(name), "ipc/%s/%dx%d/batch%d", kind == IPC_SPSC ? "spsc" : "mpmc",
+                     pairs, pairs, batch);
+            printf("%s: %.1f M messages/s\n", name, messages / best / 1e6);
+            bench_report(name, messages, best);
+        }
+    }
+
+    double best = 0;
+    for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+        IpcChannel *ping = create_channel(16, IPC_SPSC);
+        IpcChannel *pong = create_channel(16, IPC_SPSC);
+        BenchChannelJob echo = {pong, ping, round_trips, 1};
+        pthread_t thread;
+        double message = 0;
+        double start = bench_seconds();
+        pthread_create(&thread, NULL, bench_channel_worker, &echo);
+        for (long i = 0; i < round_trips; i++) {
+            bench_channel_send(ping, &message, 1);
+            bench_channel_receive(pong, &message, 1);
+        }
+        pthread_join(thread, NULL);
+        double elapsed = bench_seconds() - start;
+        if (repeat == 0 || elapsed < best) best = elapsed;
+        release_channel(ping);
+        release_channel(pong);
+    }
+    printf("ipc/ping_pong: %.0f ns per round trip\n", best / round_trips * 1e9);
+    bench_report("ipc/ping_pong", round_trips, best);
+
+    // SEND 0x11 to process 1 in a loop; RECV 0x20 from process 0 and STORE it
+    unsigned char sender[32], receiver[32];
+    double value = 7;
+    int slot = 2048, start = 0;
+    int sender_size = 0, receiver_size = 0;
+    sender[sender_size] = 0x01; memcpy(&sender[sender_size + 1], &value, sizeof(double)); sender_size += 9;
+    sender[sender_size++] = 0x0C; sender[sender_size++] = IPC_SEND + 1;
+    sender[sender_size] = 0x06; memcpy(&sender[sender_size + 1], &start, sizeof(int)); sender_size += 5;
+    receiver[receiver_size++] = 0x0C; receiver[receiver_size++] = IPC_RECEIVE + 0;
+    receiver[receiver_size] = 0x03; memcpy(&receiver[receiver_size + 1], &slot, sizeof(int)); receiver_size += 5;
+    receiver[receiver_size] = 0x06; memcpy(&receiver[receiver_size + 1], &start, sizeof(int)); receiver_size += 5;
+
+    Cocomp *guests[2] = {clone_cocomp(cocomp), clone_cocomp(cocomp)};
+    if (!guests[0] || !guests[1]) {
+        destroy_cocomp(guests[0]);
+        destroy_cocomp(guests[1]);
+        return;
+    }
+    initialize(guests[0]);
+    initialize(guests[1]);
+    guests[1]->process_id = 1;
+    ipc_connect(guests[0], guests[1], 256);
+    load_program(guests[0], sender, sender_size);
+    load_program(guests[1], receiver, receiver_size);
+    atomic_int stop = 0;
+    BenchGuestJob jobs[2] = {{guests[0], &stop}, {guests[1], &stop}};
+    pthread_t threads[2];
+    struct timespec run_for = {0, 250000000};
+    double begin = bench_seconds();
+    pthread_create(&threads[0], NULL, bench_guest_worker, &jobs[0]);
+    pthread_create(&threads[1], NULL, bench_guest_worker, &jobs[1]);
+    nanosleep(&run_for, NULL);
+    atomic_store(&stop, 1);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    double elapsed = bench_seconds() - begin;
+    long received = atomic_load(&guests[1]->ipc->receive_channels[0]->tail);
+    printf("ipc/guest_send_recv: %.1f M messages/s\n", received / elapsed / 1e6);
+    bench_report("ipc/guest_send_recv", received, elapsed);
+    destroy_cocomp(guests[0]);
+    destroy_cocomp(guests[1]);
+}
+
+// Guest output in each console mode: a program of print syscalls, and one
+// of PUSHes that each overflow the stack and report it. Output goes to
+// /dev/null, line buffered like stdout on a terminal.
+void benchmark_console(Cocomp *cocomp) {
+    static const char *modes[] = {"direct", "buffered", "background", "silent"};
+    const int passes = 200;
+    unsigned char program[2048];
+    char name[64];
+    FILE *terminal = fopen("/dev/null", "w");
+    if (!terminal) {
+        return;
+    }
+    setvbuf(terminal, NULL, _IOLBF, BUFSIZ);
+
+    for (int workload = 0; workload < 2; workload++) {
+        int size = 0;
+        long messages = 0;
+        while (size + 2 < (int)sizeof(program)) {
+            if (workload == 0) {
+                program[size++] = 0x0C;
+                program[size++] = 0x01;
+            } else {
+                program[size++] = 0x04;
+            }
+            messages++;
+        }
+        program[size++] = 0xFF;
+        initialize(cocomp);
+        load_program(cocomp, program, size);
+        for (int mode = CONSOLE_DIRECT; mode <= CONSOLE_SILENT; mode++) {
+            set_console(cocomp, mode, terminal);
+            double best = 0;
+            for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+                double start = bench_seconds();
+                for (int pass = 0; pass < passes; pass++) {
+                    cocomp->instruction_pointer = 0;
+                    cocomp->stack_pointer = cocomp->stack_base;  // full: every PUSH overflows
+                    execute_program(cocomp);
+                }
+                sync_console();
+                double elapsed = bench_seconds() - start;
+                if (repeat == 0 || elapsed < best) best = elapsed;
+            }
+            snprintf(name, sizeof(name), "console/%s/%s", workload ? "stack_overflow" : "print", modes[mode]);
+            printf("%s: %.1f ns per message\n", name, best / (messages * passes) * 1e9);
+            bench_report(name, messages * passes, best);
+        }
+        set_console(cocomp, CONSOLE_DIRECT, NULL);
+    }
+    fclose(terminal);
+    initialize(cocomp);
+}
+
+// Loads of one program, filling the VM below its stack, written to a
+// module file: load_program, which copies and decodes it; load_module of a
+// module whose trace is cached; open_module of a file not in the cache
+// (mapped, hashed, decoded) and of one that is, each followed by a load.
+static void bench_module_loads(Cocomp *cocomp, const char *vm) {
+    const int loads = 2000;
+    static const char *kinds[] = {"load_program", "load_module_cached", "open_module_cold", "open_module_cached"};
+    char path[] = "/tmp/cocomp-module-XXXXXX";
+    char name[96];
+    long instructions;
+    int capacity = cocomp->memory_size - cocomp->stack_size;
+    unsigned char *program = malloc(capacity);
+    int fd = mkstemp(path);
+    if (!program || fd < 0) {
+        free(program);
+        if (fd >= 0) close(fd);
+        return;
+    }
+    int size = bench_arithmetic_program(program, capacity, &instructions);
+    int written = write(fd, program, size) == size;
+    close(fd);
+    if (!written) {
+        unlink(path);
+        free(program);
+        return;
+    }
+
+    flush_module_cache();
+    CocompModule *module = module_from_code(program, size);
+    load_module(cocomp, module);  // leaves the trace in the module
+    for (int kind = 0; kind < 4; kind++) {
+        double best = 0;
+        for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+            double start = bench_seconds();
+            for (int i = 0; i < loads; i++) {
+                if (kind == 0) {
+                    load_program(cocomp, program, size);
+                } else if (kind == 1) {
+                    load_module(cocomp, module);
+                } else {
+                    if (kind == 2) flush_module_cache();
+                    load_module_file(cocomp, path);
+                }
+            }
+            double elapsed = bench_seconds() - start;
+            if (repeat == 0 || elapsed < best) best = elapsed;
+        }
+        snprintf(name, sizeof(name), "modules/%s/%s", vm, kinds[kind]);
+        printf("%s: %.2f us per load of %d bytes\n", name, best / loads * 1e6, size);
+        bench_report(name, loads, best);
+    }
+    print_module_cache_stats();
+    release_module(module);
+    flush_module_cache();
+    unlink(path);
+    free(program);
+    initialize(cocomp);
+}
+
+// A STORE-heavy straight-line program run with verified STOREs and, after
+// unverify_program, with checked ones; the JIT is off so every STORE is
+// interpreted. Then verify_program itself, per program.
+void benchmark_verifier(Cocomp *cocomp) {
+    unsigned char program[MEMORY_SIZE - STACK_SIZE];
+    const int passes = 100000;
+    long instructions = 0;
+    int size = 0;
+    double one = 1.0;
+    int address = 0;
+    char name[64];
+
+    while (size + 9 + 5 + 1 < 2048) {
+        program[size] = 0x02; memcpy(&program[size + 1], &one, sizeof(double)); size += 9;
+        int target = 2048 + address * 8 % 1024;  // 128 slots past the program
+        program[size] = 0x03; memcpy(&program[size + 1], &target, sizeof(int)); size += 5;
+        address++;
+        instructions += 2;
+    }
+    program[size++] = 0xFF;
+    instructions++;
+
+    initialize(cocomp);
+    set_jit_enabled(cocomp, 0);
+    for (int verified = 1; verified >= 0; verified--) {
+        load_program(cocomp, program, size);
+        if (!verified) {
+            unverify_program(cocomp);
+        }
+        double best = 0, result;
+        for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+            double elapsed = bench_engine(cocomp, execute_program, passes, &result);
+            if (repeat == 0 || elapsed < best) best = elapsed;
+        }
+        snprintf(name, sizeof(name), "verifier/store/%s", verified ? "verified" : "checked");
+        printf("%s: %.1f M instructions/s\n", name, instructions * passes / best / 1e6);
+        bench_report(name, instructions * passes, best);
+    }
+
+    const int checks = 20000;
+    double best = 0;
+    for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+        double start = bench_seconds();
+        for (int i = 0; i < checks; i++) {
+            if (verify_program(program, size, MEMORY_SIZE, NULL)) {
+                printf("verifier/verify_program: program rejected\n");
+                return;
+            }
+        }
+        double elapsed = bench_seconds() - start;
+        if (repeat == 0 || elapsed < best) best = elapsed;
+    }
+    printf("verifier/verify_program: %.2f us per %d byte program\n", best / checks * 1e6, size);
+    bench_report("verifier/verify_program", checks, best);
+    initialize(cocomp);
+}
+
+// Module loads into the default VM and, unless the configuration is fixed,
+// into a 64 KB one.
+void benchmark_modules(Cocomp *cocomp) {
+    bench_module_loads(cocomp, "4k_vm");
+#ifndef COCOMP_FIXED_CONFIG
+    CocompConfig config = COCOMP_DEFAULT_CONFIG;
+    config.page_size = 4096;
+    config.memory_size = 16 * config.page_size;
+    config.stack_size = 4096;
+    Cocomp *large = create_cocomp(&config);
+    if (large) {
+        bench_module_loads(large, "64k_vm");
+    }
+    destroy_cocomp(large);
+#endif
+}
+
+// Blocks of LOAD_FLOAT, ten ADDs and a STORE to the last 8 bytes of
+// `capacity`: runs that fit one superinstruction in compact code but take
+// several in raw code, whose ADDs are 9 bytes each.
+static int bench_chain_program(unsigned char *program, int capacity, long *instructions) {
+    double start = 1.5, one = 1.0;
+    int result = capacity - (int)sizeof(double);
+    int size = 0;
+
+    *instructions = 0;
+    while (size + 9 + 10 * 9 + 5 + 1 <= result) {
+        program[size] = 0x01; memcpy(&program[size + 1], &start, sizeof(double)); size += 9;
+        for (int i = 0; i < 10; i++) {
+            program[size] = 0x02; memcpy(&program[size + 1], &one, sizeof(double)); size += 9;
+        }
+        program[size] = 0x03; memcpy(&program[size + 1], &result, sizeof(int)); size += 5;
+        *instructions += 12;
+    }
+    program[size++] = 0xFF;
+    (*instructions)++;
+    return size;
+}
+
+// The same instructions as a raw program, as a compact image: the raw
+// program disassembled and assembled again.
+static unsigned char *bench_compact_image(const unsigned char *program, int size, long *compact_size) {
+    char *source = NULL;
+    size_t length = 0;
+    char error[128];
+    FILE *out = open_memstream(&source, &length);
+    if (!out) {
+        return NULL;
+    }
+    disassemble(program, size, out);
+    fclose(out);
+    unsigned char *image = assemble(source, compact_size, error, sizeof(error));
+    if (!image) {
+        printf("compact: %s\n", error);
+    }
+    free(source);
+    return image;
+}
+
+// Raw programs against the same instructions in compact bytecode: the
+// size of each, and the interpreter's speed on each. The JIT is off, as it
+// compiles both to the same native code.
+void benchmark_compact(Cocomp *cocomp) {
+    const long target = 10000000;
+    static const char *names[] = {"arithmetic", "branch", "constant_chain"};
+    int (*generators[])(unsigned char *, int, long *) = {
+        bench_arithmetic_program, bench_branch_program, bench_chain_program
+    };
+    unsigned char program[MEMORY_SIZE - STACK_SIZE];
+    char name[64], extra[64];
+
+    for (int kind = 0; kind < 3; kind++) {
+        long instructions, compact_size;
+        int size = generators[kind](program, sizeof(program), &instructions);
+        unsigned char *compact = bench_compact_image(program, size, &compact_size);
+        if (!compact) {
+            continue;
+        }
+        int passes = target / instructions + 1;
+        double best[2], result;
+        long bytes[2] = {size, compact_size};
+        for (int format = 0; format < 2; format++) {
+            load_program(cocomp, format ? compact : program, bytes[format]);
+            cocomp->jit_enabled = 0;
+            for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+                double elapsed = bench_engine(cocomp, execute_program, passes, &result);
+                if (repeat == 0 || elapsed < best[format]) best[format] = elapsed;
+            }
+            snprintf(name, sizeof(name), "compact/%s/%s", names[kind], format ? "compact" : "raw");
+            snprintf(extra, sizeof(extra), ", \"bytes\": %ld", bytes[format]);
+            bench_record(name, instructions * passes, best[format], extra);
+        }
+        printf("compact/%s: raw %ld bytes, %.1f M instructions/s; compact %ld bytes, %.1f M instructions/s\n",
+               names[kind], bytes[0], instructions * passes / best[0] / 1e6,
+               bytes[1], instructions * passes / best[1] / 1e6);
+        free(compact);
+    }
+    initialize(cocomp);
+}
+
+// The vector kernels, scalar against AVX2 (in an AVX2 build), on two ranges
+// of 128 doubles in guest memory. Then, through execute_program, one STORE
+// per element against a VFILL of the range, and each vector instruction
+// over the same ranges. The JIT is off, so the STOREs take the
+// interpreter's verified path rather than the JIT's checked one.
+void benchmark_vectors(Cocomp *cocomp) {
+    enum { count = 128, first = 1024, second = first + count * sizeof(double), rounds = 100000, passes = 100000 };
+    static const char *names[] = {"vadd", "vmul", "vdot", "vfill", "vcopy"};
+    static const char *kernel_names[] = {"scalar", "avx2"};
+    int kernel_count = sizeof(vector_kernel_sets) / sizeof(vector_kernel_sets[0]);
+    unsigned char program[MEMORY_SIZE - STACK_SIZE];
+    char name[64];
+    double one = 1.0;
+
+    initialize(cocomp);
+    for (int op = 0; op < 4; op++) {  // VCOPY is a memmove with either
+        double best[2] = {0};
+        for (int k = 0; k < kernel_count; k++) {
+            for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+                double sums[VECTOR_SUMS] = {0};
+                for (int i = 0; i < 2 * count; i++) {
+                    memcpy(&cocomp->memory[first + i * sizeof(double)], &one, sizeof(double));
+                }
+                double start = bench_seconds();
+                for (int round = 0; round < rounds; round++) {
+                    run_vector_kernel(&vector_kernel_sets[k], cocomp->memory, 0x19 + op, first, second, count, one, sums);
+                }
+                double elapsed = bench_seconds() - start;
+                if (repeat == 0 || elapsed < best[k]) best[k] = elapsed;
+                cocomp->accumulator = vector_total(sums);
+            }
+            snprintf(name, sizeof(name), "vector/kernel/%s/%s", names[op], kernel_names[k]);
+            bench_report(name, (long)rounds * count, best[k]);
+        }
+        printf("vector kernel %s: scalar %.2f ns per element", names[op], best[0] / rounds / count * 1e9);
+        if (kernel_count == 2) {
+            printf(", avx2 %.2f ns (%.1fx)", best[1] / rounds / count * 1e9, best[0] / best[1]);
+        }
+        printf("\n");
+    }
+
+    for (int kind = 0; kind <= 5; kind++) {
+        int size = 0;
+        program[size] = 0x01; memcpy(&program[size + 1], &one, sizeof(double)); size += 9;
+        if (kind == 0) {
+            for (int i = 0; i < count; i++) {
+                int address = first + i * sizeof(double);
+                program[size] = 0x03; memcpy(&program[size + 1], &address, sizeof(int)); size += 5;
+            }
+        } else {
+            unsigned char opcode = 0x19 + kind - 1;
+            int operands[3] = {first, opcode == 0x1C ? count : second, count};
+            int length = (opcode == 0x1C ? 2 : 3) * sizeof(int);
+            program[size] = opcode; memcpy(&program[size + 1], operands, length); size += 1 + length;
+        }
+        program[size++] = 0xFF;
+        load_program(cocomp, program, size);
+        cocomp->jit_enabled = 0;
+        double best = 0, result;
+        for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+            double elapsed = bench_engine(cocomp, execute_program, passes, &result);
+            if (repeat == 0 || elapsed < best) best = elapsed;
+        }
+        snprintf(name, sizeof(name), "vector/guest/%s", kind == 0 ? "stores" : names[kind - 1]);
+        bench_report(name, (long)passes * count, best);
+        printf("vector guest %s: %.2f ns per element\n", kind == 0 ? "STORE per element" : names[kind - 1],
+               best / passes / count * 1e9);
+    }
+    initialize(cocomp);
+}
+#endif
+
+#ifdef COCOMP_CHECK
+#define CHECK_BLOCK_LIMIT 100000  // a pass of any check program enters far fewer blocks
+
+// Write an instruction with a double or an int operand at `at`; returns the
+// address after it.
+static int check_double_op(unsigned char *program, int at, unsigned char opcode, double value) {
+    program[at] = opcode;
+    memcpy(&program[at + 1], &value, sizeof(double));
+    return at + 1 + sizeof(double);
+}
+
+static int check_int_op(unsigned char *program, int at, unsigned char opcode, int value) {
+    program[at] = opcode;
+    memcpy(&program[at + 1], &value, sizeof(int));
+    return at + 1 + sizeof(int);
+}
+
+// A double with the given bytes, for STOREs that write code.
+static double check_bytes(unsigned long long bits) {
+    double value;
+    memcpy(&value, &bits, sizeof(double));
+    return value;
+}
+
+// Arithmetic, bitwise, PUSH/POP and STORE, entered only at address 0.
+static int check_straight_program(unsigned char *program) {
+    int at = 0;
+    at = check_double_op(program, at, 0x01, 1.0);
+    at = check_double_op(program, at, 0x0A, 0.5);
+    at = check_int_op(program, at, 0x0F, 0x7FFF);
+    at = check_double_op(program, at, 0x02, 3.0);
+    at = check_int_op(program, at, 0x12, 3);
+    at = check_double_op(program, at, 0x0B, 2.0);
+    at = check_int_op(program, at, 0x10, 0x30);
+    at = check_int_op(program, at, 0x11, 0x55);
+    at = check_int_op(program, at, 0x13, 1);
+    program[at++] = 0x04;
+    at = check_double_op(program, at, 0x02, 0.125);
+    program[at++] = 0x05;
+    at = check_int_op(program, at, 0x03, 2048);
+    at = check_double_op(program, at, 0x01, 7.0);
+    at = check_double_op(program, at, 0x02, 1.0);
+    at = check_double_op(program, at, 0x0A, 2.5);
+    at = check_int_op(program, at, 0x03, 2056);
+    program[at++] = 0xFF;
+    return at;
+}
+
+// A loop counted by DBNZ, the counter on the stack.
+static int check_counted_loop_program(unsigned char *program) {
+    int at = 0, top;
+    at = check_double_op(program, at, 0x01, 200);
+    program[at++] = 0x04;
+    at = check_double_op(program, at, 0x01, 0);
+    top = at;
+    at = check_double_op(program, at, 0x02, 1.5);
+    at = check_int_op(program, at, 0x11, 7);
+    at = check_double_op(program, at, 0x0A, 0.25);
+    at = check_int_op(program, at, 0x12, 1);
+    at = check_int_op(program, at, 0x0F, 0xFFFF);
+    at = check_int_op(program, at, 0x03, 2048);
+    at = check_int_op(program, at, 0x18, top);
+    program[at++] = 0x05;
+    program[at++] = 0xFF;
+    return at;
+}
+
+// A loop counted in the accumulator by COMPARE and BLT.
+static int check_compare_loop_program(unsigned char *program) {
+    int at = 0, top;
+    at = check_double_op(program, at, 0x01, 0);
+    top = at;
+    at = check_double_op(program, at, 0x02, 1.0);
+    at = check_int_op(program, at, 0x12, 1);
+    at = check_int_op(program, at, 0x13, 1);
+    at = check_int_op(program, at, 0x03, 2048);
+    at = check_double_op(program, at, 0x0B, 300);
+    at = check_int_op(program, at, 0x15, top);
+    program[at++] = 0xFF;
+    return at;
+}
+
+// Forty CALLs of a function at address 9. A raw CALL returns to its operand
+// byte, 0x09, which runs as a NOP over the padding byte after it.
+static int check_call_program(unsigned char *program) {
+    int function = 9, at = function, main_code;
+    at = check_double_op(program, at, 0x02, 1.0);
+    at = check_int_op(program, at, 0x11, 3);
+    at = check_double_op(program, at, 0x0A, 0.5);
+    at = check_double_op(program, at, 0x02, 2.0);
+    program[at++] = 0x08;
+    main_code = at;
+    check_int_op(program, 0, 0x06, main_code);
+    at = check_double_op(program, at, 0x01, 0);
+    for (int i = 0; i < 40; i++) {
+        program[at++] = 0x07;
+        program[at++] = function;
+        program[at++] = 0x00;
+    }
+    at = check_int_op(program, at, 0x03, 2048);
+    program[at++] = 0xFF;
+    return at;
+}
+
+// Each pass stores the LOAD_FLOAT constant, plus 1, over that constant and
+// over the SUBTRACT that follows in the same block, so every pass runs
+// different code. The JIT ends a block before a STORE into it, so this
+// block is too short to compile.
+static int check_patch_block_program(unsigned char *program) {
+    int at = 0;
+    at = check_double_op(program, at, 0x01, 2.5);
+    at = check_double_op(program, at, 0x02, 1.0);
+    at = check_int_op(program, at, 0x03, 1);
+    at = check_int_op(program, at, 0x03, at + 1 + sizeof(int) + 1);
+    at = check_double_op(program, at, 0x0A, 0);
+    at = check_int_op(program, at, 0x11, 5);
+    at = check_double_op(program, at, 0x02, 0.75);
+    at = check_int_op(program, at, 0x03, 2048);
+    program[at++] = 0xFF;
+    return at;
+}
+
+// A DBNZ loop that stores the accumulator over the ADD constant at its top
+// on every iteration. The STORE comes after PUSH; POP, outside the block
+// the JIT compiles from the top of the loop, so it rewrites compiled code.
+static int check_patch_loop_program(unsigned char *program) {
+    int at = 0, top;
+    at = check_double_op(program, at, 0x01, 100);
+    program[at++] = 0x04;
+    at = check_double_op(program, at, 0x01, 1.0);
+    top = at;
+    at = check_double_op(program, at, 0x02, 0.5);
+    at = check_int_op(program, at, 0x0F, 0xFFFF);
+    at = check_double_op(program, at, 0x0A, 0.25);
+    at = check_int_op(program, at, 0x11, 1);
+    program[at++] = 0x04;
+    program[at++] = 0x05;
+    at = check_int_op(program, at, 0x03, top + 1);
+    at = check_int_op(program, at, 0x18, top);
+    at = check_int_op(program, at, 0x03, 2048);
+    program[at++] = 0x05;
+    program[at++] = 0xFF;
+    return at;
+}
+
+// A DBNZ loop run hot, then rewritten: SHIFT_LEFT 2; PUSH; POP; PUSH becomes
+// PUSH; POP; SHIFT_RIGHT 2; PUSH, and the loop runs again. The code after
+// the loop also turns its own first instruction into END, so the second
+// time round the program stops there.
+static int check_patch_opcode_program(unsigned char *program) {
+    int at = 0, top, region, stop;
+    at = check_double_op(program, at, 0x01, 120);
+    program[at++] = 0x04;
+    at = check_double_op(program, at, 0x01, 1.0);
+    top = at;
+    at = check_double_op(program, at, 0x02, 3.0);
+    at = check_int_op(program, at, 0x11, 1);
+    at = check_double_op(program, at, 0x0A, 0.5);
+    region = at;
+    at = check_int_op(program, at, 0x12, 2);
+    program[at++] = 0x04;
+    program[at++] = 0x05;
+    program[at++] = 0x04;
+    program[at++] = 0x05;
+    at = check_int_op(program, at, 0x0F, 0xFFFF);
+    at = check_int_op(program, at, 0x18, top);
+    program[at++] = 0x05;
+    stop = at;
+    at = check_double_op(program, at, 0x01, check_bytes(0x0400000002130504ULL));  // 04 05 13 02 00 00 00 04
+    at = check_int_op(program, at, 0x03, region);
+    at = check_double_op(program, at, 0x01, check_bytes(0x3FF00000000000FFULL));  // first byte 0xFF
+    at = check_int_op(program, at, 0x03, stop);
+    at = check_double_op(program, at, 0x01, 120);
+    program[at++] = 0x04;
+    at = check_double_op(program, at, 0x01, 1.0);
+    at = check_int_op(program, at, 0x06, top);
+    return at;
+}
+
+// Report where `vm` differs from `reference`; returns 1 if they match.
+static int check_state(const char *program, const char *engine, int pass, Cocomp *reference, Cocomp *vm) {
+    int match = 1;
+    if (memcmp(&vm->accumulator, &reference->accumulator, sizeof(double)) != 0) {
+        printf("%s: %s accumulator %.17g, switch %.17g after pass %d\n",
+               program, engine, vm->accumulator, reference->accumulator, pass);
+        match = 0;
+    }
+    if (vm->instruction_pointer != reference->instruction_pointer) {
+        printf("%s: %s instruction pointer %d, switch %d after pass %d\n",
+               program, engine, vm->instruction_pointer, reference->instruction_pointer, pass);
+        match = 0;
+    }
+    if (vm->stack_pointer != reference->stack_pointer || vm->return_depth != reference->return_depth) {
+        printf("%s: %s stack pointer %d (%d returns), switch %d (%d returns) after pass %d\n",
+               program, engine, vm->stack_pointer, vm->return_depth,
+               reference->stack_pointer, reference->return_depth, pass);
+        match = 0;
+    }
+    if (vm->flags != reference->flags || vm->status != reference->status) {
+        printf("%s: %s flags %d, status %s; switch flags %d, status %s after pass %d\n",
+               program, engine, vm->flags, status_name(vm->status),
+               reference->flags, status_name(reference->status), pass);
+        match = 0;
+    }
+    for (int address = 0; address < VM_MEMORY_SIZE(reference); address++) {
+        if (vm->memory[address] != reference->memory[address]) {
+            printf("%s: %s memory differs from switch at %d after pass %d\n", program, engine, address, pass);
+            match = 0;
+            break;
+        }
+    }
+    return match;
+}
+
+// Runs each program on the reference interpreter, the decoded engine with
+// and without fusion, and the JIT, one VM each, and compares the VMs after
+// every pass. There are enough passes and loop iterations for the JIT to
+// compile each program's blocks. Returns 1 if every engine matched.
+int check_engines(void) {
+    static const struct {
+        const char *name;
+        int (*build)(unsigned char *program);
+    } programs[] = {
+        {"straight", check_straight_program},
+        {"counted_loop", check_counted_loop_program},
+        {"compare_loop", check_compare_loop_program},
+        {"call", check_call_program},
+        {"patch_block", check_patch_block_program},
+        {"patch_loop", check_patch_loop_program},
+        {"patch_opcode", check_patch_opcode_program},
+    };
+    enum { program_count = sizeof(programs) / sizeof(programs[0]) };
+    static const char *engines[] = {"switch", "decoded", "unfused", "jit"};
+    int engine_count = COCOMP_JIT ? 4 : 3;
+    int passes = 2 * JIT_THRESHOLD;
+    unsigned char program[MEMORY_SIZE - STACK_SIZE];
+    Cocomp *vms[4];
+    int failures = 0;
+
+    for (int engine = 0; engine < engine_count; engine++) {
+        vms[engine] = create_cocomp(NULL);
+        if (!vms[engine]) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < program_count; i++) {
+        memset(program, 0, sizeof(program));
+        int size = programs[i].build(program);
+        for (int engine = 0; engine < engine_count; engine++) {
+            set_jit_enabled(vms[engine], engine == 3);
+            vms[engine]->fusion_enabled = engine != 2;
+            load_program(vms[engine], program, size);
+        }
+        int match = 1;
+        for (int pass = 1; match && pass <= passes; pass++) {
+            for (int engine = 0; engine < engine_count; engine++) {
+                vms[engine]->instruction_pointer = 0;
+                vms[engine]->accumulator = 0;
+                if (engine == 0) {
+                    execute_program_switch(vms[engine]);
+                } else if (!execute_program_quantum(vms[engine], CHECK_BLOCK_LIMIT)) {
+                    printf("%s: %s did not stop within %d blocks in pass %d\n",
+                           programs[i].name, engines[engine], CHECK_BLOCK_LIMIT, pass);
+                    match = 0;
+                }
+            }
+            for (int engine = 1; engine < engine_count; engine++) {
+                match &= check_state(programs[i].name, engines[engine], pass, vms[0], vms[engine]);
+            }
+        }
+#if COCOMP_JIT
+        printf("%-14s %s (%d JIT blocks compiled)\n", programs[i].name, match ? "ok" : "MISMATCH", vms[3]->jit_block_count);
+#else
+        printf("%-14s %s\n", programs[i].name, match ? "ok" : "MISMATCH");
+#endif
+        failures += !match;
+    }
+    for (int engine = 0; engine < engine_count; engine++) {
+        destroy_cocomp(vms[engine]);
+    }
+    if (failures) {
+        printf("%d of %d programs differ between engines\n", failures, program_count);
+    }
+    return failures == 0;
+}
+#endif
+
+void print_memory(Cocomp *cocomp) {
+    printf("Memory contents:\n");
+    for (int i = 0; i < cocomp->memory_size; i++) {
+        printf("%02x ", cocomp->memory[i]);
+        if ((i + 1) % 16 == 0) {
+            printf("\n");
+        }
+    }
+    printf("\n");
+    printf("Heap contents:\n");
+    for (int i = 0; i < cocomp->heap_size; i++) {
+        printf("%02x ", cocomp->heap ? cocomp->heap->bytes[i] : 0);
+        if ((i + 1) % 16 == 0) {
+            printf("\n");
+        }
+    }
+    printf("\n");
+    printf("Accumulator: %lf\n", cocomp->accumulator);
+    printf("Stack Pointer: %d\n", cocomp->stack_pointer);
+    print_heap_stats(cocomp);
+}
+
+// The data stack is a run of 8-byte slots growing down from stack_limit;
+// stack_pointer is the address of the top slot, or stack_limit when empty.
+void push_stack(Cocomp *cocomp, double value) {
+    if (cocomp->stack_pointer - (int)sizeof(double) < cocomp->stack_base) {
+        report_error(cocomp, COCOMP_STACK_OVERFLOW, "Stack overflow!\n");
+        return;
+    }
+    cocomp->stack_pointer -= sizeof(double);
+    write_stack_slot(cocomp, cocomp->stack_pointer, value);
+}
+
+double pop_stack(Cocomp *cocomp) {
+    if (cocomp->stack_pointer >= cocomp->stack_limit) {
+        report_error(cocomp, COCOMP_STACK_UNDERFLOW, "Stack underflow!\n");
+        return 0;
+    }
+    double value = read_stack_slot(cocomp, cocomp->stack_pointer);
+    cocomp->stack_pointer += sizeof(double);
+    return value;
+}
+
+// Guest SEND and RECV move one message through the channel to or from
+// `process_id`. If it is full or empty, the thread waits in
+// THREAD_SENDING/THREAD_RECEIVING, and the interpreter leaves it on the
+// SYSCALL, to run again when the thread is next scheduled.
+static void ipc_syscall(Cocomp *cocomp, int process_id, int receive) {
+    IpcChannel *channel = ipc_channel(cocomp, process_id, receive);
+    cocomp->thread_states[cocomp->thread_id] = THREAD_READY;  // if this is a retry
+    if (!channel) {
+        return;
+    }
+    int moved = receive ? channel_receive(channel, &cocomp->accumulator, 1)
+                        : channel_send(channel, &cocomp->accumulator, 1);
+    if (!moved) {
+        cocomp->thread_states[cocomp->thread_id] = receive ? THREAD_RECEIVING : THREAD_SENDING;
+        cocomp->thread_join_targets[cocomp->thread_id] = process_id;
+        cocomp->reschedule = 1;
+    }
+}
+
+// Built-in syscalls. Each takes its argument from the accumulator and
+// leaves its result there.
+static void syscall_print(Cocomp *cocomp, int code) {
+    (void)code;
+    console_print(cocomp, "I/O Interrupt: Accumulator value = %lf\n", cocomp->accumulator);
+}
+
+// Accumulator = ID of a new thread starting at address (int)accumulator, or -1
+static void syscall_spawn(Cocomp *cocomp, int code) {
+    (void)code;
+    cocomp->accumulator = spawn_thread(cocomp, (int)cocomp->accumulator);
+}
+
+static void syscall_yield(Cocomp *cocomp, int code) {
+    (void)code;
+    cocomp->reschedule = 1;
+}
+
+// Block until thread (int)accumulator has finished
+static void syscall_join(Cocomp *cocomp, int code) {
+    (void)code;
+    int target = (int)cocomp->accumulator;
+    if (target >= 0 && target < cocomp->max_threads && target != cocomp->thread_id &&
+        (cocomp->thread_states[target] == THREAD_READY || cocomp->thread_states[target] == THREAD_BLOCKED)) {
+        cocomp->thread_states[cocomp->thread_id] = THREAD_BLOCKED;
+        cocomp->thread_join_targets[cocomp->thread_id] = target;
+        cocomp->reschedule = 1;
+    }
+}
+
+// Accumulator = heap address of (int)accumulator bytes from this thread's arena, or -1
+static void syscall_alloc(Cocomp *cocomp, int code) {
+    (void)code;
+    cocomp->accumulator = allocate_heap(cocomp, (int)cocomp->accumulator);
+}
+
+static void syscall_free(Cocomp *cocomp, int code) {
+    (void)code;
+    free_heap(cocomp, (int)cocomp->accumulator);
+}
+
+// Accumulator = this thread's arena mark
+static void syscall_mark(Cocomp *cocomp, int code) {
+    (void)code;
+    cocomp->accumulator = arena_mark(cocomp, cocomp->thread_id);
+}
+
+// Release this thread's arena to mark (int)accumulator
+static void syscall_release(Cocomp *cocomp, int code) {
+    (void)code;
+    arena_release(cocomp, cocomp->thread_id, (int)cocomp->accumulator);
+}
+
+// SEND accumulator to process code - IPC_SEND, waiting while the channel is full
+static void syscall_send(Cocomp *cocomp, int code) {
+    ipc_syscall(cocomp, code - IPC_SEND, 0);
+}
+
+// RECV: accumulator = next message from process code - IPC_RECEIVE
+static void syscall_receive(Cocomp *cocomp, int code) {
+    ipc_syscall(cocomp, code - IPC_RECEIVE, 1);
+}
+
+// Arguments of a file syscall, at the address in the accumulator
+static int file_arguments(Cocomp *cocomp, double *arguments, int count) {
+    int address = (int)cocomp->accumulator;
+    if (!mmu_read(cocomp, address, arguments, count * sizeof(double))) {
+        report_error(cocomp, COCOMP_INVALID_ADDRESS, "Invalid memory address %d\n", address);
+        cocomp->accumulator = -1;
+        return 0;
+    }
+    return 1;
+}
+
+// OPEN [name address, flags]: the name is NUL-terminated in guest memory
+static void syscall_open(Cocomp *cocomp, int code) {
+    (void)code;
+    double arguments[2];
+    char name[FS_NAME_LENGTH];
+    if (!file_arguments(cocomp, arguments, 2)) {
+        return;
+    }
+    int address = (int)arguments[0];
+    for (int i = 0; i < FS_NAME_LENGTH; i++) {
+        if (!mmu_read(cocomp, address + i, &name[i], 1)) {
+            report_error(cocomp, COCOMP_INVALID_ADDRESS, "Invalid memory address %d\n", address + i);
+            cocomp->accumulator = -1;
+            return;
+        }
+        if (!name[i]) {
+            cocomp->accumulator = fs_open(cocomp, name, (int)arguments[1]);
+            return;
+        }
+    }
+    report_error(cocomp, COCOMP_NO_FILE, "File name at %d is too long\n", address);
+    cocomp->accumulator = -1;
+}
+
+// READ or WRITE [descriptor, address, length]
+static void syscall_read_write(Cocomp *cocomp, int code) {
+    double arguments[3];
+    if (!file_arguments(cocomp, arguments, 3)) {
+        return;
+    }
+    if (code == FILE_READ) {
+        cocomp->accumulator = fs_read(cocomp, (int)arguments[0], (int)arguments[1], (long)arguments[2]);
+    } else {
+        cocomp->accumulator = fs_write(cocomp, (int)arguments[0], (int)arguments[1], (long)arguments[2]);
+    }
+}
+
+// SEEK [descriptor, offset, whence]
+static void syscall_seek(Cocomp *cocomp, int code) {
+    (void)code;
+    double arguments[3];
+    if (file_arguments(cocomp, arguments, 3)) {
+        cocomp->accumulator = fs_seek(cocomp, (int)arguments[0], (long)arguments[1], (int)arguments[2]);
+    }
+}
+
+static void syscall_close(Cocomp *cocomp, int code) {
+    (void)code;
+    cocomp->accumulator = fs_close(cocomp, (int)cocomp->accumulator);
+}
+
+#define EVERY_PROCESS(base, handler) \
+    [(base) + 0] = handler, [(base) + 1] = handler, [(base) + 2] = handler, [(base) + 3] = handler, \
+    [(base) + 4] = handler, [(base) + 5] = handler, [(base) + 6] = handler, [(base) + 7] = handler, \
+    [(base) + 8] = handler, [(base) + 9] = handler
+_Static_assert(IPC_MAILBOXES == 10, "EVERY_PROCESS covers one syscall per process");
+
+static SyscallHandler syscall_handlers[SYSCALL_COUNT] = {
+    [0x01] = syscall_print,
+    [0x02] = syscall_spawn,
+    [0x03] = syscall_yield,
+    [0x04] = syscall_join,
+    [0x05] = syscall_alloc,
+    [0x06] = syscall_free,
+    [0x07] = syscall_mark,
+    [0x08] = syscall_release,
+    EVERY_PROCESS(IPC_SEND, syscall_send),
+    EVERY_PROCESS(IPC_RECEIVE, syscall_receive),
+    [FILE_OPEN] = syscall_open,
+    [FILE_READ] = syscall_read_write,
+    [FILE_WRITE] = syscall_read_write,
+    [FILE_SEEK] = syscall_seek,
+    [FILE_CLOSE] = syscall_close,
+};
+
+void handle_interrupt(Cocomp *cocomp, int interrupt_code) {
+    SyscallHandler handler = NULL;
+    if (interrupt_code >= 0 && interrupt_code < SYSCALL_COUNT) {
+        handler = syscall_handlers[interrupt_code];
+    }
+    if (!handler) {
+        report_error(cocomp, COCOMP_UNKNOWN_SYSCALL, "Unknown interrupt code %02x\n", interrupt_code);
+        return;
+    }
+    handler(cocomp, interrupt_code);
+}
+
+// Make SYSCALL `code` run `handler` in every VM, or fail as unknown if it
+// is NULL. Handlers are shared by all host threads, so register them before
+// any VM runs. Returns the handler it replaces; NULL if there was none or
+// the code is out of range.
+SyscallHandler register_syscall(int code, SyscallHandler handler) {
+    if (code < 0 || code >= SYSCALL_COUNT) {
+        return NULL;
+    }
+    SyscallHandler previous = syscall_handlers[code];
+    syscall_handlers[code] = handler;
+    return previous;
+}
+
+// Back to a single guest thread (thread 0) on the main stack.
+void reset_threads(Cocomp *cocomp) {
+    cocomp->thread_id = 0;
+    cocomp->thread_count = 1; // Start with one thread
+    memset(cocomp->thread_stack_pointers, 0, cocomp->max_threads * sizeof(int));
+    memset(cocomp->thread_return_depths, 0, cocomp->max_threads * sizeof(int));
+    memset(cocomp->thread_flags, 0, cocomp->max_threads);
+    memset(cocomp->thread_instruction_pointers, 0, cocomp->max_threads * sizeof(int));
+    memset(cocomp->thread_accumulators, 0, cocomp->max_threads * sizeof(double));
+    memset(cocomp->thread_states, THREAD_FREE, cocomp->max_threads);
+    memset(cocomp->thread_join_targets, 0, cocomp->max_threads * sizeof(int));
+    cocomp->thread_states[0] = THREAD_READY;
+    cocomp->stack_base = cocomp->memory_size - cocomp->stack_size;
+    cocomp->stack_limit = cocomp->memory_size;
+    cocomp->return_depth = 0;
+    cocomp->flags = 0;
+    cocomp->reschedule = 0;
+    cocomp->context_switches = 0;
+    cocomp->parked = 0;
+}
+
+// Thread 0 owns the main stack area; spawned threads get THREAD_STACK_SIZE
+// bytes each directly below it.
+static int thread_stack_base(Cocomp *cocomp, int id) {
+    return cocomp->memory_size - cocomp->stack_size - id * THREAD_STACK_SIZE;
+}
+
+// Start a guest thread at `address` with its own stack region. Returns the
+// thread ID, or -1 if the address is invalid or every slot is in use.
+int spawn_thread(Cocomp *cocomp, int address) {
+    if (address < 0 || address >= cocomp->memory_size) {
+        report_error(cocomp, COCOMP_INVALID_ADDRESS, "Invalid memory address %d\n", address);
+        return -1;
+    }
+    for (int id = 1; id < cocomp->max_threads; id++) {
+        if (cocomp->thread_states[id] == THREAD_FREE || cocomp->thread_states[id] == THREAD_FINISHED) {
+            cocomp->thread_states[id] = THREAD_READY;
+            cocomp->thread_instruction_pointers[id] = address;
+            cocomp->thread_accumulators[id] = 0;
+            cocomp->thread_stack_pointers[id] = thread_stack_base(cocomp, id) + THREAD_STACK_SIZE;  // empty
+            cocomp->thread_return_depths[id] = 0;
+            cocomp->thread_flags[id] = 0;
+            cocomp->thread_count++;
+            return id;
+        }
+    }
+    report_error(cocomp, COCOMP_THREAD_LIMIT, "Thread limit reached!\n");
+    return -1;
+}
+
+// The running thread is parked in SEND or RECV
+int thread_waiting(Cocomp *cocomp) {
+    int state = cocomp->thread_states[cocomp->thread_id];
+    return state == THREAD_SENDING || state == THREAD_RECEIVING;
+}
+
+// A thread waiting on a channel can go once the channel has room or a
+// message. Another VM may take it first, and the thread waits again.
+static int channel_wait_over(Cocomp *cocomp, int id) {
+    int process_id = cocomp->thread_join_targets[id];
+    if (cocomp->thread_states[id] == THREAD_SENDING) {
+        return channel_has_room(cocomp->ipc->send_channels[process_id]);
+    }
+    return channel_has_message(cocomp->ipc->receive_channels[process_id]);
+}
+
+static void load_thread(Cocomp *cocomp, int next) {
+    cocomp->thread_id = next;
+    cocomp->instruction_pointer = cocomp->thread_instruction_pointers[next];
+    cocomp->accumulator = cocomp->thread_accumulators[next];
+    cocomp->stack_pointer = cocomp->thread_stack_pointers[next];
+    cocomp->stack_base = thread_stack_base(cocomp, next);
+    cocomp->stack_limit = next ? cocomp->stack_base + THREAD_STACK_SIZE : cocomp->memory_size;
+    cocomp->return_depth = cocomp->thread_return_depths[next];
+    cocomp->flags = cocomp->thread_flags[next];
+    cocomp->context_switches++;
+}
+
+// Save the running thread's registers and load the next ready thread, round
+// robin (the running thread itself comes last). Only the instruction
+// pointer, accumulator and stack registers move. Returns 0 if no thread is
+// ready. If threads are waiting on channels to other VMs, one of them is
+// loaded and the VM is parked: only another VM can wake it, so the
+// interpreter returns to the host, and the thread tries its SEND or RECV
+// again on the next call. A VM sending to or receiving from itself cannot.
+int schedule_thread(Cocomp *cocomp) {
+    int current = cocomp->thread_id;
+    int waiting = -1;
+    cocomp->thread_instruction_pointers[current] = cocomp->instruction_pointer;
+    cocomp->thread_accumulators[current] = cocomp->accumulator;
+    cocomp->thread_stack_pointers[current] = cocomp->stack_pointer;
+    cocomp->thread_return_depths[current] = cocomp->return_depth;
+    cocomp->thread_flags[current] = cocomp->flags;
+    cocomp->parked = 0;
+    for (int i = 1; i <= cocomp->max_threads; i++) {
+        int next = (current + i) % cocomp->max_threads;
+        int state = cocomp->thread_states[next];
+        if (state == THREAD_SENDING || state == THREAD_RECEIVING) {
+            if (!channel_wait_over(cocomp, next)) {
+                int process_id = cocomp->thread_join_targets[next];
+                if (waiting < 0 && cocomp->ipc->send_channels[process_id] != cocomp->ipc->receive_channels[process_id]) {
+                    waiting = next;
+                }
+                continue;
+            }
+            cocomp->thread_states[next] = state = THREAD_READY;
+        }
+        if (state != THREAD_READY) {
+            continue;
+        }
+        if (next != current) {
+            load_thread(cocomp, next);
+        }
+        return 1;
+    }
+    if (waiting >= 0) {
+        if (waiting != current) {
+            load_thread(cocomp, waiting);
+        }
+        cocomp->parked = 1;
+        return 0;
+    }
+    report_error(cocomp, COCOMP_DEADLOCK, "Deadlock: every thread is blocked\n");
+    return 0;
+}
+
+// The running thread has stopped (END, an unknown instruction or an
+// instruction pointer outside memory). Wakes its joiners and returns 1 if
+// another thread was loaded, 0 once the program as a whole is finished.
+int end_thread(Cocomp *cocomp) {
+    if (cocomp->thread_count <= 1) {
+        return 0;
+    }
+    int current = cocomp->thread_id;
+    cocomp->thread_states[current] = THREAD_FINISHED;
+    cocomp->thread_count--;
+    for (int id = 0; id < cocomp->max_threads; id++) {
+        if (cocomp->thread_states[id] == THREAD_BLOCKED && cocomp->thread_join_targets[id] == current) {
+            cocomp->thread_states[id] = THREAD_READY;
+        }
+    }
+    return schedule_thread(cocomp);
+}
+
+void reset_heap(Cocomp *cocomp) {
+    CocompHeap *heap = cocomp->heap;
+    if (!heap) {
+        return;  // created empty on first use
+    }
+    for (int i = 0; i < cocomp->max_threads; i++) {
+        HeapArena *arena = &heap->arenas[i];
+        arena->base = i * cocomp->heap_arena_size;
+        arena->used = 0;
+        arena->live_blocks = 0;
+        arena->dead_bytes = 0;
+        arena->high_water = 0;
+        arena->failures = 0;
+    }
+    memset(heap->bytes, 0, cocomp->heap_size);
+    memset(heap->sizes, 0, cocomp->heap_size * sizeof(int));
+    heap->pool_count = 0;
+}
+
+// Allocates from the running guest thread's arena. Returns the heap
+// address, or -1 if the arena is full.
+int allocate_heap(Cocomp *cocomp, int size) {
+    return arena_allocate(cocomp, cocomp->thread_id, size);
+}
+
+int arena_allocate(Cocomp *cocomp, int arena, int size) {
+    if (arena < 0 || arena >= cocomp->max_threads || size <= 0) {
+        report_error(cocomp, COCOMP_INVALID_HEAP_CALL, "Invalid heap allocation!\n");
+        return -1;
+    }
+    CocompHeap *heap = get_heap(cocomp);
+    if (!heap) {
+        return -1;
+    }
+    HeapArena *a = &heap->arenas[arena];
+    if (a->used + size > cocomp->heap_arena_size) {
+        a->failures++;
+        report_error(cocomp, COCOMP_HEAP_FULL, "Heap allocation failed: not enough space!\n");
+        return -1;
+    }
+    int address = a->base + a->used;
+    heap->sizes[address] = size;
+    a->used += size;
+    a->live_blocks++;
+    if (a->used > a->high_water) a->high_water = a->used;
+    return address;
+}
+
+// Pools whose block lies in [start, end) are gone along with it.
+static void drop_pools(CocompHeap *heap, int start, int end) {
+    for (int i = 0; i < heap->pool_count; i++) {
+        if (heap->pools[i].base >= start && heap->pools[i].base < end) {
+            heap->pools[i].base = -1;
+        }
+    }
+}
+
+// Frees exactly the block at `address`, whichever thread allocated it.
+void free_heap(Cocomp *cocomp, int address) {
+    CocompHeap *heap = get_heap(cocomp);
+    if (!heap) {
+        return;
+    }
+    if (address < 0 || address >= cocomp->heap_size || heap->sizes[address] <= 0) {
+        report_error(cocomp, COCOMP_INVALID_HEAP_CALL, "Invalid heap address!\n");
+        return;
+    }
+    int index = address / cocomp->heap_arena_size;
+    HeapArena *a = &heap->arenas[index];
+    int size = heap->sizes[address];
+    drop_pools(heap, address, address + size);
+    a->live_blocks--;
+    if (a->live_blocks == 0) {
+        heap->sizes[address] = -size;
+        a->dead_bytes += size;
+        arena_release(cocomp, index, 0);
+    } else if (address + size == a->base + a->used) {
+        heap->sizes[address] = 0;
+        a->used -= size;
+    } else {
+        heap->sizes[address] = -size;
+        a->dead_bytes += size;
+    }
+}
+
+// A mark records how much of an arena is in use; releasing to it frees
+// every block allocated since, live or not.
+int arena_mark(Cocomp *cocomp, int arena) {
+    CocompHeap *heap = get_heap(cocomp);
+    if (arena < 0 || arena >= cocomp->max_threads || !heap) {
+        return -1;
+    }
+    return heap->arenas[arena].used;
+}
+
+void arena_release(Cocomp *cocomp, int arena, int mark) {
+    CocompHeap *heap = get_heap(cocomp);
+    if (arena < 0 || arena >= cocomp->max_threads || mark < 0) {
+        report_error(cocomp, COCOMP_INVALID_HEAP_CALL, "Invalid arena release!\n");
+        return;
+    }
+    if (!heap) {
+        return;
+    }
+    HeapArena *a = &heap->arenas[arena];
+    int end = a->base + a->used;
+    int address = a->base + mark;
+    if (address >= end) {
+        return;
+    }
+    if (heap->sizes[address] == 0) {
+        // Blocks were freed below the mark and reused: start at the first
+        // block that begins at or after it
+        address = a->base;
+        while (address < a->base + mark) {
+            address += abs(heap->sizes[address]);
+        }
+    }
+    drop_pools(heap, address, end);
+    a->used = address - a->base;
+    while (address < end) {
+        int size = heap->sizes[address];
+        if (size > 0) {
+            a->live_blocks--;
+        } else {
+            size = -size;
+            a->dead_bytes -= size;
+        }
+        heap->sizes[address] = 0;
+        address += size;
+    }
+}
+
+// Creates a pool of `capacity` objects in the running thread's arena.
+// Returns its ID, or -1.
+int create_pool(Cocomp *cocomp, int object_size, int capacity) {
+    CocompHeap *heap = get_heap(cocomp);
+    if (!heap) {
+        return -1;
+    }
+    if (heap->pool_count >= MAX_POOLS || object_size < (int)sizeof(int) || capacity <= 0) {
+        report_error(cocomp, COCOMP_INVALID_HEAP_CALL, "Pool creation failed!\n");
+        return -1;
+    }
+    int base = allocate_heap(cocomp, object_size * capacity);
+    if (base < 0) {
+        return -1;
+    }
+    HeapPool *pool = &heap->pools[heap->pool_count];
+    pool->base = base;
+    pool->object_size = object_size;
+    pool->capacity = capacity;
+    pool->live = 0;
+    pool->high_water = 0;
+    for (int i = 0; i < capacity; i++) {
+        int next = i + 1 < capacity ? base + (i + 1) * object_size : -1;
+        memcpy(&heap->bytes[base + i * object_size], &next, sizeof(int));
+    }
+    pool->free_head = base;
+    return heap->pool_count++;
+}
+
+int pool_allocate(Cocomp *cocomp, int pool) {
+    CocompHeap *heap = get_heap(cocomp);
+    if (!heap) {
+        return -1;
+    }
+    if (pool < 0 || pool >= heap->pool_count || heap->pools[pool].base < 0) {
+        report_error(cocomp, COCOMP_INVALID_HEAP_CALL, "Invalid pool %d\n", pool);
+        return -1;
+    }
+    HeapPool *p = &heap->pools[pool];
+    if (p->free_head < 0) {
+        report_error(cocomp, COCOMP_HEAP_FULL, "Pool %d is full!\n", pool);
+        return -1;
+    }
+    int address = p->free_head;
+    memcpy(&p->free_head, &heap->bytes[address], sizeof(int));
+    p->live++;
+    if (p->live > p->high_water) p->high_water = p->live;
+    return address;
+}
+
+void pool_free(Cocomp *cocomp, int pool, int address) {
+    CocompHeap *heap = get_heap(cocomp);
+    if (!heap) {
+        return;
+    }
+    if (pool < 0 || pool >= heap->pool_count || heap->pools[pool].base < 0) {
+        report_error(cocomp, COCOMP_INVALID_HEAP_CALL, "Invalid pool %d\n", pool);
+        return;
+    }
+    HeapPool *p = &heap->pools[pool];
+    int offset = address - p->base;
+    if (offset < 0 || offset >= p->object_size * p->capacity || offset % p->object_size) {
+        report_error(cocomp, COCOMP_INVALID_HEAP_CALL, "Invalid pool address %d\n", address);
+        return;
+    }
+    memcpy(&heap->bytes[address], &p->free_head, sizeof(int));
+    p->free_head = address;
+    p->live--;
+}
+
+// Fragmentation is the share of an arena's used bytes held by dead blocks.
+void print_heap_stats(Cocomp *cocomp) {
+    CocompHeap *heap = get_heap(cocomp);
+    if (!heap) {
+        return;
+    }
+    printf("Heap Statistics:\n");
+    for (int i = 0; i < cocomp->max_threads; i++) {
+        HeapArena *a = &heap->arenas[i];
+        printf("Arena %d: %d/%d bytes used, %d live blocks, %.1f%% fragmented, high water %d, %ld failures\n",
+               i, a->used, cocomp->heap_arena_size, a->live_blocks, a->used ? 100.0 * a->dead_bytes / a->used : 0.0,
+               a->high_water, a->failures);
+    }
+    for (int i = 0; i < heap->pool_count; i++) {
+        HeapPool *p = &heap->pools[i];
+        if (p->base < 0) continue;
+        printf("Pool %d: %d-byte objects, %d/%d live, high water %d\n",
+               i, p->object_size, p->live, p->capacity, p->high_water);
+    }
+}
+
+void reset_mmu(Cocomp *cocomp) {
+    CocompPaging *paging = cocomp->paging;
+    if (!paging) {
+        return;
+    }
+    if (paging->swap && paging->swap_fd < 0) {
+        munmap(paging->swap, cocomp->virtual_pages * VM_PAGE_SIZE(cocomp));
+        paging->swap = NULL;
+    } else if (paging->swap) {
+        // Truncating the file zeroes it without touching every page
+        ftruncate(paging->swap_fd, 0);
+        ftruncate(paging->swap_fd, cocomp->virtual_pages * VM_PAGE_SIZE(cocomp));
+    }
+    paging->backing_store_used = 0;
+    paging->page_policy = PAGE_POLICY_CLOCK;
+    paging->page_seed = 1;
+    paging->mmu_clock = 0;
+    paging->swap_traffic = 0;
+    paging->swap_host_page = -1;
+    paging->swap_readahead_end = 0;
+    paging->tlb_hits = 0;
+    paging->tlb_misses = 0;
+    paging->page_faults = 0;
+    paging->page_evictions = 0;
+    paging->page_writebacks = 0;
+    paging->page_prefetches = 0;
+    reset_page_mapping(cocomp);
+}
+
+// Map virtual pages 0..num_frames-1 back onto the frames of the same number,
+// keeping their contents. Pages above stay in swap. Pinned frames stay
+// pinned, as they hold the same pages again.
+void reset_page_mapping(Cocomp *cocomp) {
+    CocompPaging *paging = cocomp->paging;
+    if (!paging) {
+        return;
+    }
+    if (paging->backing_store_used) {
+        for (int frame = 0; frame < cocomp->num_frames; frame++) {
+            long page = paging->frame_pages[frame];
+            if (page >= 0 && paging->frame_dirty[frame]) {
+                memcpy(&paging->swap[page * VM_PAGE_SIZE(cocomp)], &cocomp->memory[frame * VM_PAGE_SIZE(cocomp)], VM_PAGE_SIZE(cocomp));
+            }
+        }
+        memcpy(cocomp->memory, paging->swap, cocomp->memory_size);
+        invalidate_decoded(cocomp, 0, cocomp->memory_size);
+        paging->backing_store_used = 0;
+    }
+    // Only tables with resident pages are allocated
+    for (int frame = 0; frame < cocomp->num_frames; frame++) {
+        long page = paging->frame_pages[frame];
+        if (page >= 0) {
+            PageDirectoryEntry *entry = &paging->page_directory[page / PAGE_TABLE_ENTRIES];
+            if (entry->table != paging->first_page_table) free(entry->table);
+            entry->table = NULL;
+            entry->resident = 0;
+        }
+    }
+    PageDirectoryEntry *first = &paging->page_directory[0];
+    first->table = paging->first_page_table;
+    first->resident = 0;
+    memset(first->table, INVALID_PAGE, PAGE_TABLE_ENTRIES);
+    for (int frame = 0; frame < cocomp->num_frames; frame++) {
+        first->table[frame] = frame;
+        first->resident++;
+        paging->frame_pages[frame] = frame;
+        paging->frame_referenced[frame] = 0;
+        paging->frame_dirty[frame] = 1;  // not in swap yet
+        paging->frame_last_use[frame] = 0;
+    }
+    for (int i = 0; i < TLB_ENTRIES; i++) {
+        paging->tlb[i].page = -1;
+    }
+    paging->clock_hand = 0;
+    paging->next_sequential_page = -1;
+    paging->sequential_faults = 0;
+}
+
+// Give the VM an address space of `size` bytes (rounded up to whole pages)
+// kept in the file at `path`, or in an unlinked temporary file if `path` is
+// NULL. Memory keeps virtual pages 0..num_frames-1; the rest of the old
+// address space is dropped. Returns 1, or 0 if the file cannot be mapped.
+int open_swap(Cocomp *cocomp, const char *path, long size) {
+    size = (size + VM_PAGE_SIZE(cocomp) - 1) / VM_PAGE_SIZE(cocomp) * VM_PAGE_SIZE(cocomp);
+    if (size < cocomp->memory_size || size > MAX_VIRTUAL_SIZE) {
+        printf("Invalid address space size %ld\n", size);
+        return 0;
+    }
+    int fd;
+    if (path) {
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    } else {
+        char name[] = "/tmp/cocomp-swap-XXXXXX";
+        fd = mkstemp(name);
+        if (fd >= 0) unlink(name);
+    }
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+        printf("Cannot create swap file %s\n", path ? path : "in /tmp");
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    unsigned char *swap = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (swap == MAP_FAILED) {
+        printf("Cannot map swap file %s\n", path ? path : "in /tmp");
+        close(fd);
+        return 0;
+    }
+    // Guest pages are much smaller than the host's, so the kernel's own
+    // readahead mostly fetches pages nobody asked for. Sequential faults
+    // ask for it explicitly instead.
+    madvise(swap, size, MADV_RANDOM);
+    CocompPaging *paging = get_paging(cocomp);
+    long tables = (size / VM_PAGE_SIZE(cocomp) + PAGE_TABLE_ENTRIES - 1) / PAGE_TABLE_ENTRIES;
+    PageDirectoryEntry *directory = calloc(tables, sizeof(PageDirectoryEntry));
+    if (!paging || !directory) {
+        printf("Cannot allocate a page directory for %ld pages\n", size / VM_PAGE_SIZE(cocomp));
+        free(directory);
+        munmap(swap, size);
+        close(fd);
+        return 0;
+    }
+
+    reset_page_mapping(cocomp);
+    close_swap(cocomp);
+    directory[0] = paging->first_directory_entry;
+    paging->page_directory = directory;
+    paging->swap = swap;
+    paging->swap_fd = fd;
+    cocomp->virtual_pages = size / VM_PAGE_SIZE(cocomp);
+    return 1;
+}
+
+// Go back to the default address space in anonymous memory. Pages above
+// num_frames are lost.
+void close_swap(Cocomp *cocomp) {
+    CocompPaging *paging = cocomp->paging;
+    if (!paging) {
+        return;
+    }
+    reset_page_mapping(cocomp);
+    if (paging->page_directory != &paging->first_directory_entry) {
+        paging->first_directory_entry = paging->page_directory[0];
+        free(paging->page_directory);
+        paging->page_directory = &paging->first_directory_entry;
+    }
+    if (paging->swap) {
+        munmap(paging->swap, cocomp->virtual_pages * VM_PAGE_SIZE(cocomp));
+        if (paging->swap_fd >= 0) close(paging->swap_fd);
+    }
+    paging->swap = NULL;
+    paging->swap_fd = -1;
+    cocomp->virtual_pages = default_virtual_pages(cocomp);
+    paging->swap_traffic = 0;
+    paging->swap_host_page = -1;
+    paging->swap_readahead_end = 0;
+    for (int i = 0; i < TLB_ENTRIES; i++) {
+        paging->tlb[i].page = -1;
+    }
+}
+
+// Limit the VM to `frames` frames of memory. Pages beyond the limit are
+// evicted as the next faults need frames.
+void set_resident_frames(Cocomp *cocomp, int frames) {
+    if (frames < 1 || frames > cocomp->num_frames) {
+        printf("Resident set must be 1 to %d frames\n", cocomp->num_frames);
+        return;
+    }
+    CocompPaging *paging = get_paging(cocomp);
+    if (!paging) {
+        return;
+    }
+    paging->resident_frames = frames;
+}
+
+// Physical address of virtual `address`, or -1 if its page is not resident
+// and no frame can be freed for it. A TLB hit skips the directory and
+// page table.
+static int mmu_translate(Cocomp *cocomp, int address, int write) {
+    CocompPaging *paging = cocomp->paging;
+    int page = address >> VM_PAGE_SHIFT(cocomp);
+    TlbEntry *entry = &paging->tlb[page % TLB_ENTRIES];
+    int frame;
+    if (entry->page == page) {
+        paging->tlb_hits++;
+        frame = entry->frame;
+    } else {
+        paging->tlb_misses++;
+        PageDirectoryEntry *directory = &paging->page_directory[page / PAGE_TABLE_ENTRIES];
+        frame = INVALID_PAGE;
+        if (directory->resident > 0) {
+            frame = directory->table[page % PAGE_TABLE_ENTRIES];
+        }
+        if (frame == INVALID_PAGE) {
+            frame = page_fault(cocomp, page);
+            if (frame < 0) return -1;
+        }
+        entry->page = page;
+        entry->frame = frame;
+    }
+    paging->frame_referenced[frame] = 1;
+    paging->frame_last_use[frame] = ++paging->mmu_clock;
+    paging->frame_dirty[frame] |= write;
+    return frame * VM_PAGE_SIZE(cocomp) + (address & (VM_PAGE_SIZE(cocomp) - 1));
+}
+
+// Copy `length` bytes between guest virtual memory and `data`, a page at a
+// time. Returns 0 if the range is outside the address space or a page could
+// not be brought in. Until something needs paging, virtual addresses below
+// memory_size are physical ones and skip the MMU.
+int mmu_read(Cocomp *cocomp, int address, void *data, int length) {
+    unsigned char *bytes = data;
+    if (address < 0 || address > cocomp->virtual_pages * VM_PAGE_SIZE(cocomp) - length) {
+        return 0;
+    }
+    if (!cocomp->paging && address <= cocomp->memory_size - length) {
+        if (length == sizeof(double)) {
+            memcpy(data, &cocomp->memory[address], sizeof(double));
+        } else {
+            memcpy(data, &cocomp->memory[address], length);
+        }
+        return 1;
+    }
+    if (!get_paging(cocomp)) {
+        return 0;
+    }
+    if (length == sizeof(double) && (address & (VM_PAGE_SIZE(cocomp) - 1)) <= VM_PAGE_SIZE(cocomp) - (int)sizeof(double)) {
+        // stack slots and STOREs: one page, and a fixed-size copy
+        int physical = mmu_translate(cocomp, address, 0);
+        if (physical < 0) return 0;
+        memcpy(data, &cocomp->memory[physical], sizeof(double));
+        return 1;
+    }
+    while (length > 0) {
+        int chunk = VM_PAGE_SIZE(cocomp) - (address & (VM_PAGE_SIZE(cocomp) - 1));
+        if (chunk > length) chunk = length;
+        int physical = mmu_translate(cocomp, address, 0);
+        if (physical < 0) return 0;
+        memcpy(bytes, &cocomp->memory[physical], chunk);
+        address += chunk;
+        bytes += chunk;
+        length -= chunk;
+    }
+    return 1;
+}
+
+int mmu_write(Cocomp *cocomp, int address, const void *data, int length) {
+    const unsigned char *bytes = data;
+    if (address < 0 || address > cocomp->virtual_pages * VM_PAGE_SIZE(cocomp) - length) {
+        return 0;
+    }
+    if (!cocomp->paging && address <= cocomp->memory_size - length) {
+        if (length == sizeof(double)) {
+            memcpy(&cocomp->memory[address], data, sizeof(double));
+        } else {
+            memcpy(&cocomp->memory[address], data, length);
+        }
+        invalidate_decoded(cocomp, address, length);
+        return 1;
+    }
+    if (!get_paging(cocomp)) {
+        return 0;
+    }
+    if (length == sizeof(double) && (address & (VM_PAGE_SIZE(cocomp) - 1)) <= VM_PAGE_SIZE(cocomp) - (int)sizeof(double)) {
+        int physical = mmu_translate(cocomp, address, 1);
+        if (physical < 0) return 0;
+        memcpy(&cocomp->memory[physical], data, sizeof(double));
+        invalidate_decoded(cocomp, physical, sizeof(double));
+        return 1;
+    }
+    while (length > 0) {
+        int chunk = VM_PAGE_SIZE(cocomp) - (address & (VM_PAGE_SIZE(cocomp) - 1));
+        if (chunk > length) chunk = length;
+        int physical = mmu_translate(cocomp, address, 1);
+        if (physical < 0) return 0;
+        memcpy(&cocomp->memory[physical], bytes, chunk);
+        invalidate_decoded(cocomp, physical, chunk);
+        address += chunk;
+        bytes += chunk;
+        length -= chunk;
+    }
+    return 1;
+}
+
+// Frame to evict under page_policy, or -1 if every page in memory is pinned.
+static int choose_victim(Cocomp *cocomp) {
+    CocompPaging *paging = cocomp->paging;
+    int evictable = 0;
+    for (int frame = 0; frame < cocomp->num_frames; frame++) {
+        evictable += paging->frame_pages[frame] >= 0 && !paging->frame_pinned[frame];
+    }
+    if (evictable == 0) {
+        return -1;
+    }
+    switch (paging->page_policy) {
+        case PAGE_POLICY_LRU:
+            {
+                int victim = -1;
+                for (int frame = 0; frame < cocomp->num_frames; frame++) {
+                    if (paging->frame_pages[frame] >= 0 && !paging->frame_pinned[frame] &&
+                        (victim < 0 || paging->frame_last_use[frame] < paging->frame_last_use[victim])) {
+                        victim = frame;
+                    }
+                }
+                return victim;
+            }
+        case PAGE_POLICY_RANDOM:
+            for (;;) {
+                paging->page_seed = paging->page_seed * 1103515245 + 12345;
+                int frame = (paging->page_seed >> 16) % cocomp->num_frames;
+                if (paging->frame_pages[frame] >= 0 && !paging->frame_pinned[frame]) return frame;
+            }
+        default:  // clock: skip referenced frames once, clearing their bit
+            for (;;) {
+                int frame = paging->clock_hand;
+                paging->clock_hand = (paging->clock_hand + 1) % cocomp->num_frames;
+                if (paging->frame_pages[frame] < 0 || paging->frame_pinned[frame]) continue;
+                if (paging->frame_referenced[frame]) {
+                    paging->frame_referenced[frame] = 0;
+                    continue;
+                }
+                return frame;
+            }
     }
 }
 
-void print_memory(Cocomp *cocomp) {
-    printf("Memory contents:\n");
-    for (int i = 0; i < MEMORY_SIZE; i++) {
-        printf("%02x ", cocomp->memory[i]);
-        if ((i + 1) % 16 == 0) {
-            printf("\n");
-        }
+// Count swap traffic for a copy to or from `page`. The host maps swap a
+// whole host page at a time, so traffic is counted in host pages: a guest
+// page in a host page that was not the last one touched counts the host
+// page. Every SWAP_TRIM_BYTES the host mappings of a swap file are
+// dropped; the file keeps the data, and the VM's resident set stops
+// growing with the address space it touches.
+static void swap_accessed(Cocomp *cocomp, int page) {
+    CocompPaging *paging = cocomp->paging;
+    long host_page_size = sysconf(_SC_PAGESIZE);
+    long host_page = (long)page * VM_PAGE_SIZE(cocomp) / host_page_size;
+    if (host_page != paging->swap_host_page) {
+        paging->swap_host_page = host_page;
+        paging->swap_traffic += host_page_size > VM_PAGE_SIZE(cocomp) ? host_page_size : VM_PAGE_SIZE(cocomp);
     }
-    printf("\n");
-    printf("Heap contents:\n");
-    for (int i = 0; i < HEAP_SIZE; i++) {
-        printf("%02x ", cocomp->heap[i]);
-        if ((i + 1) % 16 == 0) {
-            printf("\n");
-        }
+    if (paging->swap_fd >= 0 && paging->swap_traffic >= SWAP_TRIM_BYTES) {
+        madvise(paging->swap, cocomp->virtual_pages * VM_PAGE_SIZE(cocomp), MADV_DONTNEED);
+        paging->swap_traffic = 0;
+        paging->swap_host_page = -1;
+        paging->swap_readahead_end = 0;
     }
-    printf("\n");
-    printf("Accumulator: %lf\n", cocomp->accumulator);
-    printf("Stack Pointer: %d\n", cocomp->stack_pointer);
-    printf("Heap Pointer: %d\n", cocomp->heap_pointer);
 }
 
-void push_stack(Cocomp *cocomp, double value) {
-    if (cocomp->stack_pointer <= MEMORY_SIZE - STACK_SIZE) {
-        printf("Stack overflow!\n");
-        return;
+static void evict_frame(Cocomp *cocomp, int frame) {
+    CocompPaging *paging = cocomp->paging;
+    int page = paging->frame_pages[frame];
+    PageDirectoryEntry *directory = &paging->page_directory[page / PAGE_TABLE_ENTRIES];
+    if (paging->frame_dirty[frame]) {
+        memcpy(&paging->swap[(long)page * VM_PAGE_SIZE(cocomp)], &cocomp->memory[frame * VM_PAGE_SIZE(cocomp)], VM_PAGE_SIZE(cocomp));
+        paging->page_writebacks++;
+        swap_accessed(cocomp, page);
+    }
+    directory->table[page % PAGE_TABLE_ENTRIES] = INVALID_PAGE;
+    if (--directory->resident == 0 && directory->table != paging->first_page_table) {
+        free(directory->table);
+        directory->table = NULL;
     }
-    *(double*)&cocomp->memory[--cocomp->stack_pointer] = value;
+    if (paging->tlb[page % TLB_ENTRIES].page == page) {
+        paging->tlb[page % TLB_ENTRIES].page = -1;
+    }
+    paging->frame_pages[frame] = -1;
+    paging->page_evictions++;
+    paging->backing_store_used = 1;
 }
 
-double pop_stack(Cocomp *cocomp) {
-    if (cocomp->stack_pointer >= MEMORY_SIZE) {
-        printf("Stack underflow!\n");
-        return 0;
+// Copy `page` from swap into a frame, evicting pages while the VM is at its
+// resident limit. Returns the frame, or -1.
+static int page_in(Cocomp *cocomp, int page) {
+    CocompPaging *paging = cocomp->paging;
+    PageDirectoryEntry *directory = &paging->page_directory[page / PAGE_TABLE_ENTRIES];
+    int frame = -1;
+    int resident = 0;
+    for (int i = 0; i < cocomp->num_frames; i++) {
+        if (paging->frame_pages[i] >= 0) resident++;
+        else if (frame < 0) frame = i;
+    }
+    while (frame < 0 || resident >= paging->resident_frames) {
+        int victim = choose_victim(cocomp);
+        if (victim < 0) return -1;
+        evict_frame(cocomp, victim);
+        frame = victim;
+        resident--;
+    }
+    if (!directory->table) {
+        directory->table = malloc(PAGE_TABLE_ENTRIES);
+        if (!directory->table) return -1;
+        memset(directory->table, INVALID_PAGE, PAGE_TABLE_ENTRIES);
     }
-    return *(double*)&cocomp->memory[cocomp->stack_pointer++];
+    long offset = (long)page * VM_PAGE_SIZE(cocomp);
+    unsigned char *target = &cocomp->memory[frame * VM_PAGE_SIZE(cocomp)];
+    // A fault away from a scan reads a swap file directly: copying from the
+    // mapping would map a whole host page, and the host maps its neighbours
+    // with it.
+    if (paging->swap_fd < 0 || page == paging->next_sequential_page ||
+        pread(paging->swap_fd, target, VM_PAGE_SIZE(cocomp), offset) != VM_PAGE_SIZE(cocomp)) {
+        memcpy(target, &paging->swap[offset], VM_PAGE_SIZE(cocomp));
+        swap_accessed(cocomp, page);
+    }
+    invalidate_decoded(cocomp, frame * VM_PAGE_SIZE(cocomp), VM_PAGE_SIZE(cocomp));
+    directory->table[page % PAGE_TABLE_ENTRIES] = frame;
+    directory->resident++;
+    paging->frame_pages[frame] = page;
+    paging->frame_referenced[frame] = 1;
+    paging->frame_dirty[frame] = 0;
+    paging->frame_last_use[frame] = paging->mmu_clock;
+    return frame;
 }
 
-void handle_interrupt(Cocomp *cocomp, int interrupt_code) {
-    switch (interrupt_code) {
-        case 0x01:  // Example: Print accumulator value
-            printf("I/O Interrupt: Accumulator value = %lf\n", cocomp->accumulator);
-            break;
-        default:
-            printf("Unknown interrupt code %02x\n", interrupt_code);
+// A scan that keeps faulting on the next page has the following pages read
+// in with the faulting one, and the host is asked to read the swap file
+// ahead of it.
+static void prefetch_pages(Cocomp *cocomp, int page, int frame) {
+    CocompPaging *paging = cocomp->paging;
+    int count = (paging->resident_frames - paging->pinned_frames) / 2;
+    if (count > SWAP_PREFETCH_PAGES) count = SWAP_PREFETCH_PAGES;
+    paging->frame_pinned[frame] = 1;  // keep the faulting page while making room
+    paging->pinned_frames++;
+    for (int i = 1; i <= count && page + i < cocomp->virtual_pages; i++) {
+        PageDirectoryEntry *directory = &paging->page_directory[(page + i) / PAGE_TABLE_ENTRIES];
+        if (directory->resident > 0 && directory->table[(page + i) % PAGE_TABLE_ENTRIES] != INVALID_PAGE) {
             break;
+        }
+        int prefetched = page_in(cocomp, page + i);
+        if (prefetched < 0) break;
+        paging->frame_referenced[prefetched] = 0;  // first to go if the scan stops here
+        paging->page_prefetches++;
+        paging->next_sequential_page = page + i + 1;
+    }
+    paging->frame_pinned[frame] = 0;
+    paging->pinned_frames--;
+
+    long next = (long)paging->next_sequential_page * VM_PAGE_SIZE(cocomp);
+    if (paging->swap_fd >= 0 && next + SWAP_READAHEAD > paging->swap_readahead_end) {
+        long start = next / SWAP_READAHEAD * SWAP_READAHEAD;
+        long end = start + 2 * SWAP_READAHEAD;
+        if (end > cocomp->virtual_pages * VM_PAGE_SIZE(cocomp)) end = cocomp->virtual_pages * VM_PAGE_SIZE(cocomp);
+        if (start < end) madvise(paging->swap + start, end - start, MADV_WILLNEED);
+        paging->swap_readahead_end = end;
     }
 }
 
-void allocate_heap(Cocomp *cocomp, int size) {
-    if (cocomp->heap_pointer + size > HEAP_SIZE) {
-        printf("Heap allocation failed: not enough space!\n");
-        return;
+// The default address space gets its swap on the first fault, or the
+// first READ mapped into it. NULL if it cannot be mapped.
+static unsigned char *get_swap(Cocomp *cocomp) {
+    CocompPaging *paging = cocomp->paging;
+    if (!paging->swap) {
+        void *swap = mmap(NULL, cocomp->virtual_pages * VM_PAGE_SIZE(cocomp), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (swap == MAP_FAILED) {
+            report_error(cocomp, COCOMP_NO_MEMORY, "Cannot allocate swap\n");
+            return NULL;
+        }
+        paging->swap = swap;
     }
-    cocomp->heap_pointer += size;
+    return paging->swap;
 }
 
-void free_heap(Cocomp *cocomp, int address) {
-    if (address >= 0 && address < HEAP_SIZE) {
-        cocomp->heap_pointer = address;
+// Bring virtual `page` into a frame. Returns the frame, or -1.
+int page_fault(Cocomp *cocomp, int page) {
+    CocompPaging *paging = cocomp->paging;
+    paging->page_faults++;
+    if (!get_swap(cocomp)) {
+        return -1;
+    }
+    int frame = page_in(cocomp, page);
+    if (frame < 0) {
+        report_error(cocomp, COCOMP_NO_MEMORY, "No page frame available for address %ld\n", (long)page * VM_PAGE_SIZE(cocomp));
+        return -1;
+    }
+    if (page == paging->next_sequential_page) {
+        paging->sequential_faults++;
     } else {
-        printf("Invalid heap address!\n");
+        paging->sequential_faults = 0;
     }
+    paging->next_sequential_page = page + 1;
+    if (paging->sequential_faults >= 2) {
+        prefetch_pages(cocomp, page, frame);
+    }
+    return frame;
 }
 
+// Touch `address` through the MMU, reporting a fault if it takes one
 void simulate_page_fault(Cocomp *cocomp, int address) {
-    int page_number = address / PAGE_SIZE;
-    if (cocomp->page_table[page_number] == INVALID_PAGE) {
-        printf("Page fault at address %d!\n", address);
-        cocomp->page_table[page_number] = page_number;  // Example handling
+    if (address < 0 || address >= cocomp->virtual_pages * VM_PAGE_SIZE(cocomp)) {
+        report_error(cocomp, COCOMP_INVALID_ADDRESS, "Invalid memory address %d\n", address);
+        return;
     }
+    CocompPaging *paging = get_paging(cocomp);
+    if (!paging) {
+        return;
+    }
+    long faults = paging->page_faults;
+    mmu_translate(cocomp, address, 0);
+    if (paging->page_faults != faults) {
+        console_print(cocomp, "Page fault at address %d!\n", address);
+    }
+}
+
+void print_mmu_stats(Cocomp *cocomp) {
+    static const char *policies[] = {"clock", "LRU", "random"};
+    CocompPaging *paging = get_paging(cocomp);
+    if (!paging) {
+        return;
+    }
+    long lookups = paging->tlb_hits + paging->tlb_misses;
+    printf("MMU Statistics (%ld KB address space in %s swap, %s replacement, %d of %d frames resident, %d pinned):\n",
+           cocomp->virtual_pages * VM_PAGE_SIZE(cocomp) / 1024, paging->swap_fd >= 0 ? "file" : "anonymous",
+           policies[paging->page_policy], paging->resident_frames, cocomp->num_frames, paging->pinned_frames);
+    printf("TLB: %ld hits, %ld misses (%.1f%% hit rate)\n", paging->tlb_hits, paging->tlb_misses,
+           lookups ? 100.0 * paging->tlb_hits / lookups : 0.0);
+    printf("Page faults: %ld, prefetches: %ld, evictions: %ld, writebacks: %ld\n",
+           paging->page_faults, paging->page_prefetches, paging->page_evictions, paging->page_writebacks);
 }
 
 void print_debug_info(Cocomp *cocomp) {
@@ -367,18 +7923,31 @@ void print_debug_info(Cocomp *cocomp) {
     printf("Instruction Pointer: %d\n", cocomp->instruction_pointer);
     printf("Accumulator: %lf\n", cocomp->accumulator);
     printf("Stack Pointer: %d\n", cocomp->stack_pointer);
-    printf("Heap Pointer: %d\n", cocomp->heap_pointer);
+    int heap_used = 0;
+    for (int i = 0; cocomp->heap && i < cocomp->max_threads; i++) {
+        heap_used += cocomp->heap->arenas[i].used;
+    }
+    printf("Heap Used: %d\n", heap_used);
     printf("Process ID: %d\n", cocomp->process_id);
     printf("Task ID: %d\n", cocomp->task_id);
     printf("Thread ID: %d\n", cocomp->thread_id);
     printf("Thread Count: %d\n", cocomp->thread_count);
-    printf("Page Table:\n");
-    for (int i = 0; i < NUM_PAGES; i++) {
-        printf("Page %d: %d\n", i, cocomp->page_table[i]);
+    CocompPaging *paging = get_paging(cocomp);
+    if (!paging) {
+        return;
+    }
+    printf("Page Table (resident pages):\n");
+    for (int frame = 0; frame < cocomp->num_frames; frame++) {
+        int page = paging->frame_pages[frame];
+        if (page >= 0) {
+            printf("Page %d: %d\n", page, paging->page_directory[page / PAGE_TABLE_ENTRIES].table[page % PAGE_TABLE_ENTRIES]);
+        }
     }
-    printf("Page Directory:\n");
-    for (int i = 0; i < NUM_PAGES; i++) {
-        printf("Directory %d: %d\n", i, cocomp->page_directory[i]);
+    printf("Page Directory (tables with resident pages):\n");
+    for (int i = 0; i < (cocomp->virtual_pages + PAGE_TABLE_ENTRIES - 1) / PAGE_TABLE_ENTRIES; i++) {
+        if (paging->page_directory[i].resident > 0) {
+            printf("Directory %d: %d\n", i, paging->page_directory[i].resident);
+        }
     }
 }
 
@@ -391,27 +7960,436 @@ void process_management(Cocomp *cocomp, int num_processes) {
 }
 
 void thread_management(Cocomp *cocomp, int num_threads) {
-    cocomp->thread_count = num_threads;
+    static const char *states[] = {"free", "ready", "blocked", "finished", "sending", "receiving"};
     printf("Managing %d threads\n", num_threads);
-    // Example: Simulate thread management
-    for (int i = 0; i < num_threads; i++) {
-        printf("Thread %d: ID = %d, Stack Pointer = %d\n", i, cocomp->thread_id + i, cocomp->thread_stack_pointers[i]);
+    for (int i = 0; i < num_threads && i < cocomp->max_threads; i++) {
+        int stack_pointer = i == cocomp->thread_id ? cocomp->stack_pointer : cocomp->thread_stack_pointers[i];
+        printf("Thread %d: ID = %d, State = %s, Stack Pointer = %d\n", i, i, states[cocomp->thread_states[i]], stack_pointer);
     }
 }
 
 void paging_management(Cocomp *cocomp) {
     printf("Paging management\n");
-    // Example: Simulate paging management
-    for (int i = 0; i < NUM_PAGES; i++) {
-        if (cocomp->page_table[i] == INVALID_PAGE) {
-            printf("Page %d is invalid\n", i);
+    CocompPaging *paging = get_paging(cocomp);
+    if (!paging) {
+        return;
+    }
+    for (int frame = 0; frame < cocomp->num_frames; frame++) {
+        if (paging->frame_pages[frame] < 0) {
+            printf("Frame %d is free\n", frame);
+        } else {
+            printf("Frame %d: page %d%s%s\n", frame, paging->frame_pages[frame],
+                   paging->frame_pinned[frame] ? ", pinned" : "", paging->frame_dirty[frame] ? ", dirty" : "");
         }
     }
+    print_mmu_stats(cocomp);
 }
 
 void file_system_operations(Cocomp *cocomp) {
     printf("File system operations\n");
-    // Example: Simulate file system operations
+    CocompFiles *files = cocomp->files;
+    if (!files) {
+        return;
+    }
+    FsHeader *header = files->fs->header;
+    for (int i = 0; i < FS_MAX_FILES; i++) {
+        FsEntry *entry = &header->entries[i];
+        if (entry->name[0]) {
+            printf("File %s: %ld of %ld bytes\n", entry->name, entry->size, entry->blocks * FS_BLOCK_SIZE);
+        }
+    }
+    int open = 0;
+    for (int fd = 0; fd < FS_MAX_OPEN; fd++) {
+        open += files->files[fd].entry >= 0;
+    }
+    printf("%d open files, %ld of %ld blocks used, %ld pages read by mapping, %ld bytes read by copying\n", open,
+           header->next_block, header->block_count, files->zero_copy_pages, files->copied_bytes);
+}
+
+static CocompFs *map_fs(int fd, size_t size, const char *path) {
+    FsHeader *header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        printf("Cannot map file system image %s\n", path ? path : "in /tmp");
+        close(fd);
+        return NULL;
+    }
+    CocompFs *fs = allocate_component(sizeof(CocompFs), "a file system");
+    if (!fs) {
+        munmap(header, size);
+        close(fd);
+        return NULL;
+    }
+    // Sequential readers ask for readahead themselves, as the swap does
+    madvise(header, size, MADV_RANDOM);
+    fs->header = header;
+    fs->size = size;
+    fs->fd = fd;
+    pthread_mutex_init(&fs->lock, NULL);
+    atomic_init(&fs->references, 1);
+    return fs;
+}
+
+static long fs_header_blocks(void) {
+    return (sizeof(FsHeader) + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+}
+
+// A new, empty image of `size` bytes (rounded up to whole blocks) in the
+// file at `path`, or in an unlinked temporary file if `path` is NULL. The
+// caller holds one reference. NULL if the image cannot be created.
+CocompFs *create_fs(const char *path, long size) {
+    size = (size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE * FS_BLOCK_SIZE;
+    if (size <= fs_header_blocks() * FS_BLOCK_SIZE || FS_BLOCK_SIZE % sysconf(_SC_PAGESIZE) != 0) {
+        printf("Invalid file system size %ld\n", size);
+        return NULL;
+    }
+    int fd;
+    if (path) {
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    } else {
+        char name[] = "/tmp/cocomp-fs-XXXXXX";
+        fd = mkstemp(name);
+        if (fd >= 0) unlink(name);
+    }
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+        printf("Cannot create file system image %s\n", path ? path : "in /tmp");
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    CocompFs *fs = map_fs(fd, size, path);
+    if (!fs) {
+        return NULL;
+    }
+    FsHeader *header = fs->header;
+    memcpy(header->magic, FS_MAGIC, sizeof(header->magic));
+    header->version = FS_VERSION;
+    header->block_size = FS_BLOCK_SIZE;
+    header->block_count = size / FS_BLOCK_SIZE;
+    header->next_block = fs_header_blocks();
+    return fs;
+}
+
+// The image at `path`, as create_fs left it. NULL if it is not one.
+CocompFs *open_fs(const char *path) {
+    int fd = open(path, O_RDWR);
+    off_t size = fd >= 0 ? lseek(fd, 0, SEEK_END) : -1;
+    if (size < (off_t)sizeof(FsHeader)) {
+        printf("Cannot open file system image %s\n", path);
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    CocompFs *fs = map_fs(fd, size, path);
+    if (!fs) {
+        return NULL;
+    }
+    FsHeader *header = fs->header;
+    if (memcmp(header->magic, FS_MAGIC, sizeof(header->magic)) != 0 || header->version != FS_VERSION ||
+        header->block_size != FS_BLOCK_SIZE || header->block_count * FS_BLOCK_SIZE > size ||
+        header->next_block > header->block_count) {
+        printf("%s is not a file system image\n", path);
+        release_fs(fs);
+        return NULL;
+    }
+    return fs;
+}
+
+// Give up a reference. The image is unmapped, with everything written to
+// it kept in the file, once the last VM has unmounted it.
+void release_fs(CocompFs *fs) {
+    if (!fs || atomic_fetch_sub(&fs->references, 1) != 1) {
+        return;
+    }
+    munmap(fs->header, fs->size);
+    close(fs->fd);
+    pthread_mutex_destroy(&fs->lock);
+    free(fs);
+}
+
+// Directory entry of `name`, or -1. The caller holds fs->lock.
+static int fs_lookup(CocompFs *fs, const char *name) {
+    for (int i = 0; name[0] && i < FS_MAX_FILES; i++) {
+        if (strncmp(fs->header->entries[i].name, name, FS_NAME_LENGTH) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Reserve `bytes` after the last file for a new, empty file. Returns its
+// entry, or -1 if the name is too long or the image is full. The caller
+// holds fs->lock.
+static int fs_reserve(CocompFs *fs, const char *name, long bytes) {
+    FsHeader *header = fs->header;
+    long blocks = (bytes + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    if (!name[0] || strlen(name) >= FS_NAME_LENGTH || blocks > header->block_count - header->next_block) {
+        return -1;
+    }
+    for (int i = 0; i < FS_MAX_FILES; i++) {
+        FsEntry *entry = &header->entries[i];
+        if (!entry->name[0]) {
+            strcpy(entry->name, name);
+            entry->first_block = header->next_block;
+            entry->blocks = blocks;
+            entry->size = 0;
+            header->next_block += blocks;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Store a file in the image from the host, in place of one with the same
+// name if that has room. Returns 0 if it does not fit.
+int fs_add_file(CocompFs *fs, const char *name, const void *data, long size) {
+    pthread_mutex_lock(&fs->lock);
+    int i = fs_lookup(fs, name);
+    if (i >= 0 && fs->header->entries[i].blocks * FS_BLOCK_SIZE < size) {
+        i = -1;
+    } else if (i < 0) {
+        i = fs_reserve(fs, name, size);
+    }
+    if (i >= 0) {
+        FsEntry *entry = &fs->header->entries[i];
+        memcpy((unsigned char *)fs->header + entry->first_block * FS_BLOCK_SIZE, data, size);
+        entry->size = size;
+    }
+    pthread_mutex_unlock(&fs->lock);
+    if (i < 0) {
+        printf("Cannot add %s to the file system\n", name);
+        return 0;
+    }
+    return 1;
+}
+
+// Mount `fs` in the VM, in place of any it had; the VM takes a reference.
+// Returns 0 if the VM's file table cannot be allocated.
+int mount_fs(Cocomp *cocomp, CocompFs *fs) {
+    unmount_fs(cocomp);
+    CocompFiles *files = allocate_component(sizeof(CocompFiles), "a file table");
+    if (!files) {
+        return 0;
+    }
+    for (int fd = 0; fd < FS_MAX_OPEN; fd++) {
+        files->files[fd].entry = -1;
+    }
+    atomic_fetch_add(&fs->references, 1);
+    files->fs = fs;
+    cocomp->files = files;
+    return 1;
+}
+
+// Close the VM's files and give up its reference to its file system
+void unmount_fs(Cocomp *cocomp) {
+    CocompFiles *files = cocomp->files;
+    if (!files) {
+        return;
+    }
+    release_fs(files->fs);
+    free_component(cocomp, files);
+    cocomp->files = NULL;
+}
+
+// Open the file called `name` for FS_READ and/or FS_WRITE, creating it if
+// FS_CREATE is given. Returns the descriptor, or -1.
+int fs_open(Cocomp *cocomp, const char *name, int flags) {
+    CocompFiles *files = cocomp->files;
+    if (!files) {
+        report_error(cocomp, COCOMP_NO_FILE_SYSTEM, "No file system mounted\n");
+        return -1;
+    }
+    CocompFs *fs = files->fs;
+    pthread_mutex_lock(&fs->lock);
+    int entry = fs_lookup(fs, name);
+    if (entry < 0 && (flags & FS_CREATE)) {
+        entry = fs_reserve(fs, name, FS_DEFAULT_FILE_SIZE);
+    }
+    pthread_mutex_unlock(&fs->lock);
+    if (entry < 0) {
+        if (flags & FS_CREATE) {
+            report_error(cocomp, COCOMP_FILE_SYSTEM_FULL, "Cannot create file %s\n", name);
+        } else {
+            report_error(cocomp, COCOMP_NO_FILE, "No file %s\n", name);
+        }
+        return -1;
+    }
+    for (int fd = 0; fd < FS_MAX_OPEN; fd++) {
+        FsOpenFile *file = &files->files[fd];
+        if (file->entry < 0) {
+            file->entry = entry;
+            file->flags = flags;
+            file->position = 0;
+            file->sequential_end = 0;
+            file->readahead_end = 0;
+            return fd;
+        }
+    }
+    report_error(cocomp, COCOMP_BAD_FILE, "Too many open files\n");
+    return -1;
+}
+
+// Open file `fd` if it allows `access`, or NULL
+static FsOpenFile *open_file(Cocomp *cocomp, int fd, int access) {
+    CocompFiles *files = cocomp->files;
+    if (!files) {
+        report_error(cocomp, COCOMP_NO_FILE_SYSTEM, "No file system mounted\n");
+        return NULL;
+    }
+    if (fd < 0 || fd >= FS_MAX_OPEN || files->files[fd].entry < 0 || (access & ~files->files[fd].flags)) {
+        report_error(cocomp, COCOMP_BAD_FILE, "Bad file descriptor %d\n", fd);
+        return NULL;
+    }
+    return &files->files[fd];
+}
+
+// Guest pages can take image pages when they are whole host pages kept in
+// anonymous swap. A swap file has to hold the data itself.
+static int fs_can_map_pages(Cocomp *cocomp) {
+    return VM_PAGE_SIZE(cocomp) % sysconf(_SC_PAGESIZE) == 0 && (!cocomp->paging || cocomp->paging->swap_fd < 0);
+}
+
+// READ a whole guest page without copying: if the page at `address` is not
+// resident, its place in swap becomes a private mapping of the image bytes
+// at `data`, and they are copied out of the host's page cache only if the
+// guest faults the page in. Until then the page shows later writes to those
+// bytes of the image. Returns 0 if the page has to be copied instead.
+static int map_image_page(Cocomp *cocomp, CocompFs *fs, const unsigned char *data, int address) {
+    size_t offset = data - (unsigned char *)fs->header;
+    long page = address >> VM_PAGE_SHIFT(cocomp);
+    if (offset % sysconf(_SC_PAGESIZE) != 0 || address < 0 || page >= cocomp->virtual_pages ||
+        (!cocomp->paging && address < cocomp->memory_size)) {
+        return 0;
+    }
+    CocompPaging *paging = get_paging(cocomp);
+    if (!paging || !get_swap(cocomp)) {
+        return 0;
+    }
+    PageDirectoryEntry *directory = &paging->page_directory[page / PAGE_TABLE_ENTRIES];
+    if (directory->resident > 0 && directory->table[page % PAGE_TABLE_ENTRIES] != INVALID_PAGE) {
+        return 0;
+    }
+    unsigned char *target = &paging->swap[page * VM_PAGE_SIZE(cocomp)];
+    if (mmap(target, VM_PAGE_SIZE(cocomp), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fs->fd, offset) == MAP_FAILED) {
+        // The old page may be gone; the copy that follows overwrites all of it
+        mmap(target, VM_PAGE_SIZE(cocomp), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        return 0;
+    }
+    paging->backing_store_used = 1;
+    return 1;
+}
+
+// Copy up to `length` bytes from the file's position into guest memory at
+// `address`, mapping whole guest pages where map_image_page can. Returns
+// the bytes read (0 at the end of the file), or -1.
+long fs_read(Cocomp *cocomp, int fd, int address, long length) {
+    FsOpenFile *file = open_file(cocomp, fd, FS_READ);
+    if (!file) {
+        return -1;
+    }
+    CocompFiles *files = cocomp->files;
+    CocompFs *fs = files->fs;
+    FsEntry *entry = &fs->header->entries[file->entry];
+    if (length > entry->size - file->position) length = entry->size - file->position;
+    if (length > INT_MAX - (long)address) length = INT_MAX - (long)address;
+    if (length <= 0) {
+        return 0;
+    }
+    unsigned char *image = (unsigned char *)fs->header;
+    long start = entry->first_block * FS_BLOCK_SIZE + file->position;
+    if (file->position == file->sequential_end && start + length + FS_READAHEAD > file->readahead_end) {
+        long from = (start + length) / FS_READAHEAD * FS_READAHEAD;
+        long to = from + 2 * FS_READAHEAD;
+        if (to > (long)fs->size) to = fs->size;
+        if (from < to) madvise(image + from, to - from, MADV_WILLNEED);
+        file->readahead_end = to;
+    }
+    int page_size = VM_PAGE_SIZE(cocomp);
+    int map_pages = fs_can_map_pages(cocomp);
+    long done = 0;
+    while (done < length) {
+        long chunk = length - done;
+        int target = address + done;
+        if (map_pages) {
+            if (chunk > page_size - (target & (page_size - 1))) chunk = page_size - (target & (page_size - 1));
+            if (chunk == page_size && map_image_page(cocomp, fs, image + start + done, target)) {
+                files->zero_copy_pages++;
+                done += chunk;
+                continue;
+            }
+        }
+        if (!mmu_write(cocomp, target, image + start + done, chunk)) {
+            report_error(cocomp, COCOMP_INVALID_ADDRESS, "Invalid memory address %d\n", target);
+            break;
+        }
+        files->copied_bytes += chunk;
+        done += chunk;
+    }
+    file->position += done;
+    file->sequential_end = file->position;
+    return done ? done : -1;
+}
+
+// Copy `length` bytes of guest memory at `address` to the file's position,
+// as far as the space reserved for the file allows. Returns the bytes
+// written, or -1.
+long fs_write(Cocomp *cocomp, int fd, int address, long length) {
+    FsOpenFile *file = open_file(cocomp, fd, FS_WRITE);
+    if (!file) {
+        return -1;
+    }
+    CocompFs *fs = cocomp->files->fs;
+    FsEntry *entry = &fs->header->entries[file->entry];
+    long room = entry->blocks * FS_BLOCK_SIZE - file->position;
+    if (length > room) length = room;
+    if (length > INT_MAX) length = INT_MAX;
+    if (length <= 0) {
+        if (room <= 0) {
+            report_error(cocomp, COCOMP_FILE_SYSTEM_FULL, "File %s is full\n", entry->name);
+            return -1;
+        }
+        return 0;
+    }
+    unsigned char *data = (unsigned char *)fs->header + entry->first_block * FS_BLOCK_SIZE + file->position;
+    if (!mmu_read(cocomp, address, data, length)) {
+        report_error(cocomp, COCOMP_INVALID_ADDRESS, "Invalid memory address %d\n", address);
+        return -1;
+    }
+    file->position += length;
+    if (file->position > entry->size) {
+        entry->size = file->position;
+    }
+    return length;
+}
+
+// Move the file's position, as lseek does, within the space reserved for
+// the file. Returns the new position, or -1.
+long fs_seek(Cocomp *cocomp, int fd, long offset, int whence) {
+    FsOpenFile *file = open_file(cocomp, fd, 0);
+    if (!file) {
+        return -1;
+    }
+    FsEntry *entry = &cocomp->files->fs->header->entries[file->entry];
+    long position = offset;
+    if (whence == SEEK_CUR) {
+        position += file->position;
+    } else if (whence == SEEK_END) {
+        position += entry->size;
+    } else if (whence != SEEK_SET) {
+        position = -1;
+    }
+    if (position < 0 || position > entry->blocks * FS_BLOCK_SIZE) {
+        report_error(cocomp, COCOMP_BAD_FILE, "Invalid seek to %ld in %s\n", position, entry->name);
+        return -1;
+    }
+    file->position = position;
+    return position;
+}
+
+int fs_close(Cocomp *cocomp, int fd) {
+    FsOpenFile *file = open_file(cocomp, fd, 0);
+    if (!file) {
+        return -1;
+    }
+    file->entry = -1;
+    return 0;
 }
 
 void exception_handling(Cocomp *cocomp, const char *error_message) {
@@ -420,90 +8398,375 @@ void exception_handling(Cocomp *cocomp, const char *error_message) {
     cocomp->instruction_pointer = 0;
 }
 
-void ipc_send(Cocomp *cocomp, int process_id, int message) {
-    if (process_id < 0 || process_id >= 10) {
-        printf("Invalid process ID for IPC\n");
-        return;
+// A channel for up to `capacity` messages, rounded up to a power of two.
+// The caller holds one reference, given up with release_channel once the
+// channel is attached where it is needed.
+IpcChannel *create_channel(int capacity, int kind) {
+    if (capacity < 1 || capacity > 1 << 24) {
+        printf("Invalid channel capacity %d\n", capacity);
+        return NULL;
+    }
+    size_t slots = 2;
+    while (slots < (size_t)capacity) {
+        slots *= 2;
+    }
+    size_t size = ROUND_TO_CACHE_LINE(sizeof(IpcChannel)) + slots * sizeof(double);
+    if (kind == IPC_MPMC) {
+        size += slots * sizeof(atomic_size_t);
+    }
+    IpcChannel *channel = allocate_component(size, "a channel");
+    if (!channel) {
+        return NULL;
+    }
+    channel->kind = kind;
+    channel->mask = slots - 1;
+    channel->messages = (double *)((unsigned char *)channel + ROUND_TO_CACHE_LINE(sizeof(IpcChannel)));
+    if (kind == IPC_MPMC) {
+        channel->sequences = (atomic_size_t *)(channel->messages + slots);
+        for (size_t i = 0; i < slots; i++) {
+            atomic_init(&channel->sequences[i], i);
+        }
+    }
+    atomic_init(&channel->references, 1);
+    return channel;
+}
+
+void release_channel(IpcChannel *channel) {
+    if (channel && atomic_fetch_sub(&channel->references, 1) == 1) {
+        free(channel);
+    }
+}
+
+// Slots from `position` on that an MPMC sender (receiving 0) or receiver
+// (receiving 1) can claim, up to `count`: each slot's sequence says whether
+// the other side is done with it.
+static int mpmc_available(IpcChannel *channel, size_t position, int count, int receiving) {
+    int n = 0;
+    while (n < count &&
+           atomic_load_explicit(&channel->sequences[(position + n) & channel->mask], memory_order_acquire) ==
+               position + n + receiving) {
+        n++;
+    }
+    return n;
+}
+
+// Send up to `count` messages, as many as there is room for, in order.
+// Returns the number sent.
+int channel_send(IpcChannel *channel, const double *messages, int count) {
+    size_t capacity = channel->mask + 1;
+    if (channel->kind == IPC_SPSC) {
+        size_t head = atomic_load_explicit(&channel->head, memory_order_relaxed);
+        if (head - channel->cached_tail + count > capacity) {
+            channel->cached_tail = atomic_load_explicit(&channel->tail, memory_order_acquire);
+        }
+        size_t room = capacity - (head - channel->cached_tail);
+        size_t n = (size_t)count < room ? (size_t)count : room;
+        for (size_t i = 0; i < n; i++) {
+            channel->messages[(head + i) & channel->mask] = messages[i];
+        }
+        atomic_store_explicit(&channel->head, head + n, memory_order_release);
+        return n;
+    }
+    size_t head = atomic_load_explicit(&channel->head, memory_order_relaxed);
+    int n;
+    for (;;) {
+        n = mpmc_available(channel, head, count, 0);
+        if (n == 0) {
+            // Full, unless another sender claimed the slot first
+            size_t sequence = atomic_load_explicit(&channel->sequences[head & channel->mask], memory_order_acquire);
+            if (sequence < head + 1) return 0;
+            head = atomic_load_explicit(&channel->head, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&channel->head, &head, head + n,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            break;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        channel->messages[(head + i) & channel->mask] = messages[i];
+        atomic_store_explicit(&channel->sequences[(head + i) & channel->mask], head + i + 1, memory_order_release);
+    }
+    return n;
+}
+
+// Receive up to `count` messages, as many as are waiting, in the order they
+// were sent. Returns the number received.
+int channel_receive(IpcChannel *channel, double *messages, int count) {
+    if (channel->kind == IPC_SPSC) {
+        size_t tail = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+        if (channel->cached_head - tail < (size_t)count) {
+            channel->cached_head = atomic_load_explicit(&channel->head, memory_order_acquire);
+        }
+        size_t waiting = channel->cached_head - tail;
+        size_t n = (size_t)count < waiting ? (size_t)count : waiting;
+        for (size_t i = 0; i < n; i++) {
+            messages[i] = channel->messages[(tail + i) & channel->mask];
+        }
+        atomic_store_explicit(&channel->tail, tail + n, memory_order_release);
+        return n;
     }
-    cocomp->inter_process_comm[process_id] = message;
-    printf("IPC message sent to process %d: %d\n", process_id, message);
+    size_t tail = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+    int n;
+    for (;;) {
+        n = mpmc_available(channel, tail, count, 1);
+        if (n == 0) {
+            size_t sequence = atomic_load_explicit(&channel->sequences[tail & channel->mask], memory_order_acquire);
+            if (sequence < tail + 2) return 0;
+            tail = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&channel->tail, &tail, tail + n,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            break;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        messages[i] = channel->messages[(tail + i) & channel->mask];
+        atomic_store_explicit(&channel->sequences[(tail + i) & channel->mask], tail + i + channel->mask + 1,
+                              memory_order_release);
+    }
+    return n;
+}
+
+int channel_has_room(IpcChannel *channel) {
+    size_t head = atomic_load_explicit(&channel->head, memory_order_relaxed);
+    if (channel->kind == IPC_SPSC) {
+        return head - atomic_load_explicit(&channel->tail, memory_order_acquire) <= channel->mask;
+    }
+    return mpmc_available(channel, head, 1, 0);
+}
+
+int channel_has_message(IpcChannel *channel) {
+    size_t tail = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+    if (channel->kind == IPC_SPSC) {
+        return atomic_load_explicit(&channel->head, memory_order_acquire) != tail;
+    }
+    return mpmc_available(channel, tail, 1, 1);
+}
+
+// Make `channel` the VM's endpoint for sending to (receive == 0) or
+// receiving from `process_id`, in place of any it had. The VM takes a
+// reference. Returns 0 if the process ID is out of range.
+int ipc_attach(Cocomp *cocomp, int process_id, IpcChannel *channel, int receive) {
+    if (process_id < 0 || process_id >= IPC_MAILBOXES) {
+        report_error(cocomp, COCOMP_INVALID_PROCESS, "Invalid process ID for IPC\n");
+        return 0;
+    }
+    CocompIpc *ipc = get_ipc(cocomp);
+    if (!ipc) {
+        return 0;
+    }
+    IpcChannel **endpoint = receive ? &ipc->receive_channels[process_id] : &ipc->send_channels[process_id];
+    atomic_fetch_add(&channel->references, 1);
+    release_channel(*endpoint);
+    *endpoint = channel;
+    return 1;
+}
+
+// An SPSC channel each way between two VMs, by their process IDs. Each VM
+// may run on its own host thread.
+int ipc_connect(Cocomp *a, Cocomp *b, int capacity) {
+    IpcChannel *to_b = create_channel(capacity, IPC_SPSC);
+    IpcChannel *to_a = create_channel(capacity, IPC_SPSC);
+    int connected = to_b && to_a &&
+                    ipc_attach(a, b->process_id, to_b, 0) && ipc_attach(b, a->process_id, to_b, 1) &&
+                    ipc_attach(b, a->process_id, to_a, 0) && ipc_attach(a, b->process_id, to_a, 1);
+    release_channel(to_b);
+    release_channel(to_a);
+    return connected;
+}
+
+// The VM's endpoint for `process_id`, made on first use as one channel for
+// both directions if the VM was not connected there. NULL if the process ID
+// is out of range.
+IpcChannel *ipc_channel(Cocomp *cocomp, int process_id, int receive) {
+    if (process_id < 0 || process_id >= IPC_MAILBOXES) {
+        report_error(cocomp, COCOMP_INVALID_PROCESS, "Invalid process ID for IPC\n");
+        return NULL;
+    }
+    CocompIpc *ipc = get_ipc(cocomp);
+    if (!ipc) {
+        return NULL;
+    }
+    IpcChannel *channel = receive ? ipc->receive_channels[process_id] : ipc->send_channels[process_id];
+    if (!channel) {
+        channel = create_channel(IPC_DEFAULT_CAPACITY, IPC_SPSC);
+        if (!channel) {
+            return NULL;
+        }
+        if (!ipc->send_channels[process_id]) ipc_attach(cocomp, process_id, channel, 0);
+        if (!ipc->receive_channels[process_id]) ipc_attach(cocomp, process_id, channel, 1);
+        release_channel(channel);
+        channel = receive ? ipc->receive_channels[process_id] : ipc->send_channels[process_id];
+    }
+    return channel;
+}
+
+// Returns 1 if the message was sent, 0 if the channel is full.
+int ipc_send(Cocomp *cocomp, int process_id, int message) {
+    IpcChannel *channel = ipc_channel(cocomp, process_id, 0);
+    double value = message;
+    if (!channel) {
+        return 0;
+    }
+    if (!channel_send(channel, &value, 1)) {
+        report_error(cocomp, COCOMP_CHANNEL_FULL, "IPC channel to process %d is full\n", process_id);
+        return 0;
+    }
+    console_print(cocomp, "IPC message sent to process %d: %d\n", process_id, message);
+    return 1;
 }
 
+// The next message from `process_id`, or -1 if there is none.
 int ipc_receive(Cocomp *cocomp, int process_id) {
-    if (process_id < 0 || process_id >= 10) {
-        printf("Invalid process ID for IPC\n");
+    IpcChannel *channel = ipc_channel(cocomp, process_id, 1);
+    double value;
+    if (!channel) {
+        return -1;
+    }
+    if (!channel_receive(channel, &value, 1)) {
+        report_error(cocomp, COCOMP_CHANNEL_EMPTY, "No IPC message from process %d\n", process_id);
         return -1;
     }
-    int message = cocomp->inter_process_comm[process_id];
-    printf("IPC message received from process %d: %d\n", process_id, message);
-    return message;
+    console_print(cocomp, "IPC message received from process %d: %d\n", process_id, (int)value);
+    return value;
+}
+
+// Many messages per call and nothing printed. Both return the number of
+// messages moved, which is less than `count` when the channel fills up or
+// runs dry.
+int ipc_send_batch(Cocomp *cocomp, int process_id, const double *messages, int count) {
+    IpcChannel *channel = ipc_channel(cocomp, process_id, 0);
+    return channel ? channel_send(channel, messages, count) : 0;
+}
+
+int ipc_receive_batch(Cocomp *cocomp, int process_id, double *messages, int count) {
+    IpcChannel *channel = ipc_channel(cocomp, process_id, 1);
+    return channel ? channel_receive(channel, messages, count) : 0;
 }
 
+// Load `code` through the module cache and run it, so code loaded again,
+// by this VM or any other, is neither kept twice nor decoded again.
 void load_dynamic_code(Cocomp *cocomp, unsigned char *code, int size) {
-    if (size > sizeof(cocomp->dynamic_code_area)) {
-        printf("Dynamic code size exceeds allocated space!\n");
+    CocompModule *module = module_from_code(code, size);
+    if (!module) {
         return;
     }
-    memcpy(cocomp->dynamic_code_area, code, size);
-    printf("Dynamic code loaded\n");
-    // Simulate execution of dynamic code
-    load_program(cocomp, cocomp->dynamic_code_area, size);
-    execute_program(cocomp);
+    console_print(cocomp, "Dynamic code loaded\n");
+    int loaded = load_module(cocomp, module);
+    release_module(module);
+    if (loaded == 0) {
+        execute_program(cocomp);
+    }
 }
 
 void initialize_neural_network(Cocomp *cocomp) {
+    CocompNetwork *network = cocomp->network;
+    if (!network) {
+        get_network(cocomp);  // initializes the network it creates
+        return;
+    }
     // Initialize neurons and synapses to random values or zero
-    for (int i = 0; i < INPUT_LAYER_SIZE; i++) {
-        cocomp->input_layer[i] = 0.0;
+    for (int i = 0; i < cocomp->input_layer_size; i++) {
+        network->input_layer[i] = 0.0;
     }
-    for (int i = 0; i < HIDDEN_LAYER_SIZE; i++) {
-        cocomp->hidden_layer[i] = 0.0;
-        cocomp->biases_hidden[i] = (rand() / (double)RAND_MAX - 0.5) * 2.0;
+    for (int i = 0; i < cocomp->hidden_layer_size; i++) {
+        network->hidden_layer[i] = 0.0;
+        network->biases_hidden[i] = (rand() / (double)RAND_MAX - 0.5) * 2.0;
     }
-    for (int i = 0; i < OUTPUT_LAYER_SIZE; i++) {
-        cocomp->output_layer[i] = 0.0;
-        cocomp->biases_output[i] = (rand() / (double)RAND_MAX - 0.5) * 2.0;
+    for (int i = 0; i < cocomp->output_layer_size; i++) {
+        network->output_layer[i] = 0.0;
+        network->biases_output[i] = (rand() / (double)RAND_MAX - 0.5) * 2.0;
     }
-    for (int i = 0; i < INPUT_LAYER_SIZE * HIDDEN_LAYER_SIZE; i++) {
-        cocomp->weights_input_hidden[i] = (rand() / (double)RAND_MAX - 0.5) * 2.0;
+    for (int i = 0; i < cocomp->input_layer_size * cocomp->hidden_layer_size; i++) {
+        network->weights_input_hidden[i] = (rand() / (double)RAND_MAX - 0.5) * 2.0;
     }
-    for (int i = 0; i < HIDDEN_LAYER_SIZE * OUTPUT_LAYER_SIZE; i++) {
-        cocomp->weights_hidden_output[i] = (rand() / (double)RAND_MAX - 0.5) * 2.0;
+    for (int i = 0; i < cocomp->hidden_layer_size * cocomp->output_layer_size; i++) {
+        network->weights_hidden_output[i] = (rand() / (double)RAND_MAX - 0.5) * 2.0;
     }
-    printf("Neural network initialized\n");
+    console_print(cocomp, "Neural network initialized\n");
 }
 
 void forward_pass(Cocomp *cocomp) {
+    CocompNetwork *network = get_network(cocomp);
+    if (!network) {
+        return;
+    }
     // Feedforward pass through the network
-    for (int i = 0; i < HIDDEN_LAYER_SIZE; i++) {
-        cocomp->hidden_layer[i] = 0.0;
-        for (int j = 0; j < INPUT_LAYER_SIZE; j++) {
-            cocomp->hidden_layer[i] += cocomp->input_layer[j] * cocomp->weights_input_hidden[j * HIDDEN_LAYER_SIZE + i];
+    for (int i = 0; i < cocomp->hidden_layer_size; i++) {
+        network->hidden_layer[i] = 0.0;
+        for (int j = 0; j < cocomp->input_layer_size; j++) {
+            network->hidden_layer[i] += network->input_layer[j] * network->weights_input_hidden[j * cocomp->hidden_layer_size + i];
         }
-        cocomp->hidden_layer[i] += cocomp->biases_hidden[i];
-        cocomp->hidden_layer[i] = 1.0 / (1.0 + exp(-cocomp->hidden_layer[i])); // Sigmoid activation
+        network->hidden_layer[i] += network->biases_hidden[i];
+        network->hidden_layer[i] = 1.0 / (1.0 + exp(-network->hidden_layer[i])); // Sigmoid activation
     }
 
-    for (int i = 0; i < OUTPUT_LAYER_SIZE; i++) {
-        cocomp->output_layer[i] = 0.0;
-        for (int j = 0; j < HIDDEN_LAYER_SIZE; j++) {
-            cocomp->output_layer[i] += cocomp->hidden_layer[j] * cocomp->weights_hidden_output[j * OUTPUT_LAYER_SIZE + i];
+    for (int i = 0; i < cocomp->output_layer_size; i++) {
+        network->output_layer[i] = 0.0;
+        for (int j = 0; j < cocomp->hidden_layer_size; j++) {
+            network->output_layer[i] += network->hidden_layer[j] * network->weights_hidden_output[j * cocomp->output_layer_size + i];
         }
-        cocomp->output_layer[i] += cocomp->biases_output[i];
-        cocomp->output_layer[i] = 1.0 / (1.0 + exp(-cocomp->output_layer[i])); // Sigmoid activation
+        network->output_layer[i] += network->biases_output[i];
+        network->output_layer[i] = 1.0 / (1.0 + exp(-network->output_layer[i])); // Sigmoid activation
     }
 }
 
 void backward_pass(Cocomp *cocomp, double *target_output) {
+    CocompNetwork *network = get_network(cocomp);
+    if (!network) {
+        return;
+    }
     // Simple backpropagation for learning
-    double output_errors[OUTPUT_LAYER_SIZE];
-    double hidden_errors[HIDDEN_LAYER_SIZE];
+    double output_errors[cocomp->output_layer_size];
+    double hidden_errors[cocomp->hidden_layer_size];
 
-    for (int i = 0; i < OUTPUT_LAYER_SIZE; i++) {
-        double error = target_output[i] - cocomp->output_layer[i];
-        output_errors[i] = error * cocomp->output_layer[i] * (1 - cocomp->output_layer[i]);
+    for (int i = 0; i < cocomp->output_layer_size; i++) {
+        double error = target_output[i] - network->output_layer[i];
+        output_errors[i] = error * network->output_layer[i] * (1 - network->output_layer[i]);
     }
 
-    for (int i = 0; i < HIDDEN_LAYER_SIZE; i++) {
+    for (int i = 0; i < cocomp->hidden_layer_size; i++) {
         hidden_errors[i] = 0.0;
-        for (i
+        for (int j = 0; j < cocomp->output_layer_size; j++) {
+            hidden_errors[i] += output_errors[j] * network->weights_hidden_output[i * cocomp->output_layer_size + j];
+        }
+        hidden_errors[i] *= network->hidden_layer[i] * (1 - network->hidden_layer[i]);
+    }
+
+    for (int i = 0; i < cocomp->hidden_layer_size; i++) {
+        for (int j = 0; j < cocomp->output_layer_size; j++) {
+            network->weights_hidden_output[i * cocomp->output_layer_size + j] += LEARNING_RATE * output_errors[j] * network->hidden_layer[i];
+        }
+    }
+
+    for (int i = 0; i < cocomp->input_layer_size; i++) {
+        for (int j = 0; j < cocomp->hidden_layer_size; j++) {
+            network->weights_input_hidden[i * cocomp->hidden_layer_size + j] += LEARNING_RATE * hidden_errors[j] * network->input_layer[i];
+        }
+    }
+
+    for (int i = 0; i < cocomp->hidden_layer_size; i++) {
+        network->biases_hidden[i] += LEARNING_RATE * hidden_errors[i];
+    }
+
+    for (int i = 0; i < cocomp->output_layer_size; i++) {
+        network->biases_output[i] += LEARNING_RATE * output_errors[i];
+    }
+}
+
+void train_neural_network(Cocomp *cocomp, double *inputs, double *targets, int num_samples, int epochs) {
+    CocompNetwork *network = get_network(cocomp);
+    if (!network) {
+        return;
+    }
+    for (int epoch = 0; epoch < epochs; epoch++) {
+        for (int i = 0; i < num_samples; i++) {
+            memcpy(network->input_layer, inputs, cocomp->input_layer_size * sizeof(double));
+            forward_pass(cocomp);
+            backward_pass(cocomp, targets);
+        }
+    }
+    console_print(cocomp, "Neural network training completed\n");
+}